@@ -5,10 +5,17 @@
 #import <MumbleKit/MKAudio.h>
 #import "MKUtils.h"
 #import "MKAudioDevice.h"
+#import "MKHeadlessAudioDevice.h"
 #import "MKAudioInput.h"
 #import "MKAudioOutput.h"
 #import "MKAudioOutputSidetone.h"
+#import "MKVoicePacket.h"
+#import "MKAudioLatency.h"
+#import "MKAudioProfiler.h"
+#import "MKAudioTalkState.h"
+#import "MKAudioLiveSettings.h"
 #import <MumbleKit/MKConnection.h>
+#import <MumbleKit/MKAudioRecorder.h>
 
 #if TARGET_OS_IPHONE == 1
 # import "MKVoiceProcessingDevice.h"
@@ -22,6 +29,9 @@
 #import <AudioUnit/AUComponent.h>
 #import <AudioToolbox/AudioToolbox.h>
 
+#include <sched.h>
+#include <stdatomic.h>
+
 #if TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR
 #import <UIKit/UIKit.h>
 #endif
@@ -34,11 +44,52 @@ NSString *MKAudioDidRestartNotification = @"MKAudioDidRestartNotification";
     MKAudioInput             *_audioInput;
     MKAudioOutput            *_audioOutput;
     MKAudioOutputSidetone    *_sidetoneOutput;
-    MKConnection             *_connection;
+    MKConnection             *_connections[MK_AUDIO_MAX_CONNECTIONS];
+    float                    _connectionVolumes[MK_AUDIO_MAX_CONNECTIONS];
+    NSUInteger               _voiceTargets[MK_AUDIO_MAX_CONNECTIONS];
+    NSUInteger               _localSessions[MK_AUDIO_MAX_CONNECTIONS];
+    NSUInteger               _loopbackKey;
+    NSUInteger               _mainConnection;
     MKAudioSettings          _audioSettings;
+    MKAudioSettings          _runningSettings;
     BOOL                     _running;
+    uint64_t                 _startTime;
+    uint64_t                 _startDuration;
+    float                    _listenerPosition[3];
+    float                    _listenerFront[3];
+    float                    _listenerTop[3];
+    NSMutableIndexSet        *_localMutes;
+    NSMutableDictionary      *_localVolumes;
+    BOOL                     _selfDeafened;
+    MKAudioPCMSink           _headlessOutputSink;
+    MKAudioUserPCMSink       _userOutputSink;
+    int                      _headlessInputFd;
+    MKAudioRecorder          *_recorder;
+
+    // The receive path runs on the connections' threads for every voice
+    // packet, and reads these mirrors instead of taking the lock. It counts
+    // itself in _receivers while it uses the output and the recorder, and
+    // whoever replaces those waits for the count to drain before releasing
+    // the old ones.
+    _Atomic(void *)          _receiveOutput;
+    _Atomic(void *)          _receiveRecorder;
+    _Atomic uintptr_t        _receiveConnections[MK_AUDIO_MAX_CONNECTIONS];
+    _Atomic NSUInteger       _receivers;
+    BOOL                     _latencyLoopback;
+    dispatch_source_t        _talkStateTimer;
+    NSMutableSet             *_talkingSessions;
+    NSUInteger               _talkStateDropped;
 }
 - (BOOL) _audioShouldBeRunning;
+- (void) drainTalkStateEvents;
+- (void) postTalkStateEvents:(MKAudioTalkStateEvent *)events count:(NSUInteger)n seen:(NSMutableSet *)seen;
+- (NSUInteger) slotForConnection:(MKConnection *)conn;
+- (void) publishConnections;
+- (void) publishLoopbackSession;
+- (void) waitForReceivers;
+- (NSUInteger) receiveSlotForConnection:(MKConnection *)conn;
+- (void) receiveVoicePacket:(MKVoicePacket *)packet forKey:(NSUInteger)key sequence:(NSUInteger)seq type:(MKUDPMessageType)msgType;
+- (void) clearLocalSettingsForSlot:(NSUInteger)slot;
 @end
 
 #if TARGET_OS_IPHONE == 1
@@ -130,11 +181,24 @@ static void MKAudio_AudioRouteChangedCallback(MKAudio *audio, AudioSessionProper
     }
 }
 
+// Ask for 5ms hardware buffers in low latency mode. The default is
+// around 23ms.
+static void MKAudio_SetPreferredIOBufferDuration(const MKAudioSettings *settings) {
+    Float32 duration = settings->enableLowLatency ? 0.005f : 0.023f;
+    OSStatus err = AudioSessionSetProperty(kAudioSessionProperty_PreferredHardwareIOBufferDuration, sizeof(Float32), &duration);
+    if (err != kAudioSessionNoError) {
+        NSLog(@"MKAudio: unable to set preferred IO buffer duration.");
+    }
+}
+
 static void MKAudio_SetupAudioSession(MKAudio *audio) {
     OSStatus err;
     UInt32 val, valSize;
     Float64 fval;
     BOOL audioInputAvailable = YES;
+    MKAudioSettings settings;
+
+    [audio readAudioSettings:&settings];
     
     // Initialize Audio Session
     err = AudioSessionInitialize(CFRunLoopGetMain(), kCFRunLoopDefaultMode, MKAudio_InterruptCallback, audio);
@@ -182,8 +246,6 @@ static void MKAudio_SetupAudioSession(MKAudio *audio) {
         // The OverrideCategoryDefaultToSpeaker property makes us output to the speakers of the iOS device
         // as long as there's not a headset connected. However, if the user prefers the audio to be output
         // to the receiver, honor that.
-        MKAudioSettings settings;
-        [audio readAudioSettings:&settings];
         val = 1;
         if (settings.preferReceiverOverSpeaker) {
             val = 0;
@@ -206,6 +268,8 @@ static void MKAudio_SetupAudioSession(MKAudio *audio) {
         NSLog(@"MKAudio: unable to set preferred hardware sample rate.");
         return;
     }
+
+    MKAudio_SetPreferredIOBufferDuration(&settings);
     
     if (audioInputAvailable) {
         // Allow input from Bluetooth devices.
@@ -232,7 +296,9 @@ static void MKAudio_UpdateAudioSessionSettings(MKAudio *audio) {
     OSStatus err;
     UInt32 val, valSize;
     BOOL audioInputAvailable = YES;
-    
+    MKAudioSettings settings;
+
+    [audio readAudioSettings:&settings];
 
     // To be able to select the correct category, we must query whethe audio input is available.
     valSize = sizeof(UInt32);
@@ -247,8 +313,6 @@ static void MKAudio_UpdateAudioSessionSettings(MKAudio *audio) {
         // The OverrideCategoryDefaultToSpeaker property makes us output to the speakers of the iOS device
         // as long as there's not a headset connected. However, if the user prefers the audio to be output
         // to the receiver, honor that.
-        MKAudioSettings settings;
-        [audio readAudioSettings:&settings];
         val = 1;
         if (settings.preferReceiverOverSpeaker) {
             val = 0;
@@ -259,6 +323,8 @@ static void MKAudio_UpdateAudioSessionSettings(MKAudio *audio) {
             return;
         }
     }
+
+    MKAudio_SetPreferredIOBufferDuration(&settings);
 }
 #else
 static void MKAudio_SetupAudioSession(MKAudio *audio) {
@@ -284,6 +350,35 @@ static void MKAudio_UpdateAudioSessionSettings(MKAudio *audio) {
     return audio;
 }
 
+- (id) init {
+    NSUInteger i;
+
+    if ((self = [super init])) {
+        // Until told otherwise, the listener stands at the origin, facing
+        // straight ahead.
+        _listenerFront[2] = 1.0f;
+        _listenerTop[1] = 1.0f;
+
+        _localMutes = [[NSMutableIndexSet alloc] init];
+        _localVolumes = [[NSMutableDictionary alloc] init];
+        _talkingSessions = [[NSMutableSet alloc] init];
+        _selfDeafened = NO;
+        _headlessInputFd = -1;
+        _mainConnection = NSNotFound;
+        _loopbackKey = NSNotFound;
+        for (i = 0; i < MK_AUDIO_MAX_CONNECTIONS; i++) {
+            _connectionVolumes[i] = 1.0f;
+            _voiceTargets[i] = 0;
+            _localSessions[i] = NSNotFound;
+            atomic_init(&_receiveConnections[i], 0);
+        }
+        atomic_init(&_receiveOutput, NULL);
+        atomic_init(&_receiveRecorder, NULL);
+        atomic_init(&_receivers, 0);
+    }
+    return self;
+}
+
 - (void) setDelegate:(id<MKAudioDelegate>)delegate {
     @synchronized(self) {
         _delegate = delegate;
@@ -312,6 +407,22 @@ static void MKAudio_UpdateAudioSessionSettings(MKAudio *audio) {
 - (void) updateAudioSettings:(MKAudioSettings *)settings {
     @synchronized(self) {
         memcpy(&_audioSettings, settings, sizeof(MKAudioSettings));
+        if (_audioSettings.enableLowLatency)
+            _audioSettings.audioPerPacket = 1;
+
+        // Live settings reach the audio threads at their next frame. The
+        // rest waits for a restart.
+        if (_running) {
+            [_audioInput updateSettings:&_audioSettings];
+            [_audioOutput updateSettings:&_audioSettings];
+            [_sidetoneOutput setLocalVolume:_audioSettings.sidetoneVolume];
+        }
+    }
+}
+
+- (BOOL) isRestartNeeded {
+    @synchronized(self) {
+        return _running && MKAudioSettingsRequireRestart(&_runningSettings, &_audioSettings);
     }
 }
 
@@ -346,6 +457,8 @@ static void MKAudio_UpdateAudioSessionSettings(MKAudio *audio) {
     @synchronized(self) {
         [_audioInput release];
         _audioInput = nil;
+        atomic_store(&_receiveOutput, NULL);
+        [self waitForReceivers];
         [_audioOutput release];
         _audioOutput = nil;
         [_audioDevice teardownDevice];
@@ -354,6 +467,16 @@ static void MKAudio_UpdateAudioSessionSettings(MKAudio *audio) {
         [_sidetoneOutput release];
         _sidetoneOutput = nil;
         _running = NO;
+
+        // Pick up whatever the audio threads posted before they stopped.
+        if (_talkStateTimer) {
+            dispatch_source_cancel(_talkStateTimer);
+            dispatch_release(_talkStateTimer);
+            _talkStateTimer = NULL;
+            dispatch_async(dispatch_get_main_queue(), ^{
+                [self drainTalkStateEvents];
+            });
+        }
     }
 #if TARGET_OS_IPHONE == 1
     AudioSessionSetActive(NO);
@@ -363,28 +486,76 @@ static void MKAudio_UpdateAudioSessionSettings(MKAudio *audio) {
 // Start the audio engine
 - (void) start {
 #if TARGET_OS_IPHONE == 1
+    // The buffer duration follows the settings at hand, even if the audio
+    // session was set up before low latency mode was turned on.
+    MKAudioSettings settings;
+    [self readAudioSettings:&settings];
+    MKAudio_SetPreferredIOBufferDuration(&settings);
     AudioSessionSetActive(YES);
 #endif
     @synchronized(self) {
-#if TARGET_OS_IPHONE == 1
-        if ([[MKAudio sharedAudio] echoCancellationAvailable] && _audioSettings.enableEchoCancellation) {
-            _audioDevice = [[MKVoiceProcessingDevice alloc] initWithSettings:&_audioSettings];
+        _startTime = MKAudioLatencyNow();
+
+        // The statistics tables are set up on first use, which should not
+        // happen on an audio thread.
+        MKAudioLatencyBucketLimit(0);
+        MKAudioProfilerBucketLimit(0);
+
+        if (_audioSettings.enableHeadlessAudio) {
+            MKHeadlessAudioDevice *headless = [[MKHeadlessAudioDevice alloc] initWithSettings:&_audioSettings];
+            [headless setOutputSink:_headlessOutputSink];
+            [headless setInputFileDescriptor:_headlessInputFd];
+            _audioDevice = headless;
         } else {
-            _audioDevice = [[MKiOSAudioDevice alloc] initWithSettings:&_audioSettings];
-        }
+#if TARGET_OS_IPHONE == 1
+            if ([[MKAudio sharedAudio] echoCancellationAvailable] && _audioSettings.enableEchoCancellation) {
+                _audioDevice = [[MKVoiceProcessingDevice alloc] initWithSettings:&_audioSettings];
+            } else {
+                _audioDevice = [[MKiOSAudioDevice alloc] initWithSettings:&_audioSettings];
+            }
 #elif TARGET_OS_MAC == 1
-        _audioDevice = [[MKMacAudioDevice alloc] initWithSettings:&_audioSettings];
+            _audioDevice = [[MKMacAudioDevice alloc] initWithSettings:&_audioSettings];
 #else
 # error Missing MKAudioDevice
 #endif
+        }
+        memcpy(&_runningSettings, &_audioSettings, sizeof(MKAudioSettings));
         [_audioDevice setupDevice];
+        // The sidetone must exist before the audio threads look for it. It
+        // is created even when disabled, since it can be turned on live.
+        _sidetoneOutput = [[MKAudioOutputSidetone alloc] initWithSettings:&_audioSettings inputSampleRate:[_audioDevice inputSampleRate]];
         _audioInput = [[MKAudioInput alloc] initWithDevice:_audioDevice andSettings:&_audioSettings];
-        [_audioInput setMainConnectionForAudio:_connection];
+        [self publishConnections];
+        [_audioInput setLoopback:_latencyLoopback];
+        for (NSUInteger slot = 0; slot < MK_AUDIO_MAX_CONNECTIONS; slot++)
+            [_audioInput setVoiceTarget:_voiceTargets[slot] forSlot:slot];
         _audioOutput = [[MKAudioOutput alloc] initWithDevice:_audioDevice andSettings:&_audioSettings];
-        if (_audioSettings.enableSideTone) {
-            _sidetoneOutput = [[MKAudioOutputSidetone alloc] initWithSettings:&_audioSettings];
+        [_audioOutput setListenerPosition:_listenerPosition front:_listenerFront top:_listenerTop];
+        [_audioOutput setDeafened:_selfDeafened];
+        [_audioOutput setUserOutputSink:_userOutputSink];
+        [_localMutes enumerateIndexesUsingBlock:^(NSUInteger session, BOOL *stop) {
+            [_audioOutput setMuted:YES forSession:session];
+        }];
+        for (NSNumber *session in _localVolumes) {
+            [_audioOutput setVolume:[[_localVolumes objectForKey:session] floatValue] forSession:[session unsignedIntegerValue]];
+        }
+        for (NSUInteger slot = 0; slot < MK_AUDIO_MAX_CONNECTIONS; slot++) {
+            if (_connectionVolumes[slot] != 1.0f)
+                [_audioOutput setVolume:_connectionVolumes[slot] forConnectionSlot:slot];
+        }
+        // Voice is only received once the output is fully set up.
+        atomic_store(&_receiveOutput, _audioOutput);
+        if (_talkStateTimer == NULL) {
+            // Talk state changes are delivered at about display rate.
+            _talkStateTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue());
+            dispatch_source_set_timer(_talkStateTimer, DISPATCH_TIME_NOW, NSEC_PER_SEC / 60, NSEC_PER_SEC / 240);
+            dispatch_source_set_event_handler(_talkStateTimer, ^{
+                [self drainTalkStateEvents];
+            });
+            dispatch_resume(_talkStateTimer);
         }
         _running = YES;
+        _startDuration = MKAudioLatencyNow() - _startTime;
     }
 }
 
@@ -397,12 +568,210 @@ static void MKAudio_UpdateAudioSessionSettings(MKAudio *audio) {
     [[NSNotificationCenter defaultCenter] postNotificationName:MKAudioDidRestartNotification object:self];
 }
 
+// Must be called with self locked.
+- (NSUInteger) slotForConnection:(MKConnection *)conn {
+    NSUInteger slot;
+    if (conn == nil)
+        return NSNotFound;
+    for (slot = 0; slot < MK_AUDIO_MAX_CONNECTIONS; slot++) {
+        if (_connections[slot] == conn)
+            return slot;
+    }
+    return NSNotFound;
+}
+
+// Must be called with self locked, after the connections have changed.
+// Hands them to the input, main connection first, and to the receive path.
+- (void) publishConnections {
+    NSMutableArray *conns = [[NSMutableArray alloc] initWithCapacity:MK_AUDIO_MAX_CONNECTIONS];
+    NSUInteger slots[MK_AUDIO_MAX_CONNECTIONS];
+    NSUInteger slot;
+
+    if (_mainConnection != NSNotFound) {
+        slots[[conns count]] = _mainConnection;
+        [conns addObject:_connections[_mainConnection]];
+    }
+    for (slot = 0; slot < MK_AUDIO_MAX_CONNECTIONS; slot++) {
+        if (_connections[slot] != nil && slot != _mainConnection) {
+            slots[[conns count]] = slot;
+            [conns addObject:_connections[slot]];
+        }
+        atomic_store(&_receiveConnections[slot], (uintptr_t)_connections[slot]);
+    }
+    [_audioInput setConnectionsForAudio:conns inSlots:slots];
+    [conns release];
+    [self publishLoopbackSession];
+}
+
+// Must be called with self locked. Loopback measurements are made on the
+// main connection, so only our own user there is looped back. The session
+// is published as a key, like the ones the talkers are known by.
+- (void) publishLoopbackSession {
+    NSUInteger key = NSNotFound;
+    if (_latencyLoopback && _mainConnection != NSNotFound && _localSessions[_mainConnection] != NSNotFound)
+        key = MK_AUDIO_SESSION_KEY(_mainConnection, _localSessions[_mainConnection]);
+    // Publishing drops the measurements in flight, so only do it on changes.
+    if (key == _loopbackKey)
+        return;
+    _loopbackKey = key;
+    MKAudioLatencySetLoopbackSession(key);
+}
+
+// Waits until no receive path can still be using what was unpublished
+// before the call. Receivers never take the lock, and are quick.
+- (void) waitForReceivers {
+    while (atomic_load(&_receivers) != 0)
+        sched_yield();
+}
+
+// Called on a connection's thread. The connection is only compared, never
+// messaged, so it doesn't matter if it is being removed at the same time.
+- (NSUInteger) receiveSlotForConnection:(MKConnection *)conn {
+    NSUInteger slot;
+    for (slot = 0; slot < MK_AUDIO_MAX_CONNECTIONS; slot++) {
+        if (atomic_load_explicit(&_receiveConnections[slot], memory_order_relaxed) == (uintptr_t)conn)
+            return slot;
+    }
+    return NSNotFound;
+}
+
+// Must be called with self locked. Sessions are only meaningful to the
+// connection they came from, so a connection's local playback settings go
+// away with it, and so do its voice target and our own session on it.
+- (void) clearLocalSettingsForSlot:(NSUInteger)slot {
+    NSRange range = NSMakeRange(MK_AUDIO_SESSION_KEY(slot, 0), MK_AUDIO_SESSION_MASK + 1);
+    NSUInteger key;
+
+    for (key = [_localMutes indexGreaterThanOrEqualToIndex:range.location];
+         key != NSNotFound && NSLocationInRange(key, range);
+         key = [_localMutes indexGreaterThanIndex:key]) {
+        [_audioOutput setMuted:NO forSession:key];
+    }
+    [_localMutes removeIndexesInRange:range];
+
+    for (NSNumber *session in [_localVolumes allKeys]) {
+        key = [session unsignedIntegerValue];
+        if (NSLocationInRange(key, range)) {
+            [_localVolumes removeObjectForKey:session];
+            [_audioOutput setVolume:1.0f forSession:key];
+        }
+    }
+
+    if (_connectionVolumes[slot] != 1.0f) {
+        _connectionVolumes[slot] = 1.0f;
+        [_audioOutput setVolume:1.0f forConnectionSlot:slot];
+    }
+
+    _voiceTargets[slot] = 0;
+    [_audioInput setVoiceTarget:0 forSlot:slot];
+    _localSessions[slot] = NSNotFound;
+}
+
+- (void) addConnectionForAudio:(MKConnection *)conn {
+    NSUInteger slot;
+
+    @synchronized(self) {
+        if (conn == nil || [self slotForConnection:conn] != NSNotFound)
+            return;
+        for (slot = 0; slot < MK_AUDIO_MAX_CONNECTIONS; slot++) {
+            if (_connections[slot] == nil)
+                break;
+        }
+        if (slot == MK_AUDIO_MAX_CONNECTIONS) {
+            NSLog(@"MKAudio: too many connections for audio, ignoring %@.", conn);
+            return;
+        }
+        _connections[slot] = [conn retain];
+        if (_mainConnection == NSNotFound)
+            _mainConnection = slot;
+        [self publishConnections];
+    }
+}
+
+- (void) removeConnectionForAudio:(MKConnection *)conn {
+    NSUInteger slot;
+
+    @synchronized(self) {
+        slot = [self slotForConnection:conn];
+        if (slot == NSNotFound)
+            return;
+        [self clearLocalSettingsForSlot:slot];
+        [_connections[slot] release];
+        _connections[slot] = nil;
+
+        // The connection in the lowest slot takes over as main connection.
+        if (_mainConnection == slot) {
+            _mainConnection = NSNotFound;
+            for (slot = 0; slot < MK_AUDIO_MAX_CONNECTIONS; slot++) {
+                if (_connections[slot] != nil) {
+                    _mainConnection = slot;
+                    break;
+                }
+            }
+        }
+        [self publishConnections];
+    }
+}
+
 - (void) setMainConnectionForAudio:(MKConnection *)conn {
     @synchronized(self) {
-        [conn retain];
-        [_audioInput setMainConnectionForAudio:conn];
-        [_connection release];
-        _connection = conn;
+        if (conn == nil) {
+            if (_mainConnection != NSNotFound)
+                [self removeConnectionForAudio:_connections[_mainConnection]];
+            return;
+        }
+        [self addConnectionForAudio:conn];
+        NSUInteger slot = [self slotForConnection:conn];
+        if (slot != NSNotFound) {
+            _mainConnection = slot;
+            [self publishConnections];
+        }
+    }
+}
+
+- (void) connectionDidChangeCodec:(MKConnection *)conn {
+    @synchronized(self) {
+        if (_mainConnection != NSNotFound && _connections[_mainConnection] == conn)
+            [self publishConnections];
+    }
+}
+
+- (NSArray *) connectionsForAudio {
+    NSMutableArray *conns = [NSMutableArray arrayWithCapacity:MK_AUDIO_MAX_CONNECTIONS];
+    NSUInteger slot;
+
+    @synchronized(self) {
+        for (slot = 0; slot < MK_AUDIO_MAX_CONNECTIONS; slot++) {
+            if (_connections[slot] != nil)
+                [conns addObject:_connections[slot]];
+        }
+    }
+    return conns;
+}
+
+- (void) setVolume:(float)volume forConnection:(MKConnection *)conn {
+    @synchronized(self) {
+        NSUInteger slot = [self slotForConnection:conn];
+        if (slot == NSNotFound)
+            return;
+        _connectionVolumes[slot] = volume;
+        [_audioOutput setVolume:volume forConnectionSlot:slot];
+    }
+}
+
+- (float) volumeForConnection:(MKConnection *)conn {
+    @synchronized(self) {
+        NSUInteger slot = [self slotForConnection:conn];
+        return slot != NSNotFound ? _connectionVolumes[slot] : 1.0f;
+    }
+}
+
+- (NSUInteger) sessionKeyForSession:(NSUInteger)session onConnection:(MKConnection *)conn {
+    @synchronized(self) {
+        NSUInteger slot = [self slotForConnection:conn];
+        if (slot == NSNotFound || session > MK_AUDIO_SESSION_MASK)
+            return NSNotFound;
+        return MK_AUDIO_SESSION_KEY(slot, session);
     }
 }
 
@@ -412,6 +781,304 @@ static void MKAudio_UpdateAudioSessionSettings(MKAudio *audio) {
     }
 }
 
+// The voice receive path. Called on a connection's thread for every voice
+// packet, so it doesn't lock.
+- (void) receiveVoicePacket:(MKVoicePacket *)packet forKey:(NSUInteger)key sequence:(NSUInteger)seq type:(MKUDPMessageType)msgType {
+    atomic_fetch_add(&_receivers, 1);
+    MKAudioRecorder *recorder = (MKAudioRecorder *)atomic_load(&_receiveRecorder);
+    MKAudioOutput *output = (MKAudioOutput *)atomic_load(&_receiveOutput);
+    [recorder recordVoicePacket:packet forSession:key sequence:seq type:msgType];
+    [output addVoicePacket:packet forSession:key sequence:seq type:msgType];
+    atomic_fetch_sub(&_receivers, 1);
+}
+
+// Packets that don't say where they came from are from the first
+// connection's slot.
+- (void) addVoicePacket:(MKVoicePacket *)packet forSession:(NSUInteger)session sequence:(NSUInteger)seq type:(MKUDPMessageType)msgType {
+    if (MKAudioLatencyIsLoopbackSession(MK_AUDIO_SESSION_KEY(0, session)))
+        MKAudioLatencyNoteReceived(seq, packet->timestamp);
+    [self receiveVoicePacket:packet forKey:session sequence:seq type:msgType];
+}
+
+- (void) addVoicePacket:(MKVoicePacket *)packet forSession:(NSUInteger)session sequence:(NSUInteger)seq type:(MKUDPMessageType)msgType fromConnection:(MKConnection *)conn {
+    NSUInteger slot = [self receiveSlotForConnection:conn];
+    if (slot == NSNotFound || session > MK_AUDIO_SESSION_MASK)
+        return;
+    NSUInteger key = MK_AUDIO_SESSION_KEY(slot, session);
+    if (MKAudioLatencyIsLoopbackSession(key))
+        MKAudioLatencyNoteReceived(seq, packet->timestamp);
+    [self receiveVoicePacket:packet forKey:key sequence:seq type:msgType];
+}
+
+// Called on the main thread. Collects the talk state changes posted by the
+// audio threads since the last call, and posts a single
+// MKAudioUserTalkStateChanged notification for each user whose state
+// changed, with the user's latest state.
+- (void) drainTalkStateEvents {
+    MKAudioTalkStateEvent events[MK_AUDIO_TALK_STATE_BATCH];
+    MKAudioTalkStateEvent latest[MK_AUDIO_TALK_STATE_BATCH];
+    NSUInteger i, j, n, nlatest = 0;
+
+    // If events were dropped since the last drain, a user may be stuck as
+    // talking. Note who we hear from now, and stop the others below.
+    NSUInteger dropped = MKAudioTalkStateDroppedCount();
+    NSMutableSet *seen = nil;
+    if (dropped != _talkStateDropped) {
+        _talkStateDropped = dropped;
+        seen = [NSMutableSet set];
+    }
+
+    do {
+        n = MKAudioTalkStateDrain(events, MK_AUDIO_TALK_STATE_BATCH);
+        for (i = 0; i < n; i++) {
+            // A user's events may come from different decode threads, so
+            // the timestamp decides which one is the latest.
+            for (j = 0; j < nlatest; j++) {
+                if (latest[j].session == events[i].session)
+                    break;
+            }
+            if (j == nlatest) {
+                // Too many users at once. Post what we have and go on.
+                if (nlatest == MK_AUDIO_TALK_STATE_BATCH) {
+                    [self postTalkStateEvents:latest count:nlatest seen:seen];
+                    nlatest = 0;
+                }
+                latest[nlatest++] = events[i];
+            } else if (events[i].sampleTime >= latest[j].sampleTime) {
+                latest[j] = events[i];
+            }
+        }
+    } while (n == MK_AUDIO_TALK_STATE_BATCH);
+
+    [self postTalkStateEvents:latest count:nlatest seen:seen];
+
+    if (seen != nil) {
+        uint64_t now = MKAudioTalkStateSampleTime(MKAudioLatencyNow());
+        nlatest = 0;
+        for (NSNumber *session in [[_talkingSessions copy] autorelease]) {
+            if ([seen containsObject:session])
+                continue;
+            latest[nlatest].session = [session unsignedIntegerValue];
+            latest[nlatest].state = MKTalkStatePassive;
+            latest[nlatest].sampleTime = now;
+            if (++nlatest == MK_AUDIO_TALK_STATE_BATCH) {
+                [self postTalkStateEvents:latest count:nlatest seen:nil];
+                nlatest = 0;
+            }
+        }
+        [self postTalkStateEvents:latest count:nlatest seen:nil];
+    }
+}
+
+// Called on the main thread.
+- (void) postTalkStateEvents:(MKAudioTalkStateEvent *)events count:(NSUInteger)n seen:(NSMutableSet *)seen {
+    NSNotificationCenter *center = [NSNotificationCenter defaultCenter];
+    NSUInteger j;
+
+    for (j = 0; j < n; j++) {
+        NSUInteger session = events[j].session;
+        NSNumber *key = [NSNumber numberWithUnsignedInteger:session];
+        [seen addObject:key];
+        if (events[j].state == MKTalkStatePassive)
+            [_talkingSessions removeObject:key];
+        else
+            [_talkingSessions addObject:key];
+
+        // Our own talk state is posted without a userSession. Other users'
+        // are posted with their session on the connection they are on.
+        MKConnection *conn = nil;
+        if (session != NSNotFound) {
+            @synchronized(self) {
+                NSUInteger slot = MK_AUDIO_SESSION_SLOT(session);
+                if (slot < MK_AUDIO_MAX_CONNECTIONS)
+                    conn = [[_connections[slot] retain] autorelease];
+            }
+            // The connection is gone, and so is the user.
+            if (conn == nil) {
+                [_talkingSessions removeObject:key];
+                continue;
+            }
+        }
+
+        NSMutableDictionary *talkStateDict = [[NSMutableDictionary alloc] initWithCapacity:4];
+        [talkStateDict setObject:[NSNumber numberWithUnsignedInteger:events[j].state] forKey:@"talkState"];
+        [talkStateDict setObject:[NSNumber numberWithUnsignedLongLong:events[j].sampleTime] forKey:@"sampleTime"];
+        if (session != NSNotFound) {
+            [talkStateDict setObject:[NSNumber numberWithUnsignedInteger:session & MK_AUDIO_SESSION_MASK] forKey:@"userSession"];
+            [talkStateDict setObject:conn forKey:@"connection"];
+        }
+        [center postNotificationName:@"MKAudioUserTalkStateChanged" object:talkStateDict];
+        [talkStateDict release];
+    }
+}
+
+- (void) getLatencyHistogram:(MKAudioLatencyHistogram *)histogram forStage:(MKAudioLatencyStage)stage {
+    MKAudioLatencyGetHistogram(stage, histogram);
+}
+
+- (double) latencyPercentile:(double)percentile forStage:(MKAudioLatencyStage)stage {
+    MKAudioLatencyHistogram hist;
+    NSUInteger i, seen = 0;
+
+    MKAudioLatencyGetHistogram(stage, &hist);
+    if (hist.count == 0)
+        return 0.0;
+
+    NSUInteger wanted = (NSUInteger) ceil(MIN(MAX(percentile, 0.0), 1.0) * hist.count);
+    for (i = 0; i < MK_AUDIO_LATENCY_BUCKETS; i++) {
+        seen += hist.buckets[i];
+        if (seen >= wanted && seen > 0)
+            return MIN(MKAudioLatencyBucketLimit(i), hist.maximum);
+    }
+    return hist.maximum;
+}
+
+- (void) resetLatencyStatistics {
+    MKAudioLatencyReset();
+}
+
+- (void) setLatencyLoopbackEnabled:(BOOL)enabled {
+    @synchronized(self) {
+        _latencyLoopback = enabled;
+        [self publishLoopbackSession];
+        [_audioInput setLoopback:enabled];
+    }
+}
+
+- (BOOL) isLatencyLoopbackEnabled {
+    @synchronized(self) {
+        return _latencyLoopback;
+    }
+}
+
+- (double) estimatedMouthToEarLatency {
+    MKAudioLatencyStage stages[] = {
+        MKAudioLatencyStageCapture,
+        MKAudioLatencyStagePacketize,
+        MKAudioLatencyStageSend,
+        MKAudioLatencyStageJitterBuffer,
+        MKAudioLatencyStageDecode,
+        MKAudioLatencyStagePlayout,
+    };
+    double inputLatency, outputLatency, total;
+    BOOL loopback;
+    NSUInteger i;
+
+    @synchronized(self) {
+        inputLatency = [_audioDevice inputLatency] * 1000.0;
+        outputLatency = [_audioDevice outputLatency] * 1000.0;
+        loopback = _latencyLoopback;
+    }
+
+    // The mouth-to-ear measurement ends at the mixer.
+    total = [self latencyPercentile:0.5 forStage:MKAudioLatencyStageMouthToEar];
+    if (loopback && total > 0.0)
+        return total + outputLatency;
+
+    total = inputLatency + outputLatency;
+    for (i = 0; i < sizeof(stages)/sizeof(stages[0]); i++)
+        total += [self latencyPercentile:0.5 forStage:stages[i]];
+    return total;
+}
+
+- (void) getProfileHistogram:(MKAudioProfileHistogram *)histogram forStage:(MKAudioProfileStage)stage {
+    MKAudioProfilerGetHistogram(stage, histogram);
+}
+
+- (NSUInteger) renderCyclesWithDeadlineMisses:(NSUInteger *)misses {
+    return MKAudioProfilerRenderCycles(misses);
+}
+
+- (void) resetProfile {
+    MKAudioProfilerReset();
+}
+
+- (void) getStartupTimes:(MKAudioStartupTimes *)times {
+    memset(times, 0, sizeof(MKAudioStartupTimes));
+    @synchronized(self) {
+        if (!_running)
+            return;
+        uint64_t firstInput = [_audioInput firstFrameTime];
+        uint64_t firstOutput = [_audioOutput firstRenderTime];
+        times->setup = _startDuration / 1e6;
+        times->warmUp = ([_audioInput warmUpDuration] + [_audioOutput warmUpDuration]) / 1e6;
+        if (firstInput >= _startTime)
+            times->firstInput = (firstInput - _startTime) / 1e6;
+        if (firstOutput >= _startTime)
+            times->firstOutput = (firstOutput - _startTime) / 1e6;
+    }
+}
+
+- (NSData *) copyProfileJSON {
+    static NSString *names[MKAudioProfileStageCount] = {
+        @"inputResample",
+        @"preprocess",
+        @"encode",
+        @"flush",
+        @"jitterBufferGet",
+        @"decode",
+        @"talkerResample",
+        @"mix",
+    };
+    NSUInteger i, j, misses = 0;
+
+    NSMutableArray *limits = [[NSMutableArray alloc] initWithCapacity:MK_AUDIO_PROFILE_BUCKETS];
+    for (j = 0; j < MK_AUDIO_PROFILE_BUCKETS - 1; j++)
+        [limits addObject:[NSNumber numberWithDouble:MKAudioProfilerBucketLimit(j)]];
+
+    NSMutableDictionary *stages = [[NSMutableDictionary alloc] initWithCapacity:MKAudioProfileStageCount];
+    for (i = 0; i < MKAudioProfileStageCount; i++) {
+        MKAudioProfileHistogram hist;
+        MKAudioProfilerGetHistogram((MKAudioProfileStage)i, &hist);
+
+        NSMutableArray *buckets = [[NSMutableArray alloc] initWithCapacity:MK_AUDIO_PROFILE_BUCKETS];
+        for (j = 0; j < MK_AUDIO_PROFILE_BUCKETS; j++)
+            [buckets addObject:[NSNumber numberWithUnsignedInteger:hist.buckets[j]]];
+
+        NSDictionary *stage = [NSDictionary dictionaryWithObjectsAndKeys:
+                                    [NSNumber numberWithUnsignedInteger:hist.count], @"count",
+                                    [NSNumber numberWithDouble:hist.minimum], @"minimum",
+                                    [NSNumber numberWithDouble:hist.maximum], @"maximum",
+                                    [NSNumber numberWithDouble:hist.mean], @"mean",
+                                    buckets, @"buckets",
+                                nil];
+        [stages setObject:stage forKey:names[i]];
+        [buckets release];
+    }
+
+    NSUInteger cycles = MKAudioProfilerRenderCycles(&misses);
+    NSDictionary *profile = [NSDictionary dictionaryWithObjectsAndKeys:
+                                @"microseconds", @"unit",
+                                limits, @"bucketLimits",
+                                stages, @"stages",
+                                [NSNumber numberWithUnsignedInteger:cycles], @"renderCycles",
+                                [NSNumber numberWithUnsignedInteger:misses], @"renderDeadlineMisses",
+                            nil];
+    [limits release];
+    [stages release];
+
+    return [[NSJSONSerialization dataWithJSONObject:profile options:NSJSONWritingPrettyPrinted error:NULL] retain];
+}
+
+- (void) setRecorder:(MKAudioRecorder *)recorder {
+    @synchronized(self) {
+        MKAudioRecorder *old = _recorder;
+        _recorder = [recorder retain];
+        atomic_store(&_receiveRecorder, _recorder);
+        [self waitForReceivers];
+        [old release];
+    }
+}
+
+- (void) setListenerPosition:(const float *)position front:(const float *)front top:(const float *)top {
+    @synchronized(self) {
+        memcpy(_listenerPosition, position, sizeof(_listenerPosition));
+        memcpy(_listenerFront, front, sizeof(_listenerFront));
+        memcpy(_listenerTop, top, sizeof(_listenerTop));
+        [_audioOutput setListenerPosition:_listenerPosition front:_listenerFront top:_listenerTop];
+    }
+}
+
 - (MKAudioOutputSidetone *) sidetoneOutput {
     return _sidetoneOutput;
 }
@@ -446,12 +1113,123 @@ static void MKAudio_UpdateAudioSessionSettings(MKAudio *audio) {
     }
 }
 
+// Voice targets are registered with a single server, so each connection
+// has its own. Takes effect with the next packet, and is kept across
+// restarts until the connection is removed.
+- (void) setVoiceTarget:(NSUInteger)target forConnection:(MKConnection *)conn {
+    @synchronized(self) {
+        NSUInteger slot = [self slotForConnection:conn];
+        if (slot == NSNotFound)
+            return;
+        _voiceTargets[slot] = target;
+        [_audioInput setVoiceTarget:target forSlot:slot];
+    }
+}
+
 - (void) setSelfMuted:(BOOL)selfMuted {
     @synchronized(self) {
         [_audioInput setSelfMuted:selfMuted];
     }
 }
 
+// Deafened, we don't decode or play back anyone.
+- (void) setSelfDeafened:(BOOL)selfDeafened {
+    @synchronized(self) {
+        _selfDeafened = selfDeafened;
+        [_audioOutput setDeafened:selfDeafened];
+    }
+}
+
+// The session of our own user on a connection's server, for loopback
+// measurements.
+- (void) setLocalSession:(NSUInteger)session forConnection:(MKConnection *)conn {
+    @synchronized(self) {
+        NSUInteger slot = [self slotForConnection:conn];
+        if (slot == NSNotFound)
+            return;
+        _localSessions[slot] = session;
+        [self publishLoopbackSession];
+    }
+}
+
+- (void) setLocalMuted:(BOOL)muted forSession:(NSUInteger)session {
+    @synchronized(self) {
+        if (muted)
+            [_localMutes addIndex:session];
+        else
+            [_localMutes removeIndex:session];
+        [_audioOutput setMuted:muted forSession:session];
+    }
+}
+
+- (BOOL) isLocallyMutedSession:(NSUInteger)session {
+    @synchronized(self) {
+        return [_localMutes containsIndex:session];
+    }
+}
+
+- (void) setLocalVolume:(float)volume forSession:(NSUInteger)session {
+    @synchronized(self) {
+        if (volume == 1.0f)
+            [_localVolumes removeObjectForKey:[NSNumber numberWithUnsignedInteger:session]];
+        else
+            [_localVolumes setObject:[NSNumber numberWithFloat:volume] forKey:[NSNumber numberWithUnsignedInteger:session]];
+        [_audioOutput setVolume:volume forSession:session];
+    }
+}
+
+- (float) localVolumeForSession:(NSUInteger)session {
+    @synchronized(self) {
+        NSNumber *volume = [_localVolumes objectForKey:[NSNumber numberWithUnsignedInteger:session]];
+        return volume ? [volume floatValue] : 1.0f;
+    }
+}
+
+- (void) setHeadlessOutputSink:(MKAudioPCMSink)sink {
+    @synchronized(self) {
+        [_headlessOutputSink release];
+        _headlessOutputSink = [sink copy];
+        if ([_audioDevice isKindOfClass:[MKHeadlessAudioDevice class]])
+            [(MKHeadlessAudioDevice *)_audioDevice setOutputSink:_headlessOutputSink];
+    }
+}
+
+- (void) setUserOutputSink:(MKAudioUserPCMSink)sink {
+    @synchronized(self) {
+        [_userOutputSink release];
+        _userOutputSink = [sink copy];
+        [_audioOutput setUserOutputSink:_userOutputSink];
+    }
+}
+
+- (NSUInteger) writeHeadlessInput:(const short *)pcm count:(NSUInteger)nsamp {
+    @synchronized(self) {
+        if (![_audioDevice isKindOfClass:[MKHeadlessAudioDevice class]])
+            return 0;
+        return [(MKHeadlessAudioDevice *)_audioDevice writeInput:pcm count:nsamp];
+    }
+}
+
+- (void) setHeadlessInputFileDescriptor:(int)fd {
+    @synchronized(self) {
+        _headlessInputFd = fd;
+        if ([_audioDevice isKindOfClass:[MKHeadlessAudioDevice class]])
+            [(MKHeadlessAudioDevice *)_audioDevice setInputFileDescriptor:fd];
+    }
+}
+
+- (NSUInteger) runHeadlessAudioFrames:(NSUInteger)nframes {
+    MKHeadlessAudioDevice *device = nil;
+    @synchronized(self) {
+        if ([_audioDevice isKindOfClass:[MKHeadlessAudioDevice class]])
+            device = (MKHeadlessAudioDevice *)[_audioDevice retain];
+    }
+    // Run outside of the lock. The cycles call back into MKAudio.
+    NSUInteger ret = [device runFrames:nframes];
+    [device release];
+    return ret;
+}
+
 - (void) setSuppressed:(BOOL)suppressed {
     @synchronized(self) {
         [_audioInput setSuppressed:suppressed];
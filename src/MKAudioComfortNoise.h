@@ -0,0 +1,23 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+// The decode threads report frames that sit at a talker's noise floor. The
+// level and the lag-one correlation (a first order measure of the spectral
+// tilt) of the last such frame are kept process-wide, without locks, and
+// the comfort noise generator follows them.
+void MKAudioComfortNoiseNoteBackground(const float *pcm, NSUInteger nsamp);
+
+// MKAudioComfortNoise fills the mix with shaped noise while nobody is
+// talking. The noise is read from a precomputed looping table of first
+// order autoregressive noise, in segments at random offsets, so the render
+// thread only scales and copies samples.
+@interface MKAudioComfortNoise : NSObject
+
+- (id) initWithChannels:(NSUInteger)nchan level:(float)level;
+- (void) dealloc;
+
+- (void) setLevel:(float)level;
+- (void) fillBuffer:(float *)output frames:(NSUInteger)nsamp;
+
+@end
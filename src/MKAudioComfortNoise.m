@@ -0,0 +1,191 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#import <MumbleKit/MKAudio.h>
+#import "MKAudioComfortNoise.h"
+
+#include <math.h>
+#include <stdatomic.h>
+#include <simd/simd.h>
+
+// About 85ms of noise at 48kHz, read in segments of about 10ms. The table
+// is padded with a copy of its start, so a segment never has to wrap.
+#define MK_COMFORT_NOISE_TABLE_SIZE      4096
+#define MK_COMFORT_NOISE_SEGMENT         512
+
+// Used until a decoded stream has been measured. This is about as loud
+// and as dull as the noise of the old generator.
+#define MK_COMFORT_NOISE_DEFAULT_LEVEL   0.0006f
+#define MK_COMFORT_NOISE_DEFAULT_TILT    0.5f
+
+// Loud backgrounds are not worth copying.
+#define MK_COMFORT_NOISE_MAX_LEVEL       0.01f
+#define MK_COMFORT_NOISE_MIN_TILT        (-0.9f)
+#define MK_COMFORT_NOISE_MAX_TILT        0.95f
+
+// How fast each render call follows the measurements, and how far the
+// tilt may drift before the table is rebuilt.
+#define MK_COMFORT_NOISE_SMOOTHING       0.05f
+#define MK_COMFORT_NOISE_REBUILD_TILT    0.05f
+
+// The level and tilt are packed into one word so they are always read
+// together. Zero means nothing has been measured yet.
+static _Atomic uint64_t MKAudioComfortNoiseShape = 0;
+
+static uint64_t MKAudioComfortNoisePack(float level, float tilt) {
+    uint32_t l, t;
+    memcpy(&l, &level, sizeof(uint32_t));
+    memcpy(&t, &tilt, sizeof(uint32_t));
+    return ((uint64_t)l << 32) | t;
+}
+
+static void MKAudioComfortNoiseUnpack(uint64_t shape, float *level, float *tilt) {
+    uint32_t l = (uint32_t)(shape >> 32), t = (uint32_t)shape;
+    memcpy(level, &l, sizeof(float));
+    memcpy(tilt, &t, sizeof(float));
+}
+
+// Called on a decode thread.
+void MKAudioComfortNoiseNoteBackground(const float *pcm, NSUInteger nsamp) {
+    float r0 = 0.0f, r1 = 0.0f;
+    NSUInteger i;
+
+    if (nsamp < 2)
+        return;
+    for (i = 0; i < nsamp; i++)
+        r0 += pcm[i] * pcm[i];
+    for (i = 1; i < nsamp; i++)
+        r1 += pcm[i] * pcm[i-1];
+    if (r0 <= 0.0f)
+        return;
+
+    float level = MIN(sqrtf(r0 / nsamp), MK_COMFORT_NOISE_MAX_LEVEL);
+    float tilt = MIN(MAX(r1 / r0, MK_COMFORT_NOISE_MIN_TILT), MK_COMFORT_NOISE_MAX_TILT);
+    atomic_store_explicit(&MKAudioComfortNoiseShape, MKAudioComfortNoisePack(level, tilt), memory_order_relaxed);
+}
+
+@interface MKAudioComfortNoise () {
+    NSUInteger   _numChannels;
+    float        _scale;
+    float        _level;
+    float        _tilt;
+    float        _tableTilt;
+    float       *_table;
+    uint32_t     _random;
+
+    // All channels switch segments together, each at its own offset.
+    NSUInteger   _remaining;
+    NSUInteger  *_offsets;
+}
+- (void) buildTable;
+@end
+
+@implementation MKAudioComfortNoise
+
+- (id) initWithChannels:(NSUInteger)nchan level:(float)level {
+    if ((self = [super init])) {
+        _numChannels = MAX(nchan, 1);
+        _scale = level;
+        _level = MK_COMFORT_NOISE_DEFAULT_LEVEL;
+        _tilt = MK_COMFORT_NOISE_DEFAULT_TILT;
+        _random = 0x67452301;
+        _offsets = calloc(_numChannels, sizeof(NSUInteger));
+        _table = malloc(sizeof(float) * (MK_COMFORT_NOISE_TABLE_SIZE + MK_COMFORT_NOISE_SEGMENT));
+        [self buildTable];
+    }
+    return self;
+}
+
+- (void) dealloc {
+    free(_offsets);
+    free(_table);
+    [super dealloc];
+}
+
+static inline uint32_t MKAudioComfortNoiseRandom(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Fills the table with unit variance noise whose lag-one correlation is
+// the current tilt. The excitation is the sum of four uniform variables,
+// which is close enough to Gaussian for noise.
+- (void) buildTable {
+    float a = _tilt, b = sqrtf(1.0f - _tilt * _tilt) * sqrtf(3.0f / 4.0f);
+    float y = 0.0f;
+    NSInteger i;
+
+    for (i = -64; i < MK_COMFORT_NOISE_TABLE_SIZE; i++) {
+        float w = 0.0f;
+        int k;
+        for (k = 0; k < 4; k++)
+            w += (int32_t)MKAudioComfortNoiseRandom(&_random) * (1.0f / 2147483648.0f);
+        y = a * y + b * w;
+        if (i >= 0)
+            _table[i] = y;
+    }
+    memcpy(_table + MK_COMFORT_NOISE_TABLE_SIZE, _table, sizeof(float) * MK_COMFORT_NOISE_SEGMENT);
+    _tableTilt = _tilt;
+}
+
+// Called on the render thread.
+- (void) setLevel:(float)level {
+    _scale = level;
+}
+
+// Called on the render thread. Overwrites nsamp interleaved frames.
+- (void) fillBuffer:(float *)output frames:(NSUInteger)nsamp {
+    float level = MK_COMFORT_NOISE_DEFAULT_LEVEL, tilt = MK_COMFORT_NOISE_DEFAULT_TILT;
+    uint64_t shape = atomic_load_explicit(&MKAudioComfortNoiseShape, memory_order_relaxed);
+    NSUInteger nchan = _numChannels, done = 0, c, i;
+
+    if (shape != 0)
+        MKAudioComfortNoiseUnpack(shape, &level, &tilt);
+    _level += MK_COMFORT_NOISE_SMOOTHING * (level - _level);
+    _tilt += MK_COMFORT_NOISE_SMOOTHING * (tilt - _tilt);
+    if (fabsf(_tilt - _tableTilt) > MK_COMFORT_NOISE_REBUILD_TILT)
+        [self buildTable];
+
+    const float gain = _level * _scale;
+    while (done < nsamp) {
+        if (_remaining == 0) {
+            for (c = 0; c < nchan; c++)
+                _offsets[c] = MKAudioComfortNoiseRandom(&_random) % MK_COMFORT_NOISE_TABLE_SIZE;
+            _remaining = MK_COMFORT_NOISE_SEGMENT;
+        }
+
+        NSUInteger n = MIN(_remaining, nsamp - done);
+        float *dst = output + done * nchan;
+        i = 0;
+        if (nchan == 1) {
+            const float *t = _table + _offsets[0];
+            for (; i + 4 <= n; i += 4)
+                *(simd_packed_float4 *)(dst + i) = *(const simd_packed_float4 *)(t + i) * gain;
+        } else if (nchan == 2) {
+            const float *l = _table + _offsets[0], *r = _table + _offsets[1];
+            for (; i + 2 <= n; i += 2) {
+                simd_float2 a, b;
+                memcpy(&a, l + i, sizeof(simd_float2));
+                memcpy(&b, r + i, sizeof(simd_float2));
+                simd_float4 lr = simd_make_float4(a, b);
+                *(simd_packed_float4 *)(dst + i*2) = lr.xzyw * gain;
+            }
+        }
+        for (; i < n; i++) {
+            for (c = 0; c < nchan; c++)
+                dst[i*nchan + c] = _table[_offsets[c] + i] * gain;
+        }
+
+        for (c = 0; c < nchan; c++)
+            _offsets[c] += n;
+        _remaining -= n;
+        done += n;
+    }
+}
+
+@end
@@ -0,0 +1,25 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+// MKAudioDecodeScheduler runs the per-talker decode jobs of a mix cycle
+// across a small pool of worker threads.
+//
+// Jobs are ordered by urgency (the talker with the least amount of decoded
+// audio queued up goes first) and spread across per-worker queues. A worker
+// that runs out of jobs steals from the back of the other workers' queues.
+// The calling thread takes part in the work as worker 0, and then joins the
+// remaining workers, but never waits past the given deadline. A talker whose
+// job is still running when the next cycle starts is simply skipped for that
+// cycle; the render thread conceals the gap instead of waiting for it.
+@interface MKAudioDecodeScheduler : NSObject
+
+- (id) initWithNumberOfWorkers:(NSUInteger)nworkers;
+- (void) dealloc;
+
+- (NSUInteger) numberOfWorkers;
+- (NSUInteger) lateCycles;
+
+- (BOOL) decodeTalkers:(NSArray *)talkers untilBuffered:(NSUInteger)nsamples withinNanoseconds:(uint64_t)timeout;
+
+@end
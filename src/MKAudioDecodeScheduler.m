@@ -0,0 +1,271 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#import "MKAudioDecodeScheduler.h"
+#import "MKAudioOutputSpeech.h"
+
+#include <stdatomic.h>
+
+#define MK_DECODE_MAX_WORKERS          8
+#define MK_DECODE_MAX_JOBS_PER_WORKER  128
+
+// A decode cycle is shared between all jobs that were queued for it.
+// Jobs that are still running once the scheduler has given up waiting
+// keep their cycle alive until they are done.
+typedef struct _MKDecodeCycle {
+    _Atomic NSInteger       remaining;
+    _Atomic NSInteger       refs;
+    NSUInteger              nsamples;
+    dispatch_semaphore_t    join;
+} MKDecodeCycle;
+
+typedef struct _MKDecodeJob {
+    MKAudioOutputSpeech     *speech;
+    MKDecodeCycle           *cycle;
+} MKDecodeJob;
+
+// Per-worker job queue. The owner pops from the front, thieves steal from the
+// back. Both ends are packed into a single 64-bit word together with a cycle
+// generation (generation in the upper 16 bits, then 24 bits each of head and
+// tail), so that a single compare-and-swap claims a job from either end, and
+// a stale view of an earlier cycle's queue can never succeed.
+typedef struct _MKDecodeQueue {
+    MKDecodeJob              jobs[MK_DECODE_MAX_JOBS_PER_WORKER];
+    _Atomic uint64_t         bounds;
+} MKDecodeQueue;
+
+#define MK_DECODE_BOUNDS(gen, head, tail)  (((uint64_t)(gen) << 48) | ((uint64_t)(head) << 24) | (uint64_t)(tail))
+#define MK_DECODE_BOUNDS_GEN(b)            ((uint32_t)((b) >> 48))
+#define MK_DECODE_BOUNDS_HEAD(b)           ((uint32_t)(((b) >> 24) & 0xffffff))
+#define MK_DECODE_BOUNDS_TAIL(b)           ((uint32_t)((b) & 0xffffff))
+
+static void MKDecodeCycleRelease(MKDecodeCycle *cycle) {
+    if (atomic_fetch_sub(&cycle->refs, 1) == 1) {
+        dispatch_release(cycle->join);
+        free(cycle);
+    }
+}
+
+// The job is read before it is claimed. Once a queue is empty, the next
+// cycle may refill its slots, so reading it after the claim could observe a
+// job belonging to the next cycle.
+static BOOL MKDecodeQueuePop(MKDecodeQueue *q, MKDecodeJob *job) {
+    uint64_t b = atomic_load(&q->bounds);
+    for (;;) {
+        uint32_t head = MK_DECODE_BOUNDS_HEAD(b);
+        uint32_t tail = MK_DECODE_BOUNDS_TAIL(b);
+        if (head >= tail)
+            return NO;
+        MKDecodeJob candidate = q->jobs[head];
+        uint64_t nb = MK_DECODE_BOUNDS(MK_DECODE_BOUNDS_GEN(b), head + 1, tail);
+        if (atomic_compare_exchange_weak(&q->bounds, &b, nb)) {
+            *job = candidate;
+            return YES;
+        }
+    }
+}
+
+static BOOL MKDecodeQueueSteal(MKDecodeQueue *q, MKDecodeJob *job) {
+    uint64_t b = atomic_load(&q->bounds);
+    for (;;) {
+        uint32_t head = MK_DECODE_BOUNDS_HEAD(b);
+        uint32_t tail = MK_DECODE_BOUNDS_TAIL(b);
+        if (head >= tail)
+            return NO;
+        MKDecodeJob candidate = q->jobs[tail - 1];
+        uint64_t nb = MK_DECODE_BOUNDS(MK_DECODE_BOUNDS_GEN(b), head, tail - 1);
+        if (atomic_compare_exchange_weak(&q->bounds, &b, nb)) {
+            *job = candidate;
+            return YES;
+        }
+    }
+}
+
+@interface MKAudioDecodeScheduler () {
+    NSUInteger              _nworkers;
+    MKDecodeQueue           *_queues;
+    uint16_t                _generation;
+    NSMutableArray          *_threads;
+    dispatch_semaphore_t    _workSema;
+    dispatch_semaphore_t    _exitSema;
+    _Atomic BOOL            _running;
+    _Atomic NSUInteger      _lateCycles;
+}
+- (void) workerThreadMain:(NSUInteger)idx;
+- (void) runJobsForWorker:(NSUInteger)idx;
+@end
+
+@implementation MKAudioDecodeScheduler
+
+- (id) initWithNumberOfWorkers:(NSUInteger)nworkers {
+    if ((self = [super init])) {
+        _nworkers = MAX(1, MIN(nworkers, MK_DECODE_MAX_WORKERS));
+        _workSema = dispatch_semaphore_create(0);
+        _exitSema = dispatch_semaphore_create(0);
+        atomic_init(&_running, YES);
+        atomic_init(&_lateCycles, 0);
+
+        NSUInteger i;
+        _queues = calloc(_nworkers, sizeof(MKDecodeQueue));
+        for (i = 0; i < _nworkers; i++) {
+            atomic_init(&_queues[i].bounds, 0);
+        }
+        _generation = 0;
+
+        // Worker 0 is whichever thread calls decodeTalkers:untilBuffered:withinNanoseconds:.
+        // The helper threads must not retain us, or we would never be deallocated.
+        __block MKAudioDecodeScheduler *scheduler = self;
+        _threads = [[NSMutableArray alloc] initWithCapacity:_nworkers];
+        for (i = 1; i < _nworkers; i++) {
+            NSUInteger idx = i;
+            NSThread *thread = [[NSThread alloc] initWithBlock:^{
+                [scheduler workerThreadMain:idx];
+            }];
+            [thread setName:[NSString stringWithFormat:@"MKAudioDecodeScheduler worker %lu", (unsigned long)idx]];
+            [thread setQualityOfService:NSQualityOfServiceUserInteractive];
+            [thread start];
+            [_threads addObject:thread];
+            [thread release];
+        }
+    }
+    return self;
+}
+
+- (void) dealloc {
+    NSUInteger i;
+
+    atomic_store(&_running, NO);
+    for (i = 1; i < _nworkers; i++)
+        dispatch_semaphore_signal(_workSema);
+    for (i = 1; i < _nworkers; i++)
+        dispatch_semaphore_wait(_exitSema, DISPATCH_TIME_FOREVER);
+    [_threads release];
+
+    free(_queues);
+
+    dispatch_release(_workSema);
+    dispatch_release(_exitSema);
+
+    [super dealloc];
+}
+
+- (NSUInteger) numberOfWorkers {
+    return _nworkers;
+}
+
+- (NSUInteger) lateCycles {
+    return atomic_load(&_lateCycles);
+}
+
+- (void) workerThreadMain:(NSUInteger)idx {
+    for (;;) {
+        dispatch_semaphore_wait(_workSema, DISPATCH_TIME_FOREVER);
+        if (!atomic_load(&_running))
+            break;
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        [self runJobsForWorker:idx];
+        [pool release];
+    }
+    dispatch_semaphore_signal(_exitSema);
+}
+
+- (void) runJobsForWorker:(NSUInteger)idx {
+    MKDecodeJob job;
+    NSUInteger k;
+
+    for (;;) {
+        BOOL found = MKDecodeQueuePop(&_queues[idx], &job);
+        for (k = 1; !found && k < _nworkers; k++) {
+            found = MKDecodeQueueSteal(&_queues[(idx + k) % _nworkers], &job);
+        }
+        if (!found)
+            return;
+
+        MKDecodeCycle *cycle = job.cycle;
+        [job.speech decodeUntilBuffered:cycle->nsamples];
+        [job.speech endDecode];
+        [job.speech release];
+
+        if (atomic_fetch_sub(&cycle->remaining, 1) == 1)
+            dispatch_semaphore_signal(cycle->join);
+        MKDecodeCycleRelease(cycle);
+    }
+}
+
+- (BOOL) decodeTalkers:(NSArray *)talkers untilBuffered:(NSUInteger)nsamples withinNanoseconds:(uint64_t)timeout {
+    NSUInteger i, njobs = 0;
+    uint32_t tails[MK_DECODE_MAX_WORKERS];
+
+    if ([talkers count] == 0)
+        return YES;
+
+    // Most urgent first: the talker with the least audio queued up.
+    NSArray *ordered = [talkers sortedArrayUsingComparator:^NSComparisonResult(id a, id b) {
+        NSUInteger ba = [(MKAudioOutputSpeech *)a bufferedSamples];
+        NSUInteger bb = [(MKAudioOutputSpeech *)b bufferedSamples];
+        if (ba < bb)
+            return NSOrderedAscending;
+        if (ba > bb)
+            return NSOrderedDescending;
+        return NSOrderedSame;
+    }];
+
+    MKDecodeCycle *cycle = malloc(sizeof(MKDecodeCycle));
+    cycle->nsamples = nsamples;
+    cycle->join = dispatch_semaphore_create(0);
+    atomic_init(&cycle->remaining, 0);
+    atomic_init(&cycle->refs, 1);
+
+    for (i = 0; i < _nworkers; i++)
+        tails[i] = 0;
+
+    // Deal the jobs out round-robin, so every queue is ordered by urgency too.
+    // Talkers that are still being decoded by a late job from an earlier
+    // cycle are skipped, and so are the least urgent talkers once all queues
+    // are full.
+    for (MKAudioOutputSpeech *ous in ordered) {
+        if (njobs == _nworkers * MK_DECODE_MAX_JOBS_PER_WORKER)
+            break;
+        if (![ous tryBeginDecode])
+            continue;
+        NSUInteger q = njobs % _nworkers;
+        _queues[q].jobs[tails[q]].speech = [ous retain];
+        _queues[q].jobs[tails[q]].cycle = cycle;
+        tails[q]++;
+        njobs++;
+    }
+
+    if (njobs == 0) {
+        MKDecodeCycleRelease(cycle);
+        return YES;
+    }
+
+    atomic_store(&cycle->remaining, (NSInteger)njobs);
+    atomic_fetch_add(&cycle->refs, (NSInteger)njobs);
+    _generation++;
+    for (i = 0; i < _nworkers; i++)
+        atomic_store(&_queues[i].bounds, MK_DECODE_BOUNDS(_generation, 0, tails[i]));
+
+    NSUInteger helpers = MIN(_nworkers - 1, njobs - 1);
+    for (i = 0; i < helpers; i++)
+        dispatch_semaphore_signal(_workSema);
+
+    [self runJobsForWorker:0];
+
+    // All queues are drained at this point. Only jobs that are still
+    // executing on other workers can be outstanding.
+    BOOL onTime = YES;
+    if (atomic_load(&cycle->remaining) > 0) {
+        dispatch_time_t deadline = dispatch_time(DISPATCH_TIME_NOW, (int64_t)timeout);
+        if (dispatch_semaphore_wait(cycle->join, deadline) != 0) {
+            atomic_fetch_add(&_lateCycles, 1);
+            onTime = NO;
+        }
+    }
+
+    MKDecodeCycleRelease(cycle);
+    return onTime;
+}
+
+@end
@@ -19,4 +19,11 @@ typedef BOOL (^MKAudioDeviceInputFunc)(short *frames, unsigned int nsamp);
 - (int) outputSampleRate;
 - (int) numberOfInputChannels;
 - (int) numberOfOutputChannels;
+
+// Latency added by the device itself, in seconds.
+- (double) inputLatency;
+- (double) outputLatency;
+
+// Whether the device removes echo from its input by itself.
+- (BOOL) providesEchoCancellation;
 @end
@@ -40,4 +40,16 @@
     return 0;
 }
 
+- (double) inputLatency {
+    return 0.0;
+}
+
+- (double) outputLatency {
+    return 0.0;
+}
+
+- (BOOL) providesEchoCancellation {
+    return NO;
+}
+
 @end
@@ -0,0 +1,31 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <speex/speex_echo.h>
+
+// The echo reference is the mixer's output, as it is handed to the audio
+// device. The render thread writes it into a process-wide ring together
+// with the time its samples will be heard, and the input side reads it back
+// by time. Neither side takes locks. The reference is mono at SAMPLE_RATE.
+void MKAudioEchoReferenceWrite(const float *samples, NSUInteger nsamp, NSUInteger nchan, uint64_t heardTime);
+BOOL MKAudioEchoReferenceRead(float *dst, NSUInteger nsamp, uint64_t heardTime);
+
+// MKAudioEchoCanceller removes the echo of the mixer output from captured
+// frames, using the Speex echo canceller.
+//
+// The timestamps only line the reference up roughly, since the devices
+// don't always report their full latency. The canceller keeps estimating
+// the remaining delay by cross-correlating the envelopes of the captured
+// signal and the reference, and shifts the reference accordingly.
+@interface MKAudioEchoCanceller : NSObject
+
+- (id) initWithFrameSize:(NSUInteger)frameSize sampleRate:(NSUInteger)sampleRate;
+- (void) dealloc;
+
+- (SpeexEchoState *) echoState;
+- (NSInteger) estimatedDelay;
+
+- (void) cancelEchoInFrame:(short *)frame heardAt:(uint64_t)heardTime;
+
+@end
@@ -0,0 +1,260 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#import <MumbleKit/MKAudio.h>
+#import "MKAudioEchoCanceller.h"
+
+#include <speex/speex_resampler.h>
+#include <math.h>
+#include <stdatomic.h>
+
+// About 680ms of reference at 48kHz.
+#define MK_ECHO_REFERENCE_CAPACITY     32768
+#define MK_ECHO_REFERENCE_BLOCK        (SAMPLE_RATE / 1000)
+
+// The delay estimator works on envelopes of 1ms blocks. About once a
+// second it correlates the last half second of the captured envelope with
+// the reference envelope, shifted between -50ms and 300ms.
+#define MK_ECHO_HISTORY_BLOCKS         1024
+#define MK_ECHO_WINDOW_BLOCKS          500
+#define MK_ECHO_MIN_LAG_BLOCKS         (-50)
+#define MK_ECHO_MAX_LAG_BLOCKS         300
+#define MK_ECHO_ESTIMATE_INTERVAL      1000
+#define MK_ECHO_MIN_CORRELATION        0.5
+#define MK_ECHO_MIN_REFERENCE_LEVEL    0.001
+
+// The reference is fed a little ahead of where the echo was found, so that
+// the echo path stays inside the filter even if the estimate is late.
+#define MK_ECHO_LEAD_BLOCKS            5
+
+static float MKAudioEchoReferenceSamples[MK_ECHO_REFERENCE_CAPACITY];
+
+// The samples and the end of the ring (and the time that sample will be
+// heard) are guarded by a sequence lock. The render thread is the only
+// writer, so it never waits, and a reader that overlaps a write retries.
+static _Atomic uint64_t MKAudioEchoReferenceSeq = 0;
+static _Atomic uint64_t MKAudioEchoReferenceEnd = 0;
+static _Atomic uint64_t MKAudioEchoReferenceEndTime = 0;
+
+// Called on the render thread with nsamp interleaved frames of nchan
+// channels, the first of which will be heard at heardTime.
+void MKAudioEchoReferenceWrite(const float *samples, NSUInteger nsamp, NSUInteger nchan, uint64_t heardTime) {
+    uint64_t seq = atomic_load_explicit(&MKAudioEchoReferenceSeq, memory_order_relaxed);
+    uint64_t end = atomic_load_explicit(&MKAudioEchoReferenceEnd, memory_order_relaxed);
+    float scale = 1.0f / nchan;
+    NSUInteger i, k;
+
+    atomic_store_explicit(&MKAudioEchoReferenceSeq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    for (i = 0; i < nsamp; i++) {
+        float v = 0.0f;
+        for (k = 0; k < nchan; k++)
+            v += samples[i*nchan + k];
+        MKAudioEchoReferenceSamples[(end + i) % MK_ECHO_REFERENCE_CAPACITY] = v * scale;
+    }
+
+    atomic_store_explicit(&MKAudioEchoReferenceEnd, end + nsamp, memory_order_relaxed);
+    atomic_store_explicit(&MKAudioEchoReferenceEndTime, heardTime + (uint64_t)nsamp * NSEC_PER_SEC / SAMPLE_RATE, memory_order_relaxed);
+    atomic_store_explicit(&MKAudioEchoReferenceSeq, seq + 2, memory_order_release);
+}
+
+// Reads the nsamp samples of the reference starting with the one heard at
+// heardTime. If they aren't all in the ring, dst is zeroed and NO is returned.
+BOOL MKAudioEchoReferenceRead(float *dst, NSUInteger nsamp, uint64_t heardTime) {
+    int attempt;
+    NSUInteger i;
+
+    for (attempt = 0; attempt < 4; attempt++) {
+        uint64_t seq = atomic_load_explicit(&MKAudioEchoReferenceSeq, memory_order_acquire);
+        if (seq & 1)
+            continue;
+
+        uint64_t end = atomic_load_explicit(&MKAudioEchoReferenceEnd, memory_order_relaxed);
+        uint64_t endTime = atomic_load_explicit(&MKAudioEchoReferenceEndTime, memory_order_relaxed);
+        int64_t offset = (int64_t)(heardTime - endTime) * SAMPLE_RATE / (int64_t)NSEC_PER_SEC;
+        int64_t start = (int64_t)end + offset;
+        if (end == 0 || start < 0 || (uint64_t)start + nsamp > end || (uint64_t)start + MK_ECHO_REFERENCE_CAPACITY < end)
+            break;
+
+        for (i = 0; i < nsamp; i++)
+            dst[i] = MKAudioEchoReferenceSamples[((uint64_t)start + i) % MK_ECHO_REFERENCE_CAPACITY];
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&MKAudioEchoReferenceSeq, memory_order_relaxed) == seq)
+            return YES;
+    }
+
+    memset(dst, 0, nsamp * sizeof(float));
+    return NO;
+}
+
+@interface MKAudioEchoCanceller () {
+    SpeexEchoState         *_echoState;
+    SpeexResamplerState    *_resampler;
+
+    NSUInteger             _frameSize;
+    NSUInteger             _sampleRate;
+    NSUInteger             _refFrames;
+    NSUInteger             _blockSize;
+
+    float                  *_reference;
+    float                  *_resampled;
+    spx_int16_t            *_echoRef;
+    spx_int16_t            *_echoOut;
+
+    float                  _micEnvelope[MK_ECHO_HISTORY_BLOCKS];
+    float                  _refEnvelope[MK_ECHO_HISTORY_BLOCKS];
+    NSUInteger             _envelopeBlocks;
+    NSUInteger             _blocksSinceEstimate;
+    NSInteger              _delay;
+}
+- (void) estimateDelay;
+@end
+
+@implementation MKAudioEchoCanceller
+
+- (id) initWithFrameSize:(NSUInteger)frameSize sampleRate:(NSUInteger)sampleRate {
+    if ((self = [super init])) {
+        _frameSize = frameSize;
+        _sampleRate = sampleRate;
+        _refFrames = frameSize * SAMPLE_RATE / sampleRate;
+        _blockSize = sampleRate / 1000;
+
+        // A 100ms tail, on top of the estimated delay.
+        _echoState = speex_echo_state_init((int)frameSize, (int)(sampleRate / 10));
+        int rate = (int)sampleRate;
+        speex_echo_ctl(_echoState, SPEEX_ECHO_SET_SAMPLING_RATE, &rate);
+
+        if (sampleRate != SAMPLE_RATE) {
+            int err;
+            _resampler = speex_resampler_init(1, SAMPLE_RATE, (spx_uint32_t)sampleRate, 3, &err);
+            _resampled = calloc(frameSize, sizeof(float));
+        }
+
+        _reference = calloc(_refFrames, sizeof(float));
+        _echoRef = calloc(frameSize, sizeof(spx_int16_t));
+        _echoOut = calloc(frameSize, sizeof(spx_int16_t));
+    }
+    return self;
+}
+
+- (void) dealloc {
+    if (_echoState)
+        speex_echo_state_destroy(_echoState);
+    if (_resampler)
+        speex_resampler_destroy(_resampler);
+    free(_reference);
+    free(_resampled);
+    free(_echoRef);
+    free(_echoOut);
+    [super dealloc];
+}
+
+- (SpeexEchoState *) echoState {
+    return _echoState;
+}
+
+// The delay between the reference's timestamps and the echo, in milliseconds.
+- (NSInteger) estimatedDelay {
+    return _delay;
+}
+
+// Called on the audio input thread. The frame's first sample was captured
+// at heardTime.
+- (void) cancelEchoInFrame:(short *)frame heardAt:(uint64_t)heardTime {
+    NSUInteger i, b, nblocks = _frameSize / _blockSize;
+
+    // The envelopes are taken before the delay is applied, so the estimate
+    // doesn't depend on itself.
+    BOOL haveRef = MKAudioEchoReferenceRead(_reference, _refFrames, heardTime);
+    for (b = 0; b < nblocks; b++) {
+        float mic = 0.0f, ref = 0.0f;
+        for (i = 0; i < _blockSize; i++)
+            mic += fabsf(frame[b*_blockSize + i] / 32768.0f);
+        if (haveRef) {
+            for (i = 0; i < MK_ECHO_REFERENCE_BLOCK; i++)
+                ref += fabsf(_reference[b*MK_ECHO_REFERENCE_BLOCK + i]);
+        }
+        NSUInteger idx = _envelopeBlocks % MK_ECHO_HISTORY_BLOCKS;
+        _micEnvelope[idx] = mic / _blockSize;
+        _refEnvelope[idx] = ref / MK_ECHO_REFERENCE_BLOCK;
+        _envelopeBlocks++;
+    }
+
+    _blocksSinceEstimate += nblocks;
+    if (_blocksSinceEstimate >= MK_ECHO_ESTIMATE_INTERVAL && _envelopeBlocks >= MK_ECHO_HISTORY_BLOCKS) {
+        [self estimateDelay];
+        _blocksSinceEstimate = 0;
+    }
+
+    int64_t shift = (int64_t)(_delay - MK_ECHO_LEAD_BLOCKS) * (int64_t)NSEC_PER_MSEC;
+    if (!MKAudioEchoReferenceRead(_reference, _refFrames, (uint64_t)((int64_t)heardTime - shift)))
+        return;
+
+    const float *ref = _reference;
+    if (_resampler) {
+        spx_uint32_t inlen = (spx_uint32_t)_refFrames;
+        spx_uint32_t outlen = (spx_uint32_t)_frameSize;
+        speex_resampler_process_float(_resampler, 0, _reference, &inlen, _resampled, &outlen);
+        for (i = outlen; i < _frameSize; i++)
+            _resampled[i] = 0.0f;
+        ref = _resampled;
+    }
+    for (i = 0; i < _frameSize; i++) {
+        float v = ref[i] * 32768.0f;
+        _echoRef[i] = (spx_int16_t) MIN(MAX(v, -32768.0f), 32767.0f);
+    }
+
+    speex_echo_cancellation(_echoState, frame, _echoRef, _echoOut);
+    memcpy(frame, _echoOut, _frameSize * sizeof(short));
+}
+
+// Finds the lag at which the captured envelope best matches the reference
+// envelope. Nothing changes unless the reference was loud enough and the
+// match is clear.
+- (void) estimateDelay {
+    const NSInteger w = MK_ECHO_WINDOW_BLOCKS;
+    NSInteger t0 = (NSInteger)_envelopeBlocks + MK_ECHO_MIN_LAG_BLOCKS - w;
+    NSInteger t, lag, best = _delay;
+    double micMean = 0.0, micVar = 0.0, bestCorr = MK_ECHO_MIN_CORRELATION;
+
+    for (t = t0; t < t0 + w; t++)
+        micMean += _micEnvelope[t % MK_ECHO_HISTORY_BLOCKS];
+    micMean /= w;
+    for (t = t0; t < t0 + w; t++) {
+        double d = _micEnvelope[t % MK_ECHO_HISTORY_BLOCKS] - micMean;
+        micVar += d * d;
+    }
+    if (micVar <= 0.0)
+        return;
+
+    for (lag = MK_ECHO_MIN_LAG_BLOCKS; lag <= MK_ECHO_MAX_LAG_BLOCKS; lag++) {
+        double sr = 0.0, srr = 0.0, smr = 0.0;
+        for (t = t0; t < t0 + w; t++) {
+            double r = _refEnvelope[(t - lag) % MK_ECHO_HISTORY_BLOCKS];
+            double m = _micEnvelope[t % MK_ECHO_HISTORY_BLOCKS] - micMean;
+            sr += r;
+            srr += r * r;
+            smr += m * r;
+        }
+        double refMean = sr / w;
+        double refVar = srr - sr * refMean;
+        if (refMean < MK_ECHO_MIN_REFERENCE_LEVEL || refVar <= 0.0)
+            continue;
+        double corr = smr / sqrt(micVar * refVar);
+        if (corr > bestCorr) {
+            bestCorr = corr;
+            best = lag;
+        }
+    }
+
+    // Small corrections are absorbed by the filter. Larger ones move the
+    // echo path, so the filter has to converge again.
+    if (labs(best - _delay) > MK_ECHO_LEAD_BLOCKS)
+        speex_echo_state_reset(_echoState);
+    _delay = best;
+}
+
+@end
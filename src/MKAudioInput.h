@@ -11,13 +11,14 @@
 - (id) initWithDevice:(MKAudioDevice *)device andSettings:(MKAudioSettings *)settings;
 - (void) dealloc;
 
-- (void) setMainConnectionForAudio:(MKConnection *)conn;
+- (void) setConnectionsForAudio:(NSArray *)connections;
+- (void) setConnectionsForAudio:(NSArray *)connections inSlots:(const NSUInteger *)slots;
 
 - (void) initializeMixer;
 
 - (void) resetPreprocessor;
 - (void) addMicrophoneDataWithBuffer:(short *)input amount:(NSUInteger)nsamp;
-- (void) flushCheck:(NSData *)outputBuffer terminator:(BOOL)terminator;
+- (void) flushCheckWithTerminator:(BOOL)terminator;
 
 - (void) setForceTransmit:(BOOL)flag;
 - (BOOL) forceTransmit;
@@ -29,5 +30,12 @@
 - (void) setSelfMuted:(BOOL)selfMuted;
 - (void) setSuppressed:(BOOL)suppressed;
 - (void) setMuted:(BOOL)muted;
+- (void) setLoopback:(BOOL)loopback;
+- (void) setVoiceTarget:(NSUInteger)target forSlot:(NSUInteger)slot;
+
+- (void) updateSettings:(MKAudioSettings *)settings;
+
+- (uint64_t) warmUpDuration;
+- (uint64_t) firstFrameTime;
 
 @end
@@ -7,8 +7,15 @@
 #import <MumbleKit/MKConnection.h>
 #import "MKPacketDataStream.h"
 #import "MKAudioInput.h"
+#import "MKAudioOutput.h"
 #import "MKAudioOutputSidetone.h"
 #import "MKAudioDevice.h"
+#import "MKVoicePacket.h"
+#import "MKAudioLatency.h"
+#import "MKAudioTalkState.h"
+#import "MKAudioEchoCanceller.h"
+#import "MKAudioProfiler.h"
+#import "MKAudioLiveSettings.h"
 
 #include <speex/speex.h>
 #include <speex/speex_preprocess.h>
@@ -17,6 +24,40 @@
 #include <speex/speex_jitter.h>
 #include <speex/speex_types.h>
 #include <opus.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <simd/simd.h>
+
+// Frames below this level are silent no matter what the VAD settings are.
+#define MK_AUDIO_INPUT_SILENCE_DB   -70.0f
+
+// Voice targets are 5 bits in the packet header, and 31 is the server
+// loopback.
+#define MK_AUDIO_INPUT_MAX_VOICE_TARGET  30
+
+// Only one in this many clearly silent frames goes through the echo
+// canceller and the preprocessor, to keep their estimates up to date.
+#define MK_AUDIO_INPUT_SILENT_LEARN_INTERVAL  8
+
+// Frames of silence run through the codecs before the input starts.
+#define MK_AUDIO_INPUT_WARMUP_FRAMES  3
+
+// Quiet frames that cross zero this often are hiss rather than speech.
+#define MK_AUDIO_INPUT_NOISE_DB     -50.0f
+#define MK_AUDIO_INPUT_NOISE_ZCR     0.5f
+
+// Resampler quality by number of cores. Higher qualities use longer
+// filters, which cost more CPU and add latency.
+#define MK_AUDIO_INPUT_RESAMPLER_QUALITY(ncpu)  ((ncpu) >= 4 ? SPEEX_RESAMPLER_QUALITY_DESKTOP : ((ncpu) >= 2 ? SPEEX_RESAMPLER_QUALITY_DEFAULT : SPEEX_RESAMPLER_QUALITY_VOIP))
+
+// The connections that voice is sent to, along with their slots in MKAudio.
+// A set is never changed once it has been published, and retains its
+// connections.
+typedef struct _MKAudioInputConnections {
+    NSUInteger    count;
+    MKConnection  *connections[MK_AUDIO_MAX_CONNECTIONS];
+    NSUInteger    slots[MK_AUDIO_MAX_CONNECTIONS];
+} MKAudioInputConnections;
 
 @interface MKAudioInput () {
     @public
@@ -27,8 +68,15 @@
     MKAudioDevice          *_device;
     MKAudioSettings        _settings;
 
+    // Live settings changes, picked up at the start of each frame.
+    MKAudioSettingsSnapshot _liveSettings;
+    uint32_t               _liveSettingsSeen;
+
     SpeexPreprocessState   *_preprocessorState;
     SpeexResamplerState    *_micResampler;
+    int                    _inputChannel;
+    MKAudioEchoCanceller   *_echoCanceller;
+    uint64_t               _inputLatency;
     SpeexBits              _speexBits;
     void                   *_speexEncoder;
     OpusEncoder            *_opusEncoder;
@@ -49,7 +97,7 @@
     short                  *psOut;
 
     MKUDPMessageType       udpMessageType;
-    NSMutableArray         *frameList;
+    MKVoicePacketBuilder   _packetBuilder;
 
     MKCodecFormat          _codecFormat;
     BOOL                   _doTransmit;
@@ -58,6 +106,7 @@
 
     signed long            _preprocRunningAvg;
     signed long            _preprocAvgItems;
+    NSUInteger             _silentFrames;
 
     float                  _speechProbability;
     float                  _peakCleanMic;
@@ -66,20 +115,116 @@
     BOOL                   _muted;
     BOOL                   _suppressed;
  
+    // The VAD gate is timed in samples at sampleRate.
     BOOL                   _vadGateEnabled;
-    double                 _vadGateTimeSeconds;
-    double                 _vadOpenLastTime;
+    uint64_t               _vadGateSamples;
+    uint64_t               _vadOpenSample;
+    uint64_t               _sampleClock;
 
-    NSMutableData          *_encodingOutputBuffer;
-    NSMutableData          *_opusBuffer;
+    short                  *_opusBuffer;
     
-    MKConnection           *_connection;
+    // The input thread reads the published set without locking. It marks
+    // the set it is sending to in _connectionsInUse, and a new set is only
+    // published once it has let go of the old one. _useOpus follows the
+    // main connection, and is refreshed along with the set.
+    _Atomic(MKAudioInputConnections *) _connections;
+    _Atomic(MKAudioInputConnections *) _connectionsInUse;
+    _Atomic BOOL           _useOpus;
+
+    // Latency measurements. The capture time is when the first sample of a
+    // frame came in, and the ready time is when the frame was complete.
+    uint64_t               _frameCaptureTime;
+    uint64_t               _frameReadyTime;
+    uint64_t               _packetCaptureTime;
+    uint64_t               _packetReadyTime;
+    _Atomic BOOL           _loopback;
+
+    // Each connection has its own voice target, by slot, which can be
+    // switched from any thread. They are latched when a packet is started,
+    // so a packet never mixes targets. A terminator goes to the targets of
+    // the packets before it.
+    _Atomic NSUInteger     _voiceTargets[MK_AUDIO_MAX_CONNECTIONS];
+    NSUInteger             _packetTargets[MK_AUDIO_MAX_CONNECTIONS];
+    NSUInteger             _prevTargets[MK_AUDIO_MAX_CONNECTIONS];
+
+    // Startup measurements, in nanoseconds on the MKAudioLatencyNow clock.
+    uint64_t               _warmUpDuration;
+    _Atomic uint64_t       _firstFrameTime;
 }
+- (void) warmUp;
 @end
 
+// Converts nframes interleaved frames of nchan channels to mono, either by
+// taking a single channel (starting at 1) or by averaging all of them.
+static void MKAudioInputDownmix(short *output, const short *input, NSUInteger nframes, int nchan, int channel) {
+    NSUInteger i = 0;
+    int k;
+
+    if (nchan == 1) {
+        memcpy(output, input, nframes * sizeof(short));
+    } else if (channel > 0) {
+        input += channel - 1;
+        for (i = 0; i < nframes; i++)
+            output[i] = input[i * nchan];
+    } else if (nchan == 2) {
+        for (; i + 4 <= nframes; i += 4) {
+            simd_short8 s;
+            memcpy(&s, input + i*2, sizeof(simd_short8));
+            simd_int8 x = simd_int(s);
+            simd_short4 m = simd_short((x.even + x.odd) >> 1);
+            memcpy(output + i, &m, sizeof(simd_short4));
+        }
+        for (; i < nframes; i++)
+            output[i] = (short)((input[i*2] + input[i*2 + 1]) >> 1);
+    } else {
+        for (i = 0; i < nframes; i++) {
+            int sum = 0;
+            for (k = 0; k < nchan; k++)
+                sum += input[i*nchan + k];
+            output[i] = (short)(sum / nchan);
+        }
+    }
+}
+
+// Level (RMS, in dBFS) and zero-crossing rate of a frame. This runs on
+// every captured frame, so it is kept cheap.
+static void MKAudioInputFrameStats(const short *frame, int n, float *level, float *zcr) {
+    simd_float4 energy = 0.0f;
+    simd_int4 crossings = 0;
+    int i, nzc;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        simd_short4 s;
+        memcpy(&s, frame + i, sizeof(simd_short4));
+        simd_float4 x = simd_float(s);
+        energy += x * x;
+    }
+    float sum = 1.0f + simd_reduce_add(energy);
+    for (; i < n; i++)
+        sum += (float)frame[i] * (float)frame[i];
+
+    // Comparisons yield -1 for true.
+    for (i = 0; i + 5 <= n; i += 4) {
+        simd_short4 a, b;
+        memcpy(&a, frame + i, sizeof(simd_short4));
+        memcpy(&b, frame + i + 1, sizeof(simd_short4));
+        crossings -= simd_int((a < 0) ^ (b < 0));
+    }
+    nzc = simd_reduce_add(crossings);
+    for (; i + 1 < n; i++) {
+        if ((frame[i] < 0) != (frame[i+1] < 0))
+            nzc++;
+    }
+
+    *level = MAX(20.0f*log10f(sqrtf(sum / n)/32768.0f), -96.0f);
+    *zcr = (float)nzc / n;
+}
+
 @implementation MKAudioInput
 
 - (id) initWithDevice:(MKAudioDevice *)device andSettings:(MKAudioSettings *)settings {
+    NSUInteger i;
+
     self = [super init];
     if (self == nil)
         return nil;
@@ -89,6 +234,8 @@
 
     // Copy settings
     memcpy(&_settings, settings, sizeof(MKAudioSettings));
+    MKAudioSettingsSnapshotInit(&_liveSettings, &_settings);
+    _liveSettingsSeen = 0;
     
     _preprocessorState = NULL;
     _micResampler = NULL;
@@ -97,8 +244,8 @@
     _bufferedFrames = 0;
     
     _vadGateEnabled = _settings.enableVadGate;
-    _vadGateTimeSeconds = _settings.vadGateTimeSeconds;
-    _vadOpenLastTime = [[NSDate date] timeIntervalSince1970];
+    _vadOpenSample = 0;
+    _sampleClock = 0;
 
     // Fall back to CELT if Opus is not enabled.
     if (![[MKVersion sharedVersion] isOpusEnabled] && _settings.codec == MKCodecFormatOpus) {
@@ -143,6 +290,8 @@
         NSLog(@"MKAudioInput: %d bits/s, %d Hz, %d sample Speex-UWB", _settings.quality, sampleRate, frameSize);
     }
 
+    _vadGateSamples = (uint64_t)(MAX(_settings.vadGateTimeSeconds, 0.0) * sampleRate);
+
     doResetPreprocessor = YES;
     _lastTransmit = NO;
 
@@ -154,14 +303,22 @@
         setMaxBandwidth(g.iMaxBandwidth);
      */
 
-    frameList = [[NSMutableArray alloc] initWithCapacity:_settings.audioPerPacket];
+    MKVoicePacketBuilderInit(&_packetBuilder);
+    _opusBuffer = calloc(MAX(_settings.audioPerPacket, 1) * frameSize, sizeof(short));
 
     udpMessageType = ~0;
     
     micFrequency = [_device inputSampleRate];
-    numMicChannels = [_device numberOfInputChannels];
+    numMicChannels = MAX([_device numberOfInputChannels], 1);
     
     [self initializeMixer];
+    atomic_init(&_firstFrameTime, 0);
+    for (i = 0; i < MK_AUDIO_MAX_CONNECTIONS; i++)
+        atomic_init(&_voiceTargets[i], 0);
+    atomic_init(&_connections, NULL);
+    atomic_init(&_connectionsInUse, NULL);
+    atomic_init(&_useOpus, YES);
+    [self warmUp];
  
     [_device setupInput:^BOOL(short *frames, unsigned int nsamp) {
         [self addMicrophoneDataWithBuffer:frames amount:nsamp];
@@ -175,9 +332,9 @@
     [_device setupInput:NULL];
     [_device release];
 
-    [frameList release];
-    [_opusBuffer release];
-    [_encodingOutputBuffer release];
+    MKVoicePacketBuilderDestroy(&_packetBuilder);
+    if (_opusBuffer)
+        free(_opusBuffer);
 
     if (psMic)
         free(psMic);
@@ -188,18 +345,58 @@
         speex_encoder_destroy(_speexEncoder);
     if (_micResampler)
         speex_resampler_destroy(_micResampler);
+    _micResampler = NULL;
     if (_preprocessorState)
         speex_preprocess_state_destroy(_preprocessorState);
+    [_echoCanceller release];
     if (_opusEncoder)
         opus_encoder_destroy(_opusEncoder);
+    [self setConnectionsForAudio:nil];
 
     [super dealloc];
 }
 
-- (void) setMainConnectionForAudio:(MKConnection *)conn {
-    @synchronized(self) {
-        _connection = conn;
+// Every packet is encoded once and sent to each of the connections. The
+// first one is the main connection, which picks the codec. Calls must be
+// serialized, and should be repeated when the main connection's codec
+// changes.
+- (void) setConnectionsForAudio:(NSArray *)connections {
+    [self setConnectionsForAudio:connections inSlots:NULL];
+}
+
+// Each connection's voice target is looked up by its slot. Without slots,
+// the connections are in slots 0 and up, in order.
+- (void) setConnectionsForAudio:(NSArray *)connections inSlots:(const NSUInteger *)slots {
+    MKAudioInputConnections *conns = NULL;
+    NSUInteger i, n = MIN([connections count], MK_AUDIO_MAX_CONNECTIONS);
+    BOOL useOpus = YES;
+
+    if (n > 0) {
+        conns = malloc(sizeof(MKAudioInputConnections));
+        if (conns == NULL) {
+            NSLog(@"MKAudioInput: unable to allocate connection set.");
+            return;
+        }
+        conns->count = n;
+        for (i = 0; i < n; i++) {
+            conns->connections[i] = [[connections objectAtIndex:i] retain];
+            conns->slots[i] = slots ? MIN(slots[i], MK_AUDIO_MAX_CONNECTIONS-1) : i;
+        }
+        useOpus = [conns->connections[0] shouldUseOpus];
     }
+
+    atomic_store(&_useOpus, useOpus);
+    MKAudioInputConnections *old = atomic_exchange(&_connections, conns);
+    if (old == NULL)
+        return;
+
+    // The input thread only holds on to a set while it hands a packet to
+    // its connections, so this is quick.
+    while (atomic_load(&_connectionsInUse) == old)
+        sched_yield();
+    for (i = 0; i < old->count; i++)
+        [old->connections[i] release];
+    free(old);
 }
 
 - (void) initializeMixer {
@@ -217,9 +414,18 @@
     if (psOut)
         free(psOut);
 
+    // At the encoder's rate, captured audio is only copied.
     if (micFrequency != sampleRate) {
-        _micResampler = speex_resampler_init(1, micFrequency, sampleRate, 3, &err);
-        NSLog(@"MKAudioInput: initialized resampler (%iHz -> %iHz)", micFrequency, sampleRate);
+        NSUInteger ncpu = [[NSProcessInfo processInfo] activeProcessorCount];
+        int quality = _settings.enableLowLatency ? SPEEX_RESAMPLER_QUALITY_VOIP : MK_AUDIO_INPUT_RESAMPLER_QUALITY(ncpu);
+        _micResampler = speex_resampler_init(1, micFrequency, sampleRate, quality, &err);
+        NSLog(@"MKAudioInput: initialized resampler (%iHz -> %iHz, quality %i)", micFrequency, sampleRate, quality);
+    }
+
+    _inputChannel = _settings.inputChannel;
+    if (_inputChannel < 0 || _inputChannel > numMicChannels) {
+        NSLog(@"MKAudioInput: input channel %i not available, mixing all %i channels.", _inputChannel, numMicChannels);
+        _inputChannel = 0;
     }
 
     psMic = malloc(micLength * sizeof(short));
@@ -227,54 +433,112 @@
     micSampleSize = numMicChannels * sizeof(short);
     doResetPreprocessor = YES;
 
-    NSLog(@"MKAudioInput: Initialized mixer for %i channel %i Hz and %i channel %i Hz echo", numMicChannels, micFrequency, 0, 0);
+    // Devices that cancel echo by themselves don't need our help.
+    [_echoCanceller release];
+    _echoCanceller = nil;
+    if (_settings.enableEchoCancellation && ![_device providesEchoCancellation])
+        _echoCanceller = [[MKAudioEchoCanceller alloc] initWithFrameSize:frameSize sampleRate:sampleRate];
+    _inputLatency = (uint64_t)([_device inputLatency] * NSEC_PER_SEC);
+
+    NSLog(@"MKAudioInput: Initialized mixer for %i channel %i Hz and %i channel %i Hz echo", numMicChannels, micFrequency, _echoCanceller ? 1 : 0, _echoCanceller ? sampleRate : 0);
 }
 
-- (void) addMicrophoneDataWithBuffer:(short *)input amount:(NSUInteger)nsamp {
+// Called before the input callback is set up. Creates the preprocessor,
+// and runs silence through the resampler and the encoder, so that their
+// code and state are paged in before the first real frame. They are then
+// put back in their initial state. The preprocessor is not run, since
+// silence would skew its noise estimate.
+- (void) warmUp {
+    uint64_t start = MKAudioLatencyNow();
+    NSUInteger avail = 0;
     int i;
 
+    [self resetPreprocessor];
+    doResetPreprocessor = NO;
+
+    // The first packet is taken from the pool now rather than on the
+    // first transmit. It doubles as the encoder's scratch buffer.
+    unsigned char *encbuf = MKVoicePacketBuilderFrameBuffer(&_packetBuilder, &avail);
+
+    memset(psMic, 0, micLength * sizeof(short));
+    memset(psOut, 0, frameSize * sizeof(short));
+    for (i = 0; i < MK_AUDIO_INPUT_WARMUP_FRAMES; i++) {
+        if (_micResampler) {
+            spx_uint32_t inlen = micLength;
+            spx_uint32_t outlen = frameSize;
+            speex_resampler_process_int(_micResampler, 0, psMic, &inlen, psOut, &outlen);
+        }
+        if (_opusEncoder && encbuf)
+            opus_encode(_opusEncoder, _opusBuffer, frameSize, encbuf, (opus_int32)avail);
+        if (_speexEncoder) {
+            speex_encode_int(_speexEncoder, psOut, &_speexBits);
+            speex_bits_reset(&_speexBits);
+        }
+    }
+
+    if (_micResampler)
+        speex_resampler_reset_mem(_micResampler);
+    if (_opusEncoder)
+        opus_encoder_ctl(_opusEncoder, OPUS_RESET_STATE);
+    if (_speexEncoder)
+        speex_encoder_ctl(_speexEncoder, SPEEX_RESET_STATE, NULL);
+
+    _warmUpDuration = MKAudioLatencyNow() - start;
+}
+
+// How long the warm-up took, in nanoseconds.
+- (uint64_t) warmUpDuration {
+    return _warmUpDuration;
+}
+
+// When the first frame was captured, or 0 if none has been yet.
+- (uint64_t) firstFrameTime {
+    return atomic_load_explicit(&_firstFrameTime, memory_order_relaxed);
+}
+
+// The input is nsamp interleaved frames of numMicChannels channels.
+- (void) addMicrophoneDataWithBuffer:(short *)input amount:(NSUInteger)nsamp {
+    if (atomic_load_explicit(&_firstFrameTime, memory_order_relaxed) == 0)
+        atomic_store_explicit(&_firstFrameTime, MKAudioLatencyNow(), memory_order_relaxed);
+
     while (nsamp > 0) {
         NSUInteger left = MIN(nsamp, micLength - micFilled);
 
-        short *output = psMic + micFilled;
+        if (micFilled == 0)
+            _frameCaptureTime = MKAudioLatencyNow();
 
-        for (i = 0; i < left; i++) {
-            output[i] = input[i];
-        }
+        MKAudioInputDownmix(psMic + micFilled, input, left, numMicChannels, _inputChannel);
 
-        input += left;
+        input += left * numMicChannels;
         micFilled += left;
         nsamp -= left;
 
         if (micFilled == micLength) {
             // Should we resample?
             if (_micResampler) {
+                uint64_t start = MKAudioProfilerNow();
                 spx_uint32_t inlen = micLength;
                 spx_uint32_t outlen = frameSize;
                 speex_resampler_process_int(_micResampler, 0, psMic, &inlen, psOut, &outlen);
+                MKAudioProfilerRecordSince(MKAudioProfileStageInputResample, start);
             }
             micFilled = 0;
 
+            _frameReadyTime = MKAudioLatencyNow();
+            MKAudioLatencyRecord(MKAudioLatencyStageCapture, _frameReadyTime - _frameCaptureTime);
+
             [self processAndEncodeAudioFrame];
         }
     }
 }
 
 - (void) processSidetone {
-    // Limit sidetone processing to when we have a 48KHz mic sampling rate.
-    // For newer iOS versions, we're always given 48KHz, but for OS X, we can't
-    // be certain. So this most certainly mutes the sidetone on OS X for many audio
-    // devices.
-    //
-    // When resampling from the internal 48KHz sampling rate to 32KHz for Speex UWB, this
-    // sidetone code path will be adding non-preprocessed frames to the sidetone output.
-    // This is a deliberate choice for now, because it allows us to avoid resampling a
-    // perhaps already resampled signal.
-    if (micFrequency == 48000) {
-        NSData *data = [[NSData alloc] initWithBytes:psMic length:micLength*sizeof(short)];
-        [[[MKAudio sharedAudio] sidetoneOutput] addFrame:data];
-        [data release];
-    }
+    // The sidetone is taken from the frame at the mic's own rate, and
+    // resampled straight to the mixer rate. When the encoder runs at a
+    // different rate (such as 32KHz for Speex UWB), this means the sidetone
+    // is not preprocessed. This is a deliberate choice, because it avoids
+    // resampling an already resampled signal.
+    [[[MKAudio sharedAudio] sidetoneOutput] addSamples:psMic count:micLength];
 }
 
 - (void) resetPreprocessor {
@@ -304,6 +568,10 @@
 
     iArg = _settings.noiseSuppression;
     speex_preprocess_ctl(state, SPEEX_PREPROCESS_SET_NOISE_SUPPRESS, &iArg);
+
+    // Lets the preprocessor suppress what is left of the echo.
+    if (_echoCanceller)
+        speex_preprocess_ctl(state, SPEEX_PREPROCESS_SET_ECHO_STATE, [_echoCanceller echoState]);
 }
 
 - (int) encodeAudioFrameOfSpeech:(BOOL)isSpeech intoBuffer:(unsigned char *)encbuf ofSize:(NSUInteger)max  {
@@ -311,34 +579,29 @@
     int encoded = 1;  
     BOOL resampled = micFrequency != sampleRate;
     
-    if (max < 500)
+    if (encbuf == NULL || max < 127)
         return -1;
 
     BOOL useOpus = YES;
     if (_lastTransmit) {
         useOpus = udpMessageType == UDPVoiceOpusMessage;
     } else if ([[MKVersion sharedVersion] isOpusEnabled]) {
-        @synchronized(self) {
-            if (_connection) {
-                useOpus = [_connection shouldUseOpus];
-            }
-        }
+        useOpus = atomic_load_explicit(&_useOpus, memory_order_relaxed);
     }
     
     if (useOpus && (_settings.codec == MKCodecFormatOpus || _settings.codec == MKCodecFormatCELT)) {
         encoded = 0;
         udpMessageType = UDPVoiceOpusMessage;
-        if (_opusBuffer == nil)
-            _opusBuffer = [[NSMutableData alloc] init];
+        if (max < 500)
+            return -1;
+        memcpy(_opusBuffer + _bufferedFrames * frameSize, (resampled ? psOut : psMic), frameSize*sizeof(short));
         _bufferedFrames++;
-        [_opusBuffer appendBytes:(resampled ? psOut : psMic) length:frameSize*sizeof(short)];
         if (!isSpeech || _bufferedFrames >= _settings.audioPerPacket) {
             // Ensure we have enough frames for the Opus encoder.
             // Pad with silence if needed.
             if (_bufferedFrames < _settings.audioPerPacket) {
                 NSUInteger numMissingFrames = _settings.audioPerPacket - _bufferedFrames;
-                NSUInteger extraBytes = numMissingFrames * frameSize * sizeof(short);
-                [_opusBuffer increaseLengthBy:extraBytes];
+                memset(_opusBuffer + _bufferedFrames * frameSize, 0, numMissingFrames * frameSize * sizeof(short));
                 _bufferedFrames += numMissingFrames;
             }
             if (!_lastTransmit) {
@@ -354,9 +617,11 @@
             }
 
             opus_encoder_ctl(_opusEncoder, OPUS_SET_BITRATE(_settings.quality));
-            len = opus_encode(_opusEncoder, (short *) [_opusBuffer bytes], (opus_int32)(_bufferedFrames * frameSize), encbuf, (opus_int32)max);
-            [_opusBuffer setLength:0];
+            uint64_t start = MKAudioProfilerNow();
+            len = opus_encode(_opusEncoder, _opusBuffer, (opus_int32)(_bufferedFrames * frameSize), encbuf, (opus_int32)max);
+            MKAudioProfilerRecordSince(MKAudioProfileStageEncode, start);
             if (len <= 0) {
+                _bufferedFrames = 0;
                 bitrate = 0;
                 return -1;
             }
@@ -374,8 +639,10 @@
         }
         if (!_lastTransmit)
             speex_encoder_ctl(_speexEncoder, SPEEX_RESET_STATE, NULL);
+        uint64_t start = MKAudioProfilerNow();
         speex_encode_int(_speexEncoder, psOut, &_speexBits);
         len = speex_bits_write(&_speexBits, (char *)encbuf, 127);
+        MKAudioProfilerRecordSince(MKAudioProfileStageEncode, start);
         speex_bits_reset(&_speexBits);
         _bufferedFrames++;
         bitrate = len * 50 * 8;
@@ -385,8 +652,65 @@
     return encoded ? len : -1;
 }
 
+// The first stage of voice detection. Frames that clearly can't start a
+// transmission skip most of the processing, the VAD and the encoder.
+// Only called while not transmitting, so the VAD would need vadMax to
+// open; vadMin is used as a margin for what the preprocessor may add.
+// The frame's level is returned in level, if it was measured.
+- (BOOL) isSilentFrame:(const short *)frame level:(float *)level {
+    float zcr;
+
+    if (_settings.transmitType == MKTransmitTypeContinuous)
+        return NO;
+    if (_settings.transmitType == MKTransmitTypeVAD && _vadGateEnabled && _sampleClock - _vadOpenSample < _vadGateSamples)
+        return NO;
+
+    MKAudioInputFrameStats(frame, frameSize, level, &zcr);
+
+    if (_selfMuted || _suppressed || _muted)
+        return YES;
+    if (_settings.transmitType == MKTransmitTypeToggle)
+        return !_forceTransmit;
+
+    if (_settings.vadMax == 0 && _settings.vadMin == 0)
+        return YES;
+    if (*level < MK_AUDIO_INPUT_SILENCE_DB)
+        return YES;
+    if (*level < MK_AUDIO_INPUT_NOISE_DB && zcr > MK_AUDIO_INPUT_NOISE_ZCR)
+        return YES;
+    if (!_settings.enablePreprocessor || _settings.vadKind == MKVADKindAmplitude) {
+        float boosted = *level;
+        if (!_settings.enablePreprocessor)
+            boosted += 20.0f*log10f(1.0f + _settings.micBoost);
+        return (boosted/96.0f) + 1.0f < _settings.vadMin;
+    }
+    return NO;
+}
+
+- (void) updateSettings:(MKAudioSettings *)settings {
+    MKAudioSettingsSnapshotPublish(&_liveSettings, settings);
+}
+
+// Called on the audio input thread, between frames.
+- (void) applyLiveSettings:(MKAudioSettings *)settings {
+    int noiseSuppression = _settings.noiseSuppression;
+
+    MKAudioSettingsCopyLive(&_settings, settings);
+    _vadGateEnabled = _settings.enableVadGate;
+    _vadGateSamples = (uint64_t)(MAX(_settings.vadGateTimeSeconds, 0.0) * sampleRate);
+    if (_preprocessorState && _settings.noiseSuppression != noiseSuppression) {
+        int iArg = _settings.noiseSuppression;
+        speex_preprocess_ctl(_preprocessorState, SPEEX_PREPROCESS_SET_NOISE_SUPPRESS, &iArg);
+    }
+}
+
 - (void) processAndEncodeAudioFrame {
+    MKAudioSettings live;
+    if (MKAudioSettingsSnapshotRead(&_liveSettings, &_liveSettingsSeen, &live))
+        [self applyLiveSettings:&live];
+
     frameCounter++;
+    _sampleClock += frameSize;
 
     if (doResetPreprocessor) {
         [self resetPreprocessor];
@@ -396,9 +720,34 @@
     int isSpeech = 0;
     BOOL resampled = micFrequency != sampleRate;
     short *frame = resampled ? psOut : psMic;
-    if (_settings.enablePreprocessor) {
-        isSpeech = speex_preprocess_run(_preprocessorState, frame);
+    float silentLevel = -96.0f;
+    BOOL silent = !_lastTransmit && [self isSilentFrame:frame level:&silentLevel];
+
+    // Clearly silent frames skip the echo canceller and the preprocessor,
+    // except for one in every few, so that the echo filter, the noise
+    // estimate and the AGC keep learning while we're idle.
+    BOOL process = YES;
+    if (silent) {
+        _silentFrames++;
+        process = (_silentFrames % MK_AUDIO_INPUT_SILENT_LEARN_INTERVAL) == 0;
     } else {
+        _silentFrames = 0;
+    }
+
+    if (_echoCanceller && process)
+        [_echoCanceller cancelEchoInFrame:frame heardAt:_frameCaptureTime - _inputLatency];
+    if (_settings.enablePreprocessor) {
+        if (process) {
+            uint64_t start = MKAudioProfilerNow();
+            isSpeech = speex_preprocess_run(_preprocessorState, frame);
+            uint64_t elapsed = MKAudioProfilerRecordSince(MKAudioProfileStagePreprocess, start);
+
+            // Running average over the last hundred frames, in microseconds.
+            if (_preprocAvgItems < 100)
+                _preprocAvgItems++;
+            _preprocRunningAvg += ((signed long)(elapsed / NSEC_PER_USEC) - _preprocRunningAvg) / _preprocAvgItems;
+        }
+    } else if (!silent) {
         int i;
         for (i = 0; i < frameSize; i++) {
             float val = (frame[i] / 32767.0f) * (1.0f + _settings.micBoost);
@@ -407,6 +756,20 @@
             frame[i] = val * 32767.0f;
         }
     }
+
+    // The clean level of a silent frame is estimated from its raw level,
+    // the same way as below.
+    if (silent) {
+        int agcGain = 0;
+        if (_settings.enablePreprocessor)
+            speex_preprocess_ctl(_preprocessorState, SPEEX_PREPROCESS_GET_AGC_GAIN, &agcGain);
+        else
+            silentLevel += 20.0f*log10f(1.0f + _settings.micBoost);
+        _peakCleanMic = MAX(silentLevel - (float)agcGain, -96.0f);
+        _speechProbability = 0.0f;
+        _doTransmit = NO;
+        return;
+    }
     
     float sum = 1.0f;
     int i;
@@ -440,22 +803,15 @@
             _doTransmit = NO;
         } else if (level > _settings.vadMax) {
             _doTransmit = YES;
-            if(_vadGateEnabled) {
-                _vadOpenLastTime = [[NSDate date] timeIntervalSince1970];
-            }
+            _vadOpenSample = _sampleClock;
         } else if (level > _settings.vadMin && _lastTransmit) {
             _doTransmit = YES;
-            if(_vadGateEnabled) {
-                _vadOpenLastTime = [[NSDate date] timeIntervalSince1970];
-            }
+            _vadOpenSample = _sampleClock;
         }
         else if (level < _settings.vadMin)
         {
-            if(_vadGateEnabled) {
-                double currTime = [[NSDate date] timeIntervalSince1970];
-                if((currTime - _vadOpenLastTime) < _vadGateTimeSeconds) {
-                    _doTransmit = YES;
-                }
+            if (_vadGateEnabled && _sampleClock - _vadOpenSample < _vadGateSamples) {
+                _doTransmit = YES;
             }
         }
     } else if (_settings.transmitType == MKTransmitTypeContinuous) {
@@ -478,89 +834,125 @@
     if (_lastTransmit != _doTransmit) {
         // fixme(mkrautz): Handle more talkstates
         MKTalkState talkState = _doTransmit ? MKTalkStateTalking : MKTalkStatePassive;
-        NSNotificationCenter *center = [NSNotificationCenter defaultCenter];
-        NSDictionary *talkStateDict = [NSDictionary dictionaryWithObjectsAndKeys:
-                                       [NSNumber numberWithUnsignedInteger:talkState], @"talkState",
-                                       nil];
-        NSNotification *notification = [NSNotification notificationWithName:@"MKAudioUserTalkStateChanged" object:talkStateDict];
-        [center performSelectorOnMainThread:@selector(postNotification:) withObject:notification waitUntilDone:NO];
+        MKAudioTalkStatePost(NSNotFound, talkState, MKAudioTalkStateSampleTime(_frameCaptureTime));
     }
      
      if (!_lastTransmit && !_doTransmit) {
          return;
      }
     
-    if (_encodingOutputBuffer == nil)
-        _encodingOutputBuffer = [[NSMutableData alloc] initWithLength:960];
-    int len = [self encodeAudioFrameOfSpeech:_doTransmit intoBuffer:[_encodingOutputBuffer mutableBytes] ofSize:[_encodingOutputBuffer length]];
+    if (_bufferedFrames == 0) {
+        _packetCaptureTime = _frameCaptureTime;
+        _packetReadyTime = _frameReadyTime;
+        NSUInteger slot;
+        for (slot = 0; slot < MK_AUDIO_MAX_CONNECTIONS; slot++) {
+            _packetTargets[slot] = atomic_load_explicit(&_voiceTargets[slot], memory_order_relaxed);
+            if (!_lastTransmit)
+                _prevTargets[slot] = _packetTargets[slot];
+        }
+    }
+
+    // Encode straight into the outgoing packet.
+    NSUInteger avail = 0;
+    unsigned char *encbuf = MKVoicePacketBuilderFrameBuffer(&_packetBuilder, &avail);
+    int len = [self encodeAudioFrameOfSpeech:_doTransmit intoBuffer:encbuf ofSize:avail];
+    MKAudioLatencyRecordSince(MKAudioLatencyStageEncode, _frameReadyTime);
     if (len >= 0) {
-        NSData *outputBuffer = [[NSData alloc] initWithBytes:[_encodingOutputBuffer bytes] length:len];
-        [self flushCheck:outputBuffer terminator:!_doTransmit];
-        [outputBuffer release];
+        MKVoicePacketBuilderCommitFrame(&_packetBuilder, (NSUInteger)len, udpMessageType != UDPVoiceOpusMessage);
+        [self flushCheckWithTerminator:!_doTransmit];
     }
     _lastTransmit = _doTransmit;
 }
 
 // Flush check.
-// Queue up frames, and send them to the server when enough frames have been
-// queued up.
-- (void) flushCheck:(NSData *)codedSpeech terminator:(BOOL)terminator {
-    [frameList addObject:codedSpeech];
-    
-    if (! terminator && _bufferedFrames < _settings.audioPerPacket) {
+// Frames are encoded straight into the packet builder's current packet. Once
+// enough frames have been queued up (or the packet is about to run out of
+// room), the header is filled in and the packet is handed to the connection.
+- (void) flushCheckWithTerminator:(BOOL)terminator {
+    NSUInteger avail = 0;
+    MKVoicePacketBuilderFrameBuffer(&_packetBuilder, &avail);
+    if (! terminator && _bufferedFrames < _settings.audioPerPacket && avail >= 127) {
         return;
     }
 
-    int flags = 0;
-    if (terminator)
-        flags = 0; /* g.iPrevTarget. */
+    uint64_t start = MKAudioProfilerNow();
+    NSUInteger targets[MK_AUDIO_MAX_CONNECTIONS];
+    NSUInteger i, j, slot;
+    for (slot = 0; slot < MK_AUDIO_MAX_CONNECTIONS; slot++) {
+        targets[slot] = terminator ? _prevTargets[slot] : _packetTargets[slot];
+        _prevTargets[slot] = targets[slot];
+    }
 
-    /*
-     * Server loopback:
-     * flags = 0x1f;
-     */
-    flags |= (udpMessageType << 5);
+    // Mark the set as in use, and make sure it is still the published one,
+    // so that it can't be freed underneath us.
+    MKAudioInputConnections *conns;
+    for (;;) {
+        conns = atomic_load(&_connections);
+        atomic_store(&_connectionsInUse, conns);
+        if (atomic_load(&_connections) == conns)
+            break;
+    }
+    NSUInteger n = conns ? conns->count : 0;
+
+    // Server loopback, for latency measurements.
+    BOOL loopback = atomic_load_explicit(&_loopback, memory_order_relaxed);
+    unsigned char flags[MK_AUDIO_MAX_CONNECTIONS];
+    for (i = 0; i < n; i++) {
+        NSUInteger target = loopback ? 0x1f : targets[conns->slots[i]];
+        flags[i] = (unsigned char)((target | (udpMessageType << 5)) & 0xff);
+    }
 
-    unsigned char data[1024];
-    data[0] = (unsigned char )(flags & 0xff);
-    
     int frames = _bufferedFrames;
     _bufferedFrames = 0;
-    
-    MKPacketDataStream *pds = [[MKPacketDataStream alloc] initWithBuffer:(data+1) length:1023];
-    [pds addVarint:(frameCounter - frames)];
-
-    if (udpMessageType == UDPVoiceOpusMessage) {
-       NSData *frame = [frameList objectAtIndex:0]; 
-        uint64_t header = [frame length];
-        if (terminator)
-            header |= (1 << 13); // Opus terminator flag
-        [pds addVarint:header];
-        [pds appendBytes:(unsigned char *)[frame bytes] length:[frame length]];
-    } else {
-        /* fix terminator stuff here. */
-        NSUInteger i, nframes = [frameList count];
-        for (i = 0; i < nframes; i++) {
-            NSData *frame = [frameList objectAtIndex:i];
-            unsigned char head = (unsigned char)[frame length];
-            if (i < nframes-1)
-                head |= 0x80;
-            [pds appendValue:head];
-            [pds appendBytes:(unsigned char *)[frame bytes] length:[frame length]];
-        }
-    }
-    
-    [frameList removeAllObjects];
 
-    NSUInteger len = [pds size] + 1;
-    NSData *msgData = [[NSData alloc] initWithBytes:data length:len];
-    [pds release];
-    
-    @synchronized(self) {
-        [_connection sendVoiceData:msgData];
+    /* fix terminator stuff here (Speex). */
+    MKVoicePacket *packet = MKVoicePacketBuilderFinish(&_packetBuilder, n > 0 ? flags[0] : (unsigned char)(udpMessageType << 5), (uint64_t)(frameCounter - frames),
+                                                       udpMessageType == UDPVoiceOpusMessage, terminator);
+    if (packet == NULL) {
+        atomic_store(&_connectionsInUse, NULL);
+        return;
     }
 
-    [msgData release];
+    packet->timestamp = MKAudioLatencyNow();
+    MKAudioLatencyRecord(MKAudioLatencyStagePacketize, packet->timestamp - _packetReadyTime);
+    if (loopback)
+        MKAudioLatencyNoteCaptured(packet->sequence, _packetCaptureTime);
+
+    // Each connection takes over a reference to a packet with its own voice
+    // target in the flags byte. Sending doesn't modify a packet, so the
+    // connections that share a target share the packet, and a copy is only
+    // made for each other target in use. All references are taken before
+    // anything is sent, since a connection may release its packet at once.
+    MKVoicePacket *sent[MK_AUDIO_MAX_CONNECTIONS];
+    for (i = 0; i < n; i++) {
+        sent[i] = NULL;
+        if (i == 0) {
+            sent[i] = packet;
+            continue;
+        }
+        for (j = 0; j < i; j++) {
+            if (sent[j] != NULL && flags[j] == flags[i]) {
+                sent[i] = MKVoicePacketRetain(sent[j]);
+                break;
+            }
+        }
+        if (sent[i] == NULL) {
+            sent[i] = MKVoicePacketCreateWithBytes(MKVoicePacketBytes(packet), packet->length);
+            if (sent[i] != NULL) {
+                MKVoicePacketBytes(sent[i])[0] = flags[i];
+                sent[i]->sequence = packet->sequence;
+                sent[i]->timestamp = packet->timestamp;
+            }
+        }
+    }
+    if (n == 0)
+        MKVoicePacketRelease(packet);
+    for (i = 0; i < n; i++) {
+        if (sent[i] != NULL)
+            [conns->connections[i] sendVoicePacket:sent[i]];
+    }
+    atomic_store(&_connectionsInUse, NULL);
+    MKAudioProfilerRecordSince(MKAudioProfileStageFlush, start);
 }
 
 - (void) setForceTransmit:(BOOL)flag {
@@ -583,6 +975,20 @@
     return _peakCleanMic;
 }
 
+// While enabled, packets are sent with the server loopback target, so that
+// the server sends them right back to us instead of to anyone else.
+- (void) setLoopback:(BOOL)loopback {
+    atomic_store_explicit(&_loopback, loopback, memory_order_relaxed);
+}
+
+// Target 0 is normal talking. Targets 1 to 30 must have been registered
+// with the server with a VoiceTarget message.
+- (void) setVoiceTarget:(NSUInteger)target forSlot:(NSUInteger)slot {
+    if (slot >= MK_AUDIO_MAX_CONNECTIONS)
+        return;
+    atomic_store_explicit(&_voiceTargets[slot], MIN(target, MK_AUDIO_INPUT_MAX_VOICE_TARGET), memory_order_relaxed);
+}
+
 - (void) setSelfMuted:(BOOL)selfMuted {
     _selfMuted = selfMuted;
 }
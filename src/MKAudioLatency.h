@@ -0,0 +1,28 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#import <MumbleKit/MKAudio.h>
+
+// Process-wide latency histograms for each stage of the voice pipeline.
+//
+// Recording a sample is a handful of relaxed atomic operations, so it is
+// safe to do from the audio threads. Timestamps are CLOCK_MONOTONIC
+// nanoseconds, and 0 means "not stamped".
+
+uint64_t MKAudioLatencyNow(void);
+void MKAudioLatencyRecord(MKAudioLatencyStage stage, uint64_t ns);
+void MKAudioLatencyRecordSince(MKAudioLatencyStage stage, uint64_t start);
+void MKAudioLatencyGetHistogram(MKAudioLatencyStage stage, MKAudioLatencyHistogram *hist);
+double MKAudioLatencyBucketLimit(NSUInteger bucket);
+void MKAudioLatencyReset(void);
+
+// Loopback measurement. The input side notes when each packet it sends was
+// captured and sent, keyed by sequence number. Packets that come back for
+// the loopback session are matched up against those.
+void MKAudioLatencySetLoopbackSession(NSUInteger session);
+BOOL MKAudioLatencyIsLoopbackSession(NSUInteger session);
+void MKAudioLatencyNoteCaptured(NSUInteger seq, uint64_t captured);
+void MKAudioLatencyNoteSent(NSUInteger seq, uint64_t sent);
+void MKAudioLatencyNoteReceived(NSUInteger seq, uint64_t received);
+void MKAudioLatencyNotePlayout(NSUInteger seq, uint64_t playout);
@@ -0,0 +1,195 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#import "MKAudioLatency.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// Bucket i holds samples below 0.1ms * 2^(i/2). The last bucket holds
+// everything above that, which is anything over about three seconds.
+#define MK_AUDIO_LATENCY_FIRST_LIMIT_NS  100000.0
+
+// Enough to match up about five seconds of 10ms frames.
+#define MK_AUDIO_LATENCY_LOOPBACK_SLOTS  512
+
+typedef struct _MKAudioLatencyStats {
+    _Atomic uint64_t     count;
+    _Atomic uint64_t     sum;
+    _Atomic uint64_t     min;
+    _Atomic uint64_t     max;
+    _Atomic uint64_t     buckets[MK_AUDIO_LATENCY_BUCKETS];
+} MKAudioLatencyStats;
+
+typedef struct _MKAudioLatencyLoopbackSlot {
+    _Atomic NSUInteger   seq;
+    _Atomic uint64_t     captured;
+    _Atomic uint64_t     sent;
+} MKAudioLatencyLoopbackSlot;
+
+static MKAudioLatencyStats MKAudioLatencyStages[MKAudioLatencyStageCount];
+static uint64_t MKAudioLatencyLimits[MK_AUDIO_LATENCY_BUCKETS - 1];
+static pthread_once_t MKAudioLatencyOnce = PTHREAD_ONCE_INIT;
+
+static _Atomic NSUInteger MKAudioLatencyLoopback = NSNotFound;
+static MKAudioLatencyLoopbackSlot MKAudioLatencyLoopbackSlots[MK_AUDIO_LATENCY_LOOPBACK_SLOTS];
+
+static void MKAudioLatencyInit(void) {
+    NSUInteger i;
+    for (i = 0; i < MK_AUDIO_LATENCY_BUCKETS - 1; i++)
+        MKAudioLatencyLimits[i] = (uint64_t)(MK_AUDIO_LATENCY_FIRST_LIMIT_NS * pow(2.0, i / 2.0));
+    for (i = 0; i < MKAudioLatencyStageCount; i++)
+        atomic_store(&MKAudioLatencyStages[i].min, UINT64_MAX);
+}
+
+uint64_t MKAudioLatencyNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static NSUInteger MKAudioLatencyBucket(uint64_t ns) {
+    NSUInteger lo = 0, hi = MK_AUDIO_LATENCY_BUCKETS - 1;
+    while (lo < hi) {
+        NSUInteger mid = (lo + hi) / 2;
+        if (ns < MKAudioLatencyLimits[mid])
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+void MKAudioLatencyRecord(MKAudioLatencyStage stage, uint64_t ns) {
+    pthread_once(&MKAudioLatencyOnce, MKAudioLatencyInit);
+    if (stage >= MKAudioLatencyStageCount)
+        return;
+
+    MKAudioLatencyStats *s = &MKAudioLatencyStages[stage];
+    atomic_fetch_add_explicit(&s->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->sum, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->buckets[MKAudioLatencyBucket(ns)], 1, memory_order_relaxed);
+
+    uint64_t cur = atomic_load_explicit(&s->min, memory_order_relaxed);
+    while (ns < cur && !atomic_compare_exchange_weak_explicit(&s->min, &cur, ns, memory_order_relaxed, memory_order_relaxed))
+        ;
+    cur = atomic_load_explicit(&s->max, memory_order_relaxed);
+    while (ns > cur && !atomic_compare_exchange_weak_explicit(&s->max, &cur, ns, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+void MKAudioLatencyRecordSince(MKAudioLatencyStage stage, uint64_t start) {
+    if (start == 0)
+        return;
+    uint64_t now = MKAudioLatencyNow();
+    if (now >= start)
+        MKAudioLatencyRecord(stage, now - start);
+}
+
+// The counters are read one by one while they may still be updated, so the
+// histogram can be off by a few samples. That is fine for statistics.
+void MKAudioLatencyGetHistogram(MKAudioLatencyStage stage, MKAudioLatencyHistogram *hist) {
+    NSUInteger i;
+
+    pthread_once(&MKAudioLatencyOnce, MKAudioLatencyInit);
+    memset(hist, 0, sizeof(MKAudioLatencyHistogram));
+    if (stage >= MKAudioLatencyStageCount)
+        return;
+
+    MKAudioLatencyStats *s = &MKAudioLatencyStages[stage];
+    uint64_t count = atomic_load_explicit(&s->count, memory_order_relaxed);
+    if (count == 0)
+        return;
+
+    hist->count = (NSUInteger)count;
+    hist->minimum = atomic_load_explicit(&s->min, memory_order_relaxed) / 1e6;
+    hist->maximum = atomic_load_explicit(&s->max, memory_order_relaxed) / 1e6;
+    hist->mean = (atomic_load_explicit(&s->sum, memory_order_relaxed) / 1e6) / count;
+    for (i = 0; i < MK_AUDIO_LATENCY_BUCKETS; i++)
+        hist->buckets[i] = (NSUInteger)atomic_load_explicit(&s->buckets[i], memory_order_relaxed);
+}
+
+// Returns the upper limit of a bucket in milliseconds. The last bucket has
+// no upper limit.
+double MKAudioLatencyBucketLimit(NSUInteger bucket) {
+    pthread_once(&MKAudioLatencyOnce, MKAudioLatencyInit);
+    if (bucket >= MK_AUDIO_LATENCY_BUCKETS - 1)
+        return INFINITY;
+    return MKAudioLatencyLimits[bucket] / 1e6;
+}
+
+void MKAudioLatencyReset(void) {
+    NSUInteger i, j;
+
+    pthread_once(&MKAudioLatencyOnce, MKAudioLatencyInit);
+    for (i = 0; i < MKAudioLatencyStageCount; i++) {
+        MKAudioLatencyStats *s = &MKAudioLatencyStages[i];
+        atomic_store(&s->count, 0);
+        atomic_store(&s->sum, 0);
+        atomic_store(&s->min, UINT64_MAX);
+        atomic_store(&s->max, 0);
+        for (j = 0; j < MK_AUDIO_LATENCY_BUCKETS; j++)
+            atomic_store(&s->buckets[j], 0);
+    }
+}
+
+void MKAudioLatencySetLoopbackSession(NSUInteger session) {
+    NSUInteger i;
+    for (i = 0; i < MK_AUDIO_LATENCY_LOOPBACK_SLOTS; i++)
+        atomic_store(&MKAudioLatencyLoopbackSlots[i].seq, NSNotFound);
+    atomic_store(&MKAudioLatencyLoopback, session);
+}
+
+BOOL MKAudioLatencyIsLoopbackSession(NSUInteger session) {
+    NSUInteger loopback = atomic_load_explicit(&MKAudioLatencyLoopback, memory_order_relaxed);
+    return loopback != NSNotFound && loopback == session;
+}
+
+static MKAudioLatencyLoopbackSlot *MKAudioLatencyLoopbackSlotForSeq(NSUInteger seq) {
+    MKAudioLatencyLoopbackSlot *slot = &MKAudioLatencyLoopbackSlots[seq % MK_AUDIO_LATENCY_LOOPBACK_SLOTS];
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != seq)
+        return NULL;
+    return slot;
+}
+
+// Called on the audio input thread with the sequence number of a packet
+// that is about to be sent, and the time its first sample was captured.
+void MKAudioLatencyNoteCaptured(NSUInteger seq, uint64_t captured) {
+    if (atomic_load_explicit(&MKAudioLatencyLoopback, memory_order_relaxed) == NSNotFound)
+        return;
+    MKAudioLatencyLoopbackSlot *slot = &MKAudioLatencyLoopbackSlots[seq % MK_AUDIO_LATENCY_LOOPBACK_SLOTS];
+    atomic_store_explicit(&slot->seq, NSNotFound, memory_order_relaxed);
+    atomic_store_explicit(&slot->captured, captured, memory_order_relaxed);
+    atomic_store_explicit(&slot->sent, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq, memory_order_release);
+}
+
+void MKAudioLatencyNoteSent(NSUInteger seq, uint64_t sent) {
+    MKAudioLatencyLoopbackSlot *slot = MKAudioLatencyLoopbackSlotForSeq(seq);
+    if (slot != NULL)
+        atomic_store_explicit(&slot->sent, sent, memory_order_relaxed);
+}
+
+// A packet came back from the server: the time since it was written to
+// the socket is the network round trip.
+void MKAudioLatencyNoteReceived(NSUInteger seq, uint64_t received) {
+    MKAudioLatencyLoopbackSlot *slot = MKAudioLatencyLoopbackSlotForSeq(seq);
+    if (slot == NULL)
+        return;
+    uint64_t sent = atomic_load_explicit(&slot->sent, memory_order_relaxed);
+    if (sent != 0 && received >= sent)
+        MKAudioLatencyRecord(MKAudioLatencyStageNetwork, received - sent);
+}
+
+// The packet's audio has been decoded, and will be mixed at the given time.
+void MKAudioLatencyNotePlayout(NSUInteger seq, uint64_t playout) {
+    MKAudioLatencyLoopbackSlot *slot = MKAudioLatencyLoopbackSlotForSeq(seq);
+    if (slot == NULL)
+        return;
+    uint64_t captured = atomic_exchange_explicit(&slot->captured, 0, memory_order_relaxed);
+    if (captured != 0 && playout >= captured)
+        MKAudioLatencyRecord(MKAudioLatencyStageMouthToEar, playout - captured);
+}
@@ -0,0 +1,25 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#import <MumbleKit/MKAudio.h>
+
+// Settings are either live or need a restart. Live settings (quality, VAD,
+// noise suppression, mic boost, comfort noise and sidetone) are handed to the
+// running audio threads, which pick them up at their next frame boundary.
+// Anything else changes how the devices or codecs are set up.
+BOOL MKAudioSettingsRequireRestart(const MKAudioSettings *running, const MKAudioSettings *updated);
+void MKAudioSettingsCopyLive(MKAudioSettings *dst, const MKAudioSettings *src);
+
+// A settings snapshot is published by one thread at a time and read by a
+// single audio thread without locking. _seq is odd while a publish is in
+// progress. The reader never waits: if it races with a publish, it picks
+// the settings up at its next frame boundary instead.
+typedef struct _MKAudioSettingsSnapshot {
+    MKAudioSettings    settings;
+    _Atomic uint32_t   seq;
+} MKAudioSettingsSnapshot;
+
+void MKAudioSettingsSnapshotInit(MKAudioSettingsSnapshot *snap, const MKAudioSettings *settings);
+void MKAudioSettingsSnapshotPublish(MKAudioSettingsSnapshot *snap, const MKAudioSettings *settings);
+BOOL MKAudioSettingsSnapshotRead(MKAudioSettingsSnapshot *snap, uint32_t *seen, MKAudioSettings *settings);
@@ -0,0 +1,72 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#import "MKAudioLiveSettings.h"
+
+#include <stdatomic.h>
+
+BOOL MKAudioSettingsRequireRestart(const MKAudioSettings *running, const MKAudioSettings *updated) {
+    return running->codec != updated->codec
+        || running->audioPerPacket != updated->audioPerPacket
+        || running->jitterBufferSize != updated->jitterBufferSize
+        || running->outputDelay != updated->outputDelay
+        || running->inputChannel != updated->inputChannel
+        || running->enablePreprocessor != updated->enablePreprocessor
+        || running->enableEchoCancellation != updated->enableEchoCancellation
+        || running->preferReceiverOverSpeaker != updated->preferReceiverOverSpeaker
+        || running->enableLowLatency != updated->enableLowLatency
+        || running->enablePositionalAudio != updated->enablePositionalAudio
+        || running->positionalHeadphones != updated->positionalHeadphones
+        || running->positionalMinDistance != updated->positionalMinDistance
+        || running->positionalMaxDistance != updated->positionalMaxDistance
+        || running->positionalMaxDistanceVolume != updated->positionalMaxDistanceVolume
+        || running->enableHeadlessAudio != updated->enableHeadlessAudio
+        || running->headlessClock != updated->headlessClock;
+}
+
+void MKAudioSettingsCopyLive(MKAudioSettings *dst, const MKAudioSettings *src) {
+    dst->transmitType = src->transmitType;
+    dst->vadKind = src->vadKind;
+    dst->vadMax = src->vadMax;
+    dst->vadMin = src->vadMin;
+    dst->enableVadGate = src->enableVadGate;
+    dst->vadGateTimeSeconds = src->vadGateTimeSeconds;
+    dst->quality = src->quality;
+    dst->opusForceCELTMode = src->opusForceCELTMode;
+    dst->noiseSuppression = src->noiseSuppression;
+    dst->micBoost = src->micBoost;
+    dst->enableSideTone = src->enableSideTone;
+    dst->sidetoneVolume = src->sidetoneVolume;
+    dst->enableComfortNoise = src->enableComfortNoise;
+    dst->comfortNoiseLevel = src->comfortNoiseLevel;
+    dst->audioMixerDebug = src->audioMixerDebug;
+}
+
+void MKAudioSettingsSnapshotInit(MKAudioSettingsSnapshot *snap, const MKAudioSettings *settings) {
+    memcpy(&snap->settings, settings, sizeof(MKAudioSettings));
+    atomic_init(&snap->seq, 0);
+}
+
+// Publishers must be serialized by the caller.
+void MKAudioSettingsSnapshotPublish(MKAudioSettingsSnapshot *snap, const MKAudioSettings *settings) {
+    uint32_t seq = atomic_load_explicit(&snap->seq, memory_order_relaxed);
+    atomic_store_explicit(&snap->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&snap->settings, settings, sizeof(MKAudioSettings));
+    atomic_store_explicit(&snap->seq, seq + 2, memory_order_release);
+}
+
+// Called on an audio thread. Copies the snapshot into settings and returns
+// YES if it was published after the one last seen.
+BOOL MKAudioSettingsSnapshotRead(MKAudioSettingsSnapshot *snap, uint32_t *seen, MKAudioSettings *settings) {
+    uint32_t seq = atomic_load_explicit(&snap->seq, memory_order_acquire);
+    if (seq == *seen || (seq & 1))
+        return NO;
+    memcpy(settings, &snap->settings, sizeof(MKAudioSettings));
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&snap->seq, memory_order_relaxed) != seq)
+        return NO;
+    *seen = seq;
+    return YES;
+}
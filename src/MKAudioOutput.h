@@ -7,6 +7,17 @@
 #import <MumbleKit/MKConnection.h>
 #import "MKAudioOutputUser.h"
 #import "MKAudioDevice.h"
+#import "MKVoicePacket.h"
+
+// Several connections can share the audio subsystem. Their talkers are
+// keyed by session, with the slot of the connection they came from in the
+// bits above the session. The first connection's slot is 0, so its keys
+// are plain sessions.
+#define MK_AUDIO_MAX_CONNECTIONS          8
+#define MK_AUDIO_SESSION_BITS             24
+#define MK_AUDIO_SESSION_MASK             (((NSUInteger)1 << MK_AUDIO_SESSION_BITS) - 1)
+#define MK_AUDIO_SESSION_KEY(slot, sess)  (((NSUInteger)(slot) << MK_AUDIO_SESSION_BITS) | ((sess) & MK_AUDIO_SESSION_MASK))
+#define MK_AUDIO_SESSION_SLOT(key)        ((key) >> MK_AUDIO_SESSION_BITS)
 
 @class MKUser;
 
@@ -18,6 +29,17 @@
 - (void) removeBuffer:(MKAudioOutputUser *)u;
 - (BOOL) mixFrames: (void *)frames amount:(unsigned int)nframes;
 - (void) addFrameToBufferWithSession:(NSUInteger)session data:(NSData *)data sequence:(NSUInteger)seq type:(MKUDPMessageType)msgType;
+- (void) addVoicePacket:(MKVoicePacket *)packet forSession:(NSUInteger)session sequence:(NSUInteger)seq type:(MKUDPMessageType)msgType;
+- (void) setListenerPosition:(const float *)position front:(const float *)front top:(const float *)top;
+- (void) setMuted:(BOOL)muted forSession:(NSUInteger)session;
+- (void) setVolume:(float)volume forSession:(NSUInteger)session;
+- (void) setVolume:(float)volume forConnectionSlot:(NSUInteger)slot;
+- (void) setDeafened:(BOOL)deafened;
+- (void) setUserOutputSink:(MKAudioUserPCMSink)sink;
+- (void) updateSettings:(MKAudioSettings *)settings;
 - (NSDictionary *) copyMixerInfo;
 
+- (uint64_t) warmUpDuration;
+- (uint64_t) firstRenderTime;
+
 @end
@@ -7,69 +7,252 @@
 #import "MKAudioOutputSpeech.h"
 #import "MKAudioOutputUser.h"
 #import "MKAudioOutputSidetone.h"
+#import "MKAudioDecodeScheduler.h"
+#import "MKAudioSourceTable.h"
+#import "MKAudioLatency.h"
+#import "MKAudioEchoCanceller.h"
+#import "MKAudioProfiler.h"
+#import "MKAudioComfortNoise.h"
+#import "MKAudioLiveSettings.h"
 #import "MKAudioDevice.h"
 
 #import <AudioUnit/AudioUnit.h>
 #import <AudioUnit/AUComponent.h>
 #import <AudioToolbox/AudioToolbox.h>
 
+#include <speex/speex_resampler.h>
+#include <stdatomic.h>
+#include <simd/simd.h>
+
+// Number of frames the decode thread tries to keep queued up for each
+// talker, on top of the amount of audio requested by the last render call.
+// The low latency profile keeps a single frame.
+#define MK_AUDIO_DECODE_AHEAD_FRAMES  3
+
+// The mixer runs at the sample rate of Opus, so Opus talkers never need to
+// be resampled. If the device runs at a different rate, the mixed signal is
+// resampled once on its way out, in chunks of at most this many frames.
+#define MK_AUDIO_OUTPUT_STAGING_FRAMES  1024
+
+// Retired talkers are kept around and reset for the next talk burst instead
+// of being torn down. A few Opus talkers are created up front, so that even
+// the first talk bursts don't have to wait for a decoder to be set up.
+#define MK_AUDIO_OUTPUT_SPEECH_POOL_SIZE     32
+#define MK_AUDIO_OUTPUT_SPEECH_POOL_PREWARM  4
+
+// How many finished talkers the render thread can hand to the decode thread
+// per cycle. Any more are found finished again in the next cycle.
+#define MK_AUDIO_OUTPUT_FINISHED_RING  64
+
+// The largest interaural time difference of a human head, in seconds.
+#define MK_AUDIO_MAX_ITD_SECONDS      0.00066f
+
+typedef struct _MKAudioOutputFinished {
+    MKAudioOutputUser    *talker;
+    NSUInteger            session;
+} MKAudioOutputFinished;
+
+typedef struct _MKAudioListener {
+    float   position[3];
+    float   front[3];
+    float   top[3];
+} MKAudioListener;
+
 @interface MKAudioOutput () {
     MKAudioDevice        *_device;
     MKAudioSettings       _settings;
+
+    // Live settings changes, picked up by the render thread at the start
+    // of each cycle.
+    MKAudioSettingsSnapshot _liveSettings;
+    uint32_t              _liveSettingsSeen;
     AudioUnit             _audioUnit;
     int                   _sampleSize;
     int                   _frameSize;
+    int                   _decodeAheadFrames;
     int                   _mixerFrequency;
+    int                   _outputFrequency;
     int                   _numChannels;
     float                *_speakerVolume;
+
+    // Output resampling from the mixer rate to the device rate. _staging
+    // holds interleaved frames that were mixed but not yet resampled.
+    SpeexResamplerState  *_resampler;
+    float                *_staging;
+    NSUInteger            _stagedOffset;
+    NSUInteger            _stagedFrames;
+    BOOL                  _stagedActive;
+
+    // Whether the mix is passed to the input side's echo canceller, and
+    // how long it takes from the mixer to the speaker.
+    BOOL                  _echoReference;
+    uint64_t              _outputLatency;
+
+    // The listener is updated from other threads and read by the render
+    // thread. _listenerSeq is odd while an update is in progress.
+    MKAudioListener       _listener;
+    _Atomic uint32_t      _listenerSeq;
+    // _outputs is read without locking. _outputLock serializes changes
+    // to it, and guards _speechPool.
     NSLock               *_outputLock;
-    NSMutableDictionary  *_outputs;
+    MKAudioSourceTable    _outputs;
+    NSMutableArray       *_speechPool;
+
+    // Talkers the render thread found finished, each with a reference. The
+    // decode thread takes them out of _outputs, so that the render thread
+    // never takes _outputLock or allocates. Written by the render thread only.
+    MKAudioOutputFinished _finished[MK_AUDIO_OUTPUT_FINISHED_RING];
+    _Atomic uint32_t      _finishedHead;
+    _Atomic uint32_t      _finishedTail;
+
+    // Local playback settings, guarded by _outputLock. They are applied to
+    // each talker when it is added to _outputs, and whenever they change.
+    NSMutableIndexSet    *_mutedSessions;
+    NSMutableDictionary  *_sessionVolumes;
+    float                 _connectionVolumes[MK_AUDIO_MAX_CONNECTIONS];
+    BOOL                  _deafened;
+
+    NSThread             *_decodeThread;
+    MKAudioDecodeScheduler *_decodeScheduler;
+    dispatch_semaphore_t  _decodeSema;
+    dispatch_semaphore_t  _decodeExitSema;
+    _Atomic BOOL          _decodeRunning;
+    _Atomic NSUInteger    _renderSize;
     
     NSLock               *_mixerInfoLock;
     NSDictionary         *_mixerInfo;
 
-    double                _cngAmpliScaler;
-    double                _cngLastSample;
-    long                  _cngRegister1;
-    long                  _cngRegister2;
-    BOOL                  _cngEnabled;
+    // The render thread only takes _userSinkLock while a sink is set.
+    NSLock               *_userSinkLock;
+    MKAudioUserPCMSink    _userSink;
+    _Atomic BOOL          _hasUserSink;
+
+    // Startup measurements, in nanoseconds on the MKAudioLatencyNow clock.
+    uint64_t              _warmUpDuration;
+    _Atomic uint64_t      _firstRenderTime;
+
+    // Comfort noise can be turned on while running, so the generator is
+    // always there.
+    MKAudioComfortNoise  *_comfortNoise;
 }
 @end
 
+@interface MKAudioOutput (Private)
+- (void) reclaimSource:(MKAudioOutputUser *)u;
+- (void) retireFinishedTalkers;
+@end
+
+// Called from within MKAudioSourceTable writes, so with _outputLock held.
+static void MKAudioOutputReclaimSource(void *ctx, id source) {
+    [(MKAudioOutput *)ctx reclaimSource:source];
+}
+
 @implementation MKAudioOutput
 
 - (id) initWithDevice:(MKAudioDevice *)device andSettings:(MKAudioSettings *)settings {
+    NSUInteger n;
+
     if ((self = [super init])) {
         memcpy(&_settings, settings, sizeof(MKAudioSettings));
+        MKAudioSettingsSnapshotInit(&_liveSettings, &_settings);
+        _liveSettingsSeen = 0;
         _device = [device retain];
         _sampleSize = 0;
         _frameSize = SAMPLE_RATE / 100;
+        _decodeAheadFrames = _settings.enableLowLatency ? 1 : MK_AUDIO_DECODE_AHEAD_FRAMES;
         _mixerFrequency = 0;
         _outputLock = [[NSLock alloc] init];
-        _outputs = [[NSMutableDictionary alloc] init];
+        MKAudioSourceTableInit(&_outputs, MKAudioOutputReclaimSource, self);
+        _speechPool = [[NSMutableArray alloc] initWithCapacity:MK_AUDIO_OUTPUT_SPEECH_POOL_SIZE];
+        _mutedSessions = [[NSMutableIndexSet alloc] init];
+        _sessionVolumes = [[NSMutableDictionary alloc] init];
+        for (n = 0; n < MK_AUDIO_MAX_CONNECTIONS; n++)
+            _connectionVolumes[n] = 1.0f;
+        _deafened = NO;
         
-        _mixerFrequency = [_device inputSampleRate];
+        _mixerFrequency = SAMPLE_RATE;
+        _outputFrequency = [_device outputSampleRate];
+        if (_outputFrequency <= 0)
+            _outputFrequency = _mixerFrequency;
         _numChannels = [_device numberOfOutputChannels];
         _sampleSize = _numChannels * sizeof(short);
+
+        _resampler = NULL;
+        _staging = NULL;
+        _stagedOffset = 0;
+        _stagedFrames = 0;
+        _stagedActive = NO;
+        if (_outputFrequency != _mixerFrequency) {
+            int err = 0;
+            _resampler = speex_resampler_init(_numChannels, (spx_uint32_t)_mixerFrequency, (spx_uint32_t)_outputFrequency, SPEEX_RESAMPLER_QUALITY_DESKTOP, &err);
+            if (_resampler == NULL) {
+                NSLog(@"MKAudioOutput: unable to create output resampler (%i)", err);
+            } else {
+                _staging = malloc(sizeof(float) * _numChannels * MK_AUDIO_OUTPUT_STAGING_FRAMES);
+                NSLog(@"MKAudioOutput: Resampling mix from %i Hz to %i Hz", _mixerFrequency, _outputFrequency);
+            }
+        }
         
-        _cngRegister1 = 0x67452301;
-        _cngRegister2 = 0xefcdab89;
-        _cngEnabled = settings->enableComfortNoise;
-        _cngAmpliScaler = 2.0f / 0xffffffff;
-        _cngAmpliScaler *= 0.00150;
-        _cngAmpliScaler *= settings->comfortNoiseLevel;
-        _cngLastSample = 0.0;
+        _echoReference = _settings.enableEchoCancellation && ![_device providesEchoCancellation];
+        _outputLatency = (uint64_t)([_device outputLatency] * NSEC_PER_SEC);
+
+        _comfortNoise = [[MKAudioComfortNoise alloc] initWithChannels:_numChannels level:_settings.comfortNoiseLevel];
             
        if (_speakerVolume) {
             free(_speakerVolume);
         }
         _speakerVolume = malloc(sizeof(float)*_numChannels);
+
+        memset(&_listener, 0, sizeof(_listener));
+        _listener.front[2] = 1.0f;
+        _listener.top[1] = 1.0f;
+        atomic_init(&_listenerSeq, 0);
+
+        if (_settings.positionalMinDistance <= 0.0f)
+            _settings.positionalMinDistance = 1.0f;
+        if (_settings.positionalMaxDistance <= _settings.positionalMinDistance)
+            _settings.positionalMaxDistance = MAX(15.0f, _settings.positionalMinDistance + 1.0f);
+        _settings.positionalMaxDistanceVolume = MIN(MAX(_settings.positionalMaxDistanceVolume, 0.0f), 1.0f);
         
         int i;
         for (i = 0; i < _numChannels; ++i) {
             _speakerVolume[i] = 1.0f;
         }
+
+        uint64_t warmUpStart = MKAudioLatencyNow();
+        for (i = 0; i < MK_AUDIO_OUTPUT_SPEECH_POOL_PREWARM; ++i) {
+            MKAudioOutputSpeech *ous = [[MKAudioOutputSpeech alloc] initWithSession:0 sampleRate:_mixerFrequency messageType:UDPVoiceOpusMessage];
+            if (ous != nil) {
+                [ous warmUp];
+                [_speechPool addObject:ous];
+            }
+            [ous release];
+        }
+        _warmUpDuration = MKAudioLatencyNow() - warmUpStart;
+        atomic_init(&_firstRenderTime, 0);
         
+        // Use all but one core for decoding, leaving the last one for the
+        // render and capture threads.
+        NSUInteger ncpu = [[NSProcessInfo processInfo] activeProcessorCount];
+        _decodeScheduler = [[MKAudioDecodeScheduler alloc] initWithNumberOfWorkers:MAX(1, MIN(ncpu - 1, 4))];
+
+        _decodeSema = dispatch_semaphore_create(0);
+        _decodeExitSema = dispatch_semaphore_create(0);
+        atomic_init(&_renderSize, _frameSize);
+        atomic_init(&_decodeRunning, YES);
+        atomic_init(&_finishedHead, 0);
+        atomic_init(&_finishedTail, 0);
+
+        // The decode thread must not retain us. Otherwise, we would never
+        // be deallocated, and the thread would never be stopped.
+        __block MKAudioOutput *output = self;
+        _decodeThread = [[NSThread alloc] initWithBlock:^{
+            [output decodeThreadMain];
+        }];
+        [_decodeThread setName:@"MKAudioOutput decode"];
+        [_decodeThread setQualityOfService:NSQualityOfServiceUserInteractive];
+        [_decodeThread start];
+
         [_device setupOutput:^BOOL(short *frames, unsigned int nsamp) {
             return [self mixFrames:frames amount:nsamp];
         }];
@@ -80,17 +263,39 @@
                 [NSArray array], @"removed",
             nil] retain];
         _mixerInfoLock = [[NSLock alloc] init];
+        _userSinkLock = [[NSLock alloc] init];
+        _userSink = nil;
+        atomic_init(&_hasUserSink, NO);
     }
     return self;
 }
 
 - (void) dealloc {
+    atomic_store(&_decodeRunning, NO);
+    dispatch_semaphore_signal(_decodeSema);
+    dispatch_semaphore_wait(_decodeExitSema, DISPATCH_TIME_FOREVER);
+    [_decodeThread release];
+    [_decodeScheduler release];
+    dispatch_release(_decodeSema);
+    dispatch_release(_decodeExitSema);
+
+    if (_resampler)
+        speex_resampler_destroy(_resampler);
+    free(_staging);
+
     [_mixerInfoLock release];
+    [_userSinkLock release];
+    [_userSink release];
     [_mixerInfo release];
     [_device setupOutput:NULL];
     [_device release];
+    [self retireFinishedTalkers];
+    [_comfortNoise release];
     [_outputLock release];
-    [_outputs release];
+    MKAudioSourceTableDestroy(&_outputs);
+    [_speechPool release];
+    [_mutedSessions release];
+    [_sessionVolumes release];
     [super dealloc];
 }
 
@@ -134,28 +339,207 @@
     }
 }
 
-- (BOOL) mixFrames:(void *)frames amount:(unsigned int)nsamp {
-    unsigned int i, s;
+// The decode thread keeps every talker's output ring filled a few frames
+// ahead of the render callback. It is woken up whenever the render callback
+// has consumed audio, and whenever a new talker appears.
+//
+// Each wakeup is one decode cycle: the per-talker decode jobs are spread across
+// the decode scheduler's workers and joined again before the next cycle. The
+// join never waits longer than the time until the most starved talker runs dry.
+- (void) decodeThreadMain {
+    while (atomic_load(&_decodeRunning)) {
+        dispatch_semaphore_wait(_decodeSema, dispatch_time(DISPATCH_TIME_NOW, 5 * NSEC_PER_MSEC));
+
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        [self retireFinishedTalkers];
+        NSUInteger target = atomic_load(&_renderSize) + _decodeAheadFrames * _frameSize;
+
+        NSUInteger token;
+        MKAudioSourceSnapshot *snap = MKAudioSourceTableReadBegin(&_outputs, &token);
+        NSArray *talkers = [[NSArray alloc] initWithObjects:snap->sources count:snap->count];
+        MKAudioSourceTableReadEnd(&_outputs, token);
+
+        NSUInteger minBuffered = target;
+        for (MKAudioOutputSpeech *ous in talkers) {
+            if (![ous isInaudible])
+                minBuffered = MIN(minBuffered, [ous bufferedSamples]);
+        }
+        uint64_t timeout = ((uint64_t)minBuffered * NSEC_PER_SEC) / (uint64_t)MAX(_mixerFrequency, 1);
+        timeout = MAX(timeout, NSEC_PER_MSEC);
+
+        [_decodeScheduler decodeTalkers:talkers untilBuffered:target withinNanoseconds:timeout];
+
+        [talkers release];
+        [pool release];
+    }
+    dispatch_semaphore_signal(_decodeExitSema);
+}
+
+- (void) setListenerPosition:(const float *)position front:(const float *)front top:(const float *)top {
+    @synchronized(self) {
+        uint32_t seq = atomic_load_explicit(&_listenerSeq, memory_order_relaxed);
+        atomic_store_explicit(&_listenerSeq, seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        memcpy(_listener.position, position, sizeof(_listener.position));
+        memcpy(_listener.front, front, sizeof(_listener.front));
+        memcpy(_listener.top, top, sizeof(_listener.top));
+        atomic_store_explicit(&_listenerSeq, seq + 2, memory_order_release);
+    }
+}
+
+// Called on the render thread. Never blocks; retries if it raced with an update.
+- (void) copyListener:(MKAudioListener *)listener {
+    for (;;) {
+        uint32_t seq = atomic_load_explicit(&_listenerSeq, memory_order_acquire);
+        if (seq & 1)
+            continue;
+        memcpy(listener, &_listener, sizeof(MKAudioListener));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&_listenerSeq, memory_order_relaxed) == seq)
+            return;
+    }
+}
+
+// Work out the per-channel gains and delays for a source at pos.
+//
+// Sources without a position (and all sources, if positional audio is off)
+// are mixed evenly into all channels. Otherwise, the source is attenuated
+// logarithmically between the minimum and maximum distance. On stereo
+// outputs it is also panned with an equal-power law, and when rendering for
+// headphones, the far ear gets a little less level difference and is delayed
+// instead, which is a cheap approximation of what a head does to a sound.
+- (void) computeGains:(float *)gains delays:(NSUInteger *)delays forPosition:(const float *)pos listener:(const MKAudioListener *)l channels:(unsigned int)nchan {
+    unsigned int c;
+
+    for (c = 0; c < nchan; ++c) {
+        gains[c] = _speakerVolume[c];
+        delays[c] = 0;
+    }
+
+    if (!_settings.enablePositionalAudio || (pos[0] == 0.0f && pos[1] == 0.0f && pos[2] == 0.0f))
+        return;
+
+    float dir[3] = { pos[0] - l->position[0], pos[1] - l->position[1], pos[2] - l->position[2] };
+    float dist = sqrtf(dir[0]*dir[0] + dir[1]*dir[1] + dir[2]*dir[2]);
+
+    float atten = 1.0f;
+    if (dist >= _settings.positionalMaxDistance) {
+        atten = _settings.positionalMaxDistanceVolume;
+    } else if (dist > _settings.positionalMinDistance) {
+        float t = (dist - _settings.positionalMinDistance) / (_settings.positionalMaxDistance - _settings.positionalMinDistance);
+        atten = powf(MAX(_settings.positionalMaxDistanceVolume, 0.0001f), t);
+    }
+
+    if (nchan != 2 || dist <= 0.0f) {
+        for (c = 0; c < nchan; ++c)
+            gains[c] *= atten;
+        return;
+    }
+
+    // Right vector in Mumble's left-handed coordinate system.
+    const float *f = l->front, *t = l->top;
+    float right[3] = {
+        t[1]*f[2] - t[2]*f[1],
+        t[2]*f[0] - t[0]*f[2],
+        t[0]*f[1] - t[1]*f[0],
+    };
+    float pan = (dir[0]*right[0] + dir[1]*right[1] + dir[2]*right[2]) / dist;
+    pan = MIN(MAX(pan, -1.0f), 1.0f);
+
+    if (_settings.positionalHeadphones) {
+        NSUInteger itd = (NSUInteger) lroundf(fabsf(pan) * MK_AUDIO_MAX_ITD_SECONDS * (float)_mixerFrequency);
+        itd = MIN(itd, (NSUInteger)MK_AUDIO_MIX_MAX_ITD_SAMPLES);
+        delays[pan > 0.0f ? 0 : 1] = itd;
+        pan *= 0.7f;
+    }
+
+    gains[0] *= atten * sqrtf(0.5f * (1.0f - pan));
+    gains[1] *= atten * sqrtf(0.5f * (1.0f + pan));
+}
+
+// acc[i] += src[i] * gain, with the gain ramped linearly from g0 to g1 over
+// the buffer so that parameter changes never cause zipper noise.
+static void MKAudioOutputMixRamp(float * restrict acc, const float * restrict src, NSUInteger nsamp, float g0, float g1) {
+    NSUInteger i = 0;
+
+    if (nsamp == 0 || (g0 == 0.0f && g1 == 0.0f))
+        return;
+
+    const float step = (g1 - g0) / (float)nsamp;
+    simd_float4 g = g0 + step * (simd_float4){ 0.0f, 1.0f, 2.0f, 3.0f };
+    const simd_float4 gstep = 4.0f * step;
+    for (; i + 4 <= nsamp; i += 4) {
+        simd_float4 in = *(const simd_packed_float4 *)(src + i);
+        simd_float4 out = *(simd_packed_float4 *)(acc + i);
+        *(simd_packed_float4 *)(acc + i) = out + in * g;
+        g += gstep;
+    }
+    for (; i < nsamp; ++i) {
+        acc[i] += src[i] * (g0 + step * (float)i);
+    }
+}
+
+// Mix one source into the planar mix buffer. src must be preceded by
+// MK_AUDIO_MIX_MAX_ITD_SAMPLES samples of history. If a channel's delay
+// has changed, the old and the new delay are crossfaded.
+static void MKAudioOutputMixSource(float *mixBuffer, unsigned int nchan, NSUInteger nsamp, const float *src,
+                                   MKAudioMixState *st, const float *gains, const NSUInteger *delays) {
+    unsigned int c;
+
+    if (!st->initialized) {
+        for (c = 0; c < nchan; ++c) {
+            st->gain[c] = gains[c];
+            st->delay[c] = delays[c];
+        }
+        st->initialized = YES;
+    }
+
+    for (c = 0; c < nchan; ++c) {
+        float *acc = mixBuffer + c*nsamp;
+        if (st->delay[c] == delays[c]) {
+            MKAudioOutputMixRamp(acc, src - delays[c], nsamp, st->gain[c], gains[c]);
+        } else {
+            MKAudioOutputMixRamp(acc, src - st->delay[c], nsamp, st->gain[c], 0.0f);
+            MKAudioOutputMixRamp(acc, src - delays[c], nsamp, 0.0f, gains[c]);
+        }
+        st->gain[c] = gains[c];
+        st->delay[c] = delays[c];
+    }
+}
+
+// Mixes nsamp frames at the mixer rate into output as interleaved floats.
+// Returns whether any source was mixed.
+- (BOOL) mixSources:(float *)output amount:(unsigned int)nsamp {
+    unsigned int i, k;
     BOOL retVal = NO;
 
-    NSMutableArray *mix = [[NSMutableArray alloc] init];
-    NSMutableArray *del = [[NSMutableArray alloc] init];
     unsigned int nchan = _numChannels;
+    NSUInteger n, nmixed = 0, ndel = 0;
 
-    [_outputLock lock];
-    for (NSNumber *sessionKey in _outputs) {
-        MKAudioOutputUser *ou = [_outputs objectForKey:sessionKey];
-        if (! [ou needSamples:nsamp]) {
-            [del addObject:ou];
+    // Every source in the snapshot stays valid until the read section ends,
+    // even if it is removed from the table in the meantime.
+    NSUInteger token;
+    MKAudioSourceSnapshot *snap = MKAudioSourceTableReadBegin(&_outputs, &token);
+    MKAudioOutputUser **mix = alloca(sizeof(id) * (snap->count + 1));
+    MKAudioOutputUser **del = alloca(sizeof(id) * (snap->count + 1));
+
+    for (n = 0; n < snap->count; n++) {
+        MKAudioOutputSpeech *ou = snap->sources[n];
+        if ([ou isInaudible]) {
+            if (! [ou skipSamples:nsamp])
+                del[ndel++] = ou;
+        } else if (! [ou needSamples:nsamp]) {
+            del[ndel++] = ou;
         } else {
-            [mix addObject:ou];
+            MKAudioLatencyRecord(MKAudioLatencyStagePlayout, (uint64_t)[ou bufferedSamples] * NSEC_PER_SEC / _mixerFrequency);
+            mix[nmixed++] = ou;
         }
     }
     
     if (_settings.enableSideTone) {
         MKAudioOutputSidetone *sidetone = [[MKAudio sharedAudio] sidetoneOutput];
         if ([sidetone needSamples:nsamp]) {
-            [mix addObject:[[MKAudio sharedAudio] sidetoneOutput]];
+            mix[nmixed++] = sidetone;
         }
     }
     
@@ -164,12 +548,12 @@
         NSMutableArray *sources = [[[NSMutableArray alloc] init] autorelease];
         NSMutableArray *removed = [[[NSMutableArray alloc] init] autorelease];
 
-        for (id ou in mix) {
-            [sources addObject:[self audioOutputDebugDescription:ou]];
+        for (n = 0; n < nmixed; n++) {
+            [sources addObject:[self audioOutputDebugDescription:mix[n]]];
         }
     
-        for (id ou in del) {
-            [sources addObject:[self audioOutputDebugDescription:ou]];
+        for (n = 0; n < ndel; n++) {
+            [sources addObject:[self audioOutputDebugDescription:del[n]]];
         }
 
     
@@ -183,102 +567,391 @@
         [_mixerInfoLock unlock];
     }
     
-    float *mixBuffer = alloca(sizeof(float)*_numChannels*nsamp);
-    memset(mixBuffer, 0, sizeof(float)*_numChannels*nsamp);
-
-    if ([mix count] > 0) {
-        for (MKAudioOutputUser *ou in mix) {
-            const float * restrict userBuffer = [ou buffer];
-            for (s = 0; s < nchan; ++s) {
-                const float str = _speakerVolume[s];
-                float * restrict o = (float *)mixBuffer + s;
-                for (i = 0; i < nsamp; ++i) {
-                    o[i*nchan] += userBuffer[i] * str;
+    // The mix buffer is planar (one contiguous run of samples per channel),
+    // and is only interleaved when converting to the output format.
+    unsigned int nmix = MIN(nchan, MK_AUDIO_MIX_MAX_CHANNELS);
+    float *mixBuffer = alloca(sizeof(float)*nmix*nsamp);
+    memset(mixBuffer, 0, sizeof(float)*nmix*nsamp);
+
+    if (nmixed > 0) {
+        float *srcBuffer = alloca(sizeof(float)*(MK_AUDIO_MIX_MAX_ITD_SAMPLES + nsamp));
+        float *src = srcBuffer + MK_AUDIO_MIX_MAX_ITD_SAMPLES;
+        float gains[MK_AUDIO_MIX_MAX_CHANNELS];
+        NSUInteger delays[MK_AUDIO_MIX_MAX_CHANNELS];
+        float pos[3];
+        MKAudioListener listener;
+        [self copyListener:&listener];
+
+        MKAudioUserPCMSink userSink = nil;
+        if (atomic_load_explicit(&_hasUserSink, memory_order_relaxed)) {
+            [_userSinkLock lock];
+            userSink = [_userSink retain];
+            [_userSinkLock unlock];
+        }
+
+        for (n = 0; n < nmixed; n++) {
+            MKAudioOutputUser *ou = mix[n];
+            MKAudioMixState *st = [ou mixState];
+
+            // Gather the source's audio behind the tail of its previous buffer.
+            // The view may be split in two where the ring wraps around, and may
+            // be short if the source underran, in which case the rest is concealed.
+            memcpy(srcBuffer, st->history, sizeof(st->history));
+            MKAudioRingBufferView view = [ou bufferView];
+            NSUInteger offset = 0;
+            for (k = 0; k < 2; ++k) {
+                memcpy(src + offset, view.data[k], view.length[k]*sizeof(float));
+                offset += view.length[k];
+            }
+            if (offset < nsamp) {
+                float v = [ou concealmentSample];
+                for (i = (unsigned int)offset; i < nsamp; ++i) {
+                    v *= 0.95f;
+                    src[i] = v;
                 }
             }
+            [ou consumeSamples];
+            memcpy(st->history, src + nsamp - MK_AUDIO_MIX_MAX_ITD_SAMPLES, sizeof(st->history));
+
+            if (userSink && [ou isKindOfClass:[MKAudioOutputSpeech class]])
+                userSink([(MKAudioOutputSpeech *)ou userSession], src, nsamp);
+
+            [ou getPosition:pos];
+            [self computeGains:gains delays:delays forPosition:pos listener:&listener channels:nmix];
+            float localVolume = [ou localVolume];
+            if (localVolume != 1.0f) {
+                for (k = 0; k < nmix; ++k)
+                    gains[k] *= localVolume;
+            }
+            MKAudioOutputMixSource(mixBuffer, nmix, nsamp, src, st, gains, delays);
         }
 
-        short *outputBuffer = (short *)frames;
-        for (i = 0; i < nsamp * _numChannels; ++i) {
-            if (mixBuffer[i] >= 1.0f) {
-                outputBuffer[i] = 32767;
-            } else if (mixBuffer[i] < -1.0f) {
-                outputBuffer[i] = -32768;
-            } else {
-                outputBuffer[i] = mixBuffer[i] * 32768.0f;
+        [userSink release];
+
+        memset(output, 0, nsamp * nchan * sizeof(float));
+        for (k = 0; k < nmix; ++k) {
+            const float *m = mixBuffer + k*nsamp;
+            float *o = output + k;
+            for (i = 0; i < nsamp; ++i) {
+                o[i*nchan] = m[i];
             }
         }
     } else {
-        memset((short *)frames, 0, nsamp * _numChannels * sizeof(short));
+        memset(output, 0, nsamp * nchan * sizeof(float));
     }
-    [_outputLock unlock];
 
-    for (MKAudioOutputUser *ou in del) {
-        [self removeBuffer:ou];
+    if (_echoReference)
+        MKAudioEchoReferenceWrite(output, nsamp, nchan, MKAudioLatencyNow() + _outputLatency);
+
+    // Hand finished talkers to the decode thread. The references are taken
+    // while the read section still keeps them alive.
+    uint32_t head = atomic_load_explicit(&_finishedHead, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&_finishedTail, memory_order_relaxed);
+    for (n = 0; n < ndel && tail - head < MK_AUDIO_OUTPUT_FINISHED_RING; n++, tail++) {
+        MKAudioOutputFinished *f = &_finished[tail % MK_AUDIO_OUTPUT_FINISHED_RING];
+        f->talker = [del[n] retain];
+        f->session = [(MKAudioOutputSpeech *)del[n] userSession];
     }
+    atomic_store_explicit(&_finishedTail, tail, memory_order_release);
+    MKAudioSourceTableReadEnd(&_outputs, token);
 
-    retVal = [mix count] > 0;
+    retVal = nmixed > 0;
 
-    [mix release];
-    [del release];
+    return retVal;
+}
 
-    if(!retVal && _cngEnabled) {
-        short *outputBuffer = (short *)frames;
-        
-        for (i = 0; i < nsamp * _numChannels; ++i) {
-            float    runningvalue;
-            
-            _cngRegister1 ^= _cngRegister2;
-            runningvalue = (float)_cngRegister2 * _cngAmpliScaler;
-            runningvalue += _cngLastSample; //one pole smoother
-            runningvalue *= 0.5;            //one pole smoother
-            _cngLastSample = runningvalue;
-            _cngRegister2 += _cngRegister1;
-            
-            if (runningvalue >= 1.0f) {
-                outputBuffer[i] = 32767;
-            } else if (runningvalue < -1.0f) {
-                outputBuffer[i] = -32768;
-            } else {
-                outputBuffer[i] = runningvalue * 32768.0f;
+// How long it took to get the pooled talkers ready, in nanoseconds.
+- (uint64_t) warmUpDuration {
+    return _warmUpDuration;
+}
+
+// When the first render callback ran, or 0 if none has yet.
+- (uint64_t) firstRenderTime {
+    return atomic_load_explicit(&_firstRenderTime, memory_order_relaxed);
+}
+
+- (void) updateSettings:(MKAudioSettings *)settings {
+    MKAudioSettingsSnapshotPublish(&_liveSettings, settings);
+}
+
+// Called on the render thread with nsamp frames at the device's output rate.
+- (BOOL) mixFrames:(void *)frames amount:(unsigned int)nsamp {
+    uint64_t start = MKAudioProfilerNow();
+    if (atomic_load_explicit(&_firstRenderTime, memory_order_relaxed) == 0)
+        atomic_store_explicit(&_firstRenderTime, MKAudioLatencyNow(), memory_order_relaxed);
+    MKAudioSettings live;
+    if (MKAudioSettingsSnapshotRead(&_liveSettings, &_liveSettingsSeen, &live)) {
+        MKAudioSettingsCopyLive(&_settings, &live);
+        [_comfortNoise setLevel:_settings.comfortNoiseLevel];
+    }
+    unsigned int i;
+    BOOL retVal = NO;
+    NSUInteger nchan = _numChannels;
+    NSUInteger mixed = nsamp;
+    float *output = alloca(sizeof(float) * nchan * nsamp);
+
+    if (_resampler == NULL) {
+        retVal = [self mixSources:output amount:nsamp];
+    } else {
+        NSUInteger produced = 0;
+        while (produced < nsamp) {
+            if (_stagedFrames == 0) {
+                NSUInteger want = ((NSUInteger)(nsamp - produced) * _mixerFrequency + _outputFrequency - 1) / _outputFrequency;
+                want = MAX(1, MIN(want, MK_AUDIO_OUTPUT_STAGING_FRAMES));
+                _stagedActive = [self mixSources:_staging amount:(unsigned int)want];
+                _stagedOffset = 0;
+                _stagedFrames = want;
+            }
+            retVal |= _stagedActive;
+
+            spx_uint32_t inlen = (spx_uint32_t)_stagedFrames;
+            spx_uint32_t outlen = (spx_uint32_t)(nsamp - produced);
+            speex_resampler_process_interleaved_float(_resampler, _staging + _stagedOffset * nchan, &inlen,
+                                                      output + produced * nchan, &outlen);
+            _stagedOffset += inlen;
+            _stagedFrames -= inlen;
+            produced += outlen;
+
+            if (inlen == 0 && outlen == 0) {
+                memset(output + produced * nchan, 0, (nsamp - produced) * nchan * sizeof(float));
+                break;
             }
         }
+        mixed = ((NSUInteger)nsamp * _mixerFrequency + _outputFrequency - 1) / _outputFrequency;
+    }
+
+    // Let the decode thread refill what we just consumed.
+    atomic_store(&_renderSize, mixed);
+    dispatch_semaphore_signal(_decodeSema);
+
+    if (!retVal && _settings.enableComfortNoise) {
+        [_comfortNoise fillBuffer:output frames:nsamp];
         retVal = YES;
     }
 
+    short *outputBuffer = (short *)frames;
+    const unsigned int total = nsamp * (unsigned int)nchan;
+    for (i = 0; i + 4 <= total; i += 4) {
+        simd_float4 v = simd_clamp(*(const simd_packed_float4 *)(output + i) * 32768.0f, -32768.0f, 32767.0f);
+        simd_short4 s = simd_short(v);
+        memcpy(outputBuffer + i, &s, sizeof(simd_short4));
+    }
+    for (; i < total; ++i) {
+        outputBuffer[i] = (short) MIN(MAX(output[i] * 32768.0f, -32768.0f), 32767.0f);
+    }
+
+    // The callback missed its deadline if it took longer than the audio
+    // it produced lasts.
+    uint64_t elapsed = MKAudioProfilerRecordSince(MKAudioProfileStageMix, start);
+    MKAudioProfilerNoteRenderCycle(elapsed > (uint64_t)nsamp * NSEC_PER_SEC / _outputFrequency);
+
     return retVal;
 }
 
+// Must be called with _outputLock held.
+- (void) retireOutputLocked:(MKAudioOutputUser *)u {
+    if (![u isKindOfClass:[MKAudioOutputSpeech class]])
+        return;
+
+    // The talker may already have been replaced by a new MKAudioOutputSpeech
+    // for the same session. Only remove the one we were asked to remove.
+    MKAudioOutputSpeech *ous = (MKAudioOutputSpeech *)u;
+    MKAudioSourceTableRemove(&_outputs, [ous userSession], ous);
+}
+
+// Called with _outputLock held, once a removed talker can no longer be found
+// in the table. Takes over the table's reference. A talker that someone else
+// still holds on to is not reused: a network thread may be about to add a
+// packet to it, and resetting it for another session would hand that packet
+// to the wrong user.
+- (void) reclaimSource:(MKAudioOutputUser *)u {
+    if ([u isKindOfClass:[MKAudioOutputSpeech class]] && [u retainCount] == 1 && [_speechPool count] < MK_AUDIO_OUTPUT_SPEECH_POOL_SIZE)
+        [_speechPool addObject:u];
+    [u release];
+}
+
+// Called on the decode thread. Our reference is dropped before the talker
+// is removed, so that it can still be pooled. That is safe under the lock:
+// if it was the last reference, the talker is no longer in the table, and
+// removing it compares the pointer without touching it.
+- (void) retireFinishedTalkers {
+    uint32_t head = atomic_load_explicit(&_finishedHead, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&_finishedTail, memory_order_acquire);
+    if (head == tail)
+        return;
+
+    [_outputLock lock];
+    for (; head != tail; head++) {
+        MKAudioOutputFinished *f = &_finished[head % MK_AUDIO_OUTPUT_FINISHED_RING];
+        [f->talker release];
+        MKAudioSourceTableRemove(&_outputs, f->session, f->talker);
+        f->talker = nil;
+    }
+    [_outputLock unlock];
+    atomic_store_explicit(&_finishedHead, head, memory_order_release);
+}
+
 - (void) removeBuffer:(MKAudioOutputUser *)u {
-    if ([u respondsToSelector:@selector(userSession)]) {
-        [_outputLock lock];
-        [_outputs removeObjectForKey:[NSNumber numberWithUnsignedInteger:[(id)u userSession]]];
-        [_outputLock unlock];
+    [_outputLock lock];
+    [self retireOutputLocked:u];
+    [_outputLock unlock];
+}
+
+// Must be called with _outputLock held.
+- (void) applyLocalSettingsLocked:(MKAudioOutputSpeech *)ous {
+    NSUInteger session = [ous userSession];
+    NSNumber *volume = [_sessionVolumes objectForKey:[NSNumber numberWithUnsignedInteger:session]];
+    NSUInteger slot = MK_AUDIO_SESSION_SLOT(session);
+    float connVolume = slot < MK_AUDIO_MAX_CONNECTIONS ? _connectionVolumes[slot] : 1.0f;
+    [ous setLocalVolume:(volume ? [volume floatValue] : 1.0f) * connVolume];
+    [ous setInaudible:_deafened || [_mutedSessions containsIndex:session]];
+}
+
+- (void) setMuted:(BOOL)muted forSession:(NSUInteger)session {
+    [_outputLock lock];
+    if (muted)
+        [_mutedSessions addIndex:session];
+    else
+        [_mutedSessions removeIndex:session];
+
+    NSUInteger token;
+    MKAudioSourceSnapshot *snap = MKAudioSourceTableReadBegin(&_outputs, &token);
+    MKAudioOutputSpeech *ous = MKAudioSourceSnapshotLookup(snap, session);
+    if (ous != nil)
+        [self applyLocalSettingsLocked:ous];
+    MKAudioSourceTableReadEnd(&_outputs, token);
+    [_outputLock unlock];
+}
+
+- (void) setVolume:(float)volume forSession:(NSUInteger)session {
+    [_outputLock lock];
+    if (volume == 1.0f)
+        [_sessionVolumes removeObjectForKey:[NSNumber numberWithUnsignedInteger:session]];
+    else
+        [_sessionVolumes setObject:[NSNumber numberWithFloat:volume] forKey:[NSNumber numberWithUnsignedInteger:session]];
+
+    NSUInteger token;
+    MKAudioSourceSnapshot *snap = MKAudioSourceTableReadBegin(&_outputs, &token);
+    MKAudioOutputSpeech *ous = MKAudioSourceSnapshotLookup(snap, session);
+    if (ous != nil)
+        [self applyLocalSettingsLocked:ous];
+    MKAudioSourceTableReadEnd(&_outputs, token);
+    [_outputLock unlock];
+}
+
+// Scales every talker of the connection in the given slot, on top of the
+// talkers' own volumes.
+- (void) setVolume:(float)volume forConnectionSlot:(NSUInteger)slot {
+    NSUInteger n;
+
+    if (slot >= MK_AUDIO_MAX_CONNECTIONS)
+        return;
+
+    [_outputLock lock];
+    _connectionVolumes[slot] = volume;
+
+    NSUInteger token;
+    MKAudioSourceSnapshot *snap = MKAudioSourceTableReadBegin(&_outputs, &token);
+    for (n = 0; n < snap->count; n++) {
+        MKAudioOutputSpeech *ous = snap->sources[n];
+        if (MK_AUDIO_SESSION_SLOT([ous userSession]) == slot)
+            [self applyLocalSettingsLocked:ous];
     }
+    MKAudioSourceTableReadEnd(&_outputs, token);
+    [_outputLock unlock];
+}
+
+// The sink is called on the render thread with each audible talker's audio
+// before it is mixed.
+- (void) setUserOutputSink:(MKAudioUserPCMSink)sink {
+    [_userSinkLock lock];
+    [_userSink release];
+    _userSink = [sink copy];
+    atomic_store(&_hasUserSink, _userSink != nil);
+    [_userSinkLock unlock];
+}
+
+// While deafened, no talker is decoded or mixed.
+- (void) setDeafened:(BOOL)deafened {
+    NSUInteger n;
+
+    [_outputLock lock];
+    _deafened = deafened;
+
+    NSUInteger token;
+    MKAudioSourceSnapshot *snap = MKAudioSourceTableReadBegin(&_outputs, &token);
+    for (n = 0; n < snap->count; n++)
+        [self applyLocalSettingsLocked:snap->sources[n]];
+    MKAudioSourceTableReadEnd(&_outputs, token);
+    [_outputLock unlock];
+}
+
+// Returns a retained talker for the given session, reusing a retired one
+// with a matching codec if possible.
+- (MKAudioOutputSpeech *) newSpeechForSession:(NSUInteger)session type:(MKUDPMessageType)msgType {
+    MKAudioOutputSpeech *ous = nil;
+    NSUInteger i;
+
+    [_outputLock lock];
+    for (i = [_speechPool count]; i > 0; i--) {
+        MKAudioOutputSpeech *candidate = [_speechPool objectAtIndex:i-1];
+        if ([candidate messageType] == msgType && [candidate resetWithSession:session]) {
+            ous = [candidate retain];
+            [_speechPool removeObjectAtIndex:i-1];
+            break;
+        }
+    }
+    [_outputLock unlock];
+
+    if (ous == nil)
+        ous = [[MKAudioOutputSpeech alloc] initWithSession:session sampleRate:_mixerFrequency messageType:msgType];
+    [ous setAdaptiveJitter:_settings.enableLowLatency];
+    return ous;
 }
 
 - (void) addFrameToBufferWithSession:(NSUInteger)session data:(NSData *)data sequence:(NSUInteger)seq type:(MKUDPMessageType)msgType {
+    MKVoicePacket *packet = MKVoicePacketCreateWithBytes([data bytes], [data length]);
+    if (packet == NULL)
+        return;
+    [self addVoicePacket:packet forSession:session sequence:seq type:msgType];
+    MKVoicePacketRelease(packet);
+}
+
+// The packet's view must cover the flags byte followed by the voice payload.
+// The talker takes its own reference to the packet.
+- (void) addVoicePacket:(MKVoicePacket *)packet forSession:(NSUInteger)session sequence:(NSUInteger)seq type:(MKUDPMessageType)msgType {
     if (_numChannels == 0)
         return;
 
-    [_outputLock lock];
-    MKAudioOutputSpeech *outputUser = [_outputs objectForKey:[NSNumber numberWithUnsignedInteger:session]];
-    [outputUser retain];
-    [_outputLock unlock];
+    NSUInteger token;
+    MKAudioSourceSnapshot *snap = MKAudioSourceTableReadBegin(&_outputs, &token);
+    MKAudioOutputSpeech *outputUser = [MKAudioSourceSnapshotLookup(snap, session) retain];
+    MKAudioSourceTableReadEnd(&_outputs, token);
 
-    if (outputUser == nil || [outputUser messageType] != msgType) {
+    // A finished talker only drains its remaining output. Start a new
+    // one for the next talk burst instead of feeding it more packets.
+    BOOL newTalker = NO;
+    if (outputUser == nil || [outputUser messageType] != msgType || [outputUser isFinished]) {
         if (outputUser != nil) {
             [self removeBuffer:outputUser];
             [outputUser release];
         }
-        outputUser = [[MKAudioOutputSpeech alloc] initWithSession:session sampleRate:_mixerFrequency messageType:msgType];
+        outputUser = [self newSpeechForSession:session type:msgType];
+        if (outputUser == nil)
+            return;
         [_outputLock lock];
-        [_outputs setObject:outputUser forKey:[NSNumber numberWithUnsignedInteger:session]];
+        [self applyLocalSettingsLocked:outputUser];
+        MKAudioSourceTableInsert(&_outputs, session, outputUser);
         [_outputLock unlock];
+        newTalker = YES;
     }
 
-    [outputUser addFrame:data forSequence:seq];
+    [outputUser addPacket:packet forSequence:seq];
     [outputUser release];
+
+    if (newTalker) {
+        dispatch_semaphore_signal(_decodeSema);
+    }
 }
 
 - (NSDictionary *) copyMixerInfo {
@@ -6,6 +6,6 @@
 #import "MKAudioOutputUser.h"
 
 @interface MKAudioOutputSidetone : MKAudioOutputUser
-- (id) initWithSettings:(MKAudioSettings *)settings;
-- (void) addFrame:(NSData *)data;
+- (id) initWithSettings:(MKAudioSettings *)settings inputSampleRate:(NSUInteger)rate;
+- (void) addSamples:(const short *)samples count:(NSUInteger)nsamp;
 @end
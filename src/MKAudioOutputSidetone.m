@@ -7,94 +7,101 @@
 #import "MKAudioOutputUserPrivate.h"
 #import "MKAudioOutputSidetone.h"
 
+#include <speex/speex_resampler.h>
+#include <simd/simd.h>
+
+// About 170ms of audio at 48KHz.
+#define MK_SIDETONE_BUFFER_CAPACITY  8192
+
+// Captured audio is converted in chunks of this many samples. The
+// resampled chunk is sized for mics down to 8KHz.
+#define MK_SIDETONE_CHUNK            128
+#define MK_SIDETONE_RESAMPLED_CHUNK  (MK_SIDETONE_CHUNK * (SAMPLE_RATE / 8000) + 16)
+
+// A short filter keeps the resampler's latency low. Sidetone is only
+// for monitoring, so quality matters less than delay.
+#define MK_SIDETONE_RESAMPLER_QUALITY  1
+
 @interface MKAudioOutputSidetone () {
-    NSMutableArray        *_frames;
-    NSUInteger            _offset;
-    NSUInteger            _filled;
-    float                 _volume;
     MKAudioSettings       _settings;
+    SpeexResamplerState  *_resampler;
 }
 @end
 
+static void MKAudioOutputSidetoneConvert(float *dst, const short *src, NSUInteger n) {
+    NSUInteger i = 0;
+    for (; i + 4 <= n; i += 4) {
+        simd_short4 s;
+        memcpy(&s, src + i, sizeof(simd_short4));
+        simd_float4 f = simd_float(s) * (1.0f / 32768.0f);
+        memcpy(dst + i, &f, sizeof(simd_float4));
+    }
+    for (; i < n; i++)
+        dst[i] = src[i] * (1.0f / 32768.0f);
+}
+
 @implementation MKAudioOutputSidetone
 
-- (id) initWithSettings:(MKAudioSettings *)settings {
-    if ((self = [super init])) {
+- (id) initWithSettings:(MKAudioSettings *)settings inputSampleRate:(NSUInteger)rate {
+    if ((self = [super initWithBufferCapacity:MK_SIDETONE_BUFFER_CAPACITY])) {
         memcpy(&_settings, settings, sizeof(MKAudioSettings));
-        _frames = [[NSMutableArray alloc] init];
-        _filled = 0;
-        _offset = 0;
-        _volume = _settings.sidetoneVolume;
+
+        // The mixer applies the sidetone volume like any other local volume.
+        [self setLocalVolume:_settings.sidetoneVolume];
+
+        if (rate != SAMPLE_RATE) {
+            int err = 0;
+            _resampler = speex_resampler_init(1, (spx_uint32_t)rate, SAMPLE_RATE, MK_SIDETONE_RESAMPLER_QUALITY, &err);
+            if (_resampler == NULL) {
+                NSLog(@"MKAudioOutputSidetone: unable to create resampler (%i)", err);
+                [self release];
+                return nil;
+            }
+        }
     }
     return self;
 }
 
 - (void) dealloc {
-    [_frames release];
+    if (_resampler)
+        speex_resampler_destroy(_resampler);
     [super dealloc];
 }
 
-- (void) addFrame:(NSData *)data {
-    @synchronized(_frames) {
-        [_frames addObject:data];
-    }
-}
+// Called on the audio input thread with mono samples at the input rate.
+// They are converted to float at the mixer rate and queued in the ring
+// right away, so the render thread only ever mixes out of the ring. If the
+// ring is full, the rest is dropped.
+- (void) addSamples:(const short *)samples count:(NSUInteger)nsamp {
+    float chunk[MK_SIDETONE_CHUNK];
+    float resampled[MK_SIDETONE_RESAMPLED_CHUNK];
 
-- (BOOL) needSamples:(NSUInteger)nsamples {    
-    [self resizeBuffer:nsamples];
+    while (nsamp > 0) {
+        NSUInteger n = MIN(nsamp, MK_SIDETONE_CHUNK);
+        const float *out = chunk;
+        NSUInteger nout = n;
 
-    while (_filled < nsamples) { 
-        NSData *frameData = nil;
-        @synchronized(_frames) {
-            if ([_frames count] > 0) {
-                frameData = [_frames objectAtIndex:0];
-            }
-        }
-        if (frameData != nil) {
-            NSUInteger frameSize = [frameData length]/2;
-            short *input = (short *) [frameData bytes];
-            float *output = _buffer+_filled;
-            
-            NSUInteger maxFrames = frameSize;
-            if (_filled+frameSize > nsamples) {
-                maxFrames = nsamples - _filled;
-            }
-            if (_offset > 0) {
-                for (NSUInteger i = _offset; i < maxFrames; i++) {
-                    output[0] = (input[i] / 32767.0f) * _volume;
-                    _filled++;
-                    output++;
-                }
-                _offset = 0;
-            } else {
-                for (NSUInteger i = 0; i < maxFrames; i++) {
-                    output[i] = (input[i] / 32767.0f) * _volume;
-                }
-                _filled += maxFrames;
-            }
-            
-            if (maxFrames < frameSize) {
-                _offset = maxFrames;
-            } else {
-                @synchronized(_frames) {
-                    [_frames removeObjectAtIndex:0];
-                }
-            }
-        } else {
-            return NO;
+        MKAudioOutputSidetoneConvert(chunk, samples, n);
+        if (_resampler) {
+            spx_uint32_t inlen = (spx_uint32_t)n;
+            spx_uint32_t outlen = MK_SIDETONE_RESAMPLED_CHUNK;
+            speex_resampler_process_float(_resampler, 0, chunk, &inlen, resampled, &outlen);
+            if (inlen == 0)
+                break;
+            n = inlen;
+            out = resampled;
+            nout = outlen;
         }
+
+        if (MKAudioRingBufferWrite(&_ring, out, nout) < nout)
+            break;
+        samples += n;
+        nsamp -= n;
     }
-    
-    for (NSUInteger i = 0; i < nsamples; i++) {
-        if (_buffer[i] > 1.0f)
-            _buffer[i] = 1.0f;
-        else if (_buffer[i] < -1.0f)
-            _buffer[i] = -1.0f;
-    }
-    
-    _filled = 0;
-    return YES;
 }
 
+- (BOOL) needSamples:(NSUInteger)nsamples {
+    return [self peekSamples:nsamples] > 0;
+}
 
 @end
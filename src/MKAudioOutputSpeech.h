@@ -6,6 +6,7 @@
 #import <MumbleKit/MKAudio.h>
 #import <MumbleKit/MKUser.h>
 #import "MKAudioOutputUser.h"
+#import "MKVoicePacket.h"
 
 struct MKAudioOutputSpeechPrivate;
 
@@ -14,9 +15,26 @@ struct MKAudioOutputSpeechPrivate;
 - (id) initWithSession:(NSUInteger)session sampleRate:(NSUInteger)freq messageType:(MKUDPMessageType)type;
 - (void) dealloc;
 
+- (BOOL) resetWithSession:(NSUInteger)session;
+- (void) setAdaptiveJitter:(BOOL)adaptive;
+- (void) warmUp;
+
 - (NSUInteger) userSession;
 - (MKUDPMessageType) messageType;
 
 - (void) addFrame:(NSData *)data forSequence:(NSUInteger)seq;
+- (void) addPacket:(MKVoicePacket *)packet forSequence:(NSUInteger)seq;
+
+- (BOOL) isFinished;
+- (NSUInteger) bufferedSamples;
+- (NSUInteger) underrunCount;
+
+- (BOOL) isInaudible;
+- (void) setInaudible:(BOOL)inaudible;
+- (BOOL) skipSamples:(NSUInteger)nsamples;
+
+- (BOOL) tryBeginDecode;
+- (void) endDecode;
+- (void) decodeUntilBuffered:(NSUInteger)nsamples;
 
 @end
@@ -6,6 +6,10 @@
 #import "MKPacketDataStream.h"
 #import "MKAudioOutputSpeech.h"
 #import "MKAudioOutputUserPrivate.h"
+#import "MKAudioLatency.h"
+#import "MKAudioTalkState.h"
+#import "MKAudioProfiler.h"
+#import "MKAudioComfortNoise.h"
 
 #include <speex/speex.h>
 #include <speex/speex_preprocess.h>
@@ -14,6 +18,25 @@
 #include <speex/speex_jitter.h>
 #include <speex/speex_types.h>
 #include <opus.h>
+#include <pthread.h>
+
+// Opus packets carry a single frame. Speex packets may carry several.
+#define MK_AUDIO_OUTPUT_MAX_FRAMES  32
+
+// The jitter buffer margin, in frames. The fixed margin is what Mumble
+// uses by default. The adaptive margin is twice the measured interarrival
+// jitter, but never more than the fixed one.
+#define MK_AUDIO_OUTPUT_JITTER_MARGIN_FRAMES  10
+
+// Packets further apart than this (in frames) start a new talk burst, and
+// don't count towards the jitter estimate.
+#define MK_AUDIO_OUTPUT_JITTER_MAX_GAP_FRAMES  50
+
+// A view of a single encoded frame inside the current voice packet.
+typedef struct _MKVoiceFrame {
+    const unsigned char  *data;
+    NSUInteger            len;
+} MKVoiceFrame;
 
 @interface MKAudioOutputSpeech () {
     OpusDecoder          *_opusDecoder;
@@ -25,30 +48,53 @@
     JitterBuffer         *_jitter;
 
     SpeexResamplerState  *_resampler;
+
+    _Atomic BOOL          _finished;
+    _Atomic BOOL          _decoding;
+    _Atomic NSUInteger    _underruns;
+
+    // While inaudible, the render thread accounts for the audio it would have
+    // played in _skipDebt, and the decode thread keeps the jitter buffer moving
+    // at that pace without decoding anything.
+    _Atomic BOOL          _inaudible;
+    _Atomic NSUInteger    _skipDebt;
+    BOOL                  _skipping;
+    BOOL                  _resumed;
+    NSInteger             _skipBudget;
     
     MKUDPMessageType      _msgType;
-    NSUInteger            _bufferOffset;
-    NSUInteger            _bufferFilled;
     NSUInteger            _outputSize;
-    NSUInteger            _lastConsume;
     NSUInteger            _frameSize;
-    BOOL                  _lastAlive;
     BOOL                  _hasTerminator;
 
     BOOL                  _useStereo;
     NSInteger             _audioBufferSize;
     float                *_resamplerBuffer;
+    float                *_outputBuffer;
     NSUInteger            _sampleRate;
     NSUInteger            _freq;
     
-    float                *_fadeIn;
-    float                *_fadeOut;
+    const float          *_fadeIn;
+    const float          *_fadeOut;
     
     NSInteger             _missCount;
     NSInteger             _missedFrames;
     
-    NSMutableArray       *_frames;
+    MKPacketDataStream   *_pds;
+    MKVoicePacket        *_packet;
+    MKVoiceFrame          _frames[MK_AUDIO_OUTPUT_MAX_FRAMES];
+    NSUInteger            _frameIndex;
+    NSUInteger            _frameCount;
     unsigned char         _flags;
+    NSUInteger            _packetSeq;
+    BOOL                  _notePlayout;
+
+    BOOL                  _adaptiveJitter;
+    BOOL                  _jitterPrimed;
+    NSUInteger            _jitterLastSeq;
+    int64_t               _jitterLastTransit;
+    double                _jitterEstimate;
+    int                   _jitterMargin;
     
     NSUInteger            _userSession;
     float                 _powerMin;
@@ -57,12 +103,85 @@
     
     MKTalkState           _talkState;
 }
+- (NSUInteger) decodeFrame;
 @end
 
+// The jitter buffer runs in zero-copy mode: it holds a reference to each
+// packet it is given, and drops it through this callback if the packet is
+// discarded without ever being handed back to us.
+static void MKAudioOutputSpeechReleasePacket(void *data) {
+    MKVoicePacketRelease((MKVoicePacket *)data);
+}
+
+// Room for the largest render buffer we expect to be asked for in one go.
+#define MK_AUDIO_OUTPUT_MAX_RENDER_SAMPLES  4096
+
+// The largest packet we can decode in one go, after resampling to the mixer
+// rate: 120ms for Opus, and a single 20ms frame for Speex UWB.
+static NSUInteger MKAudioOutputSpeechMaxPacketSamples(MKUDPMessageType type, NSUInteger freq) {
+    NSUInteger ms = (type == UDPVoiceOpusMessage) ? 120 : 20;
+    return (freq * ms + 999) / 1000;
+}
+
+// Fade tables only depend on the frame size, of which there are only a
+// couple. They are computed once, shared by all talkers and never freed.
+#define MK_AUDIO_OUTPUT_MAX_FADE_TABLES  4
+
+typedef struct _MKAudioFadeTable {
+    NSUInteger   frameSize;
+    float       *fadeIn;
+    float       *fadeOut;
+} MKAudioFadeTable;
+
+static MKAudioFadeTable  MKAudioFadeTables[MK_AUDIO_OUTPUT_MAX_FADE_TABLES];
+static pthread_mutex_t   MKAudioFadeTableLock = PTHREAD_MUTEX_INITIALIZER;
+
+static BOOL MKAudioOutputSpeechGetFadeTables(NSUInteger frameSize, const float **fadeIn, const float **fadeOut) {
+    NSUInteger i, j;
+    BOOL ok = NO;
+
+    pthread_mutex_lock(&MKAudioFadeTableLock);
+    for (i = 0; i < MK_AUDIO_OUTPUT_MAX_FADE_TABLES; i++) {
+        MKAudioFadeTable *t = &MKAudioFadeTables[i];
+        if (t->frameSize == frameSize) {
+            ok = YES;
+        } else if (t->frameSize == 0) {
+            t->fadeIn = malloc(sizeof(float) * frameSize);
+            t->fadeOut = malloc(sizeof(float) * frameSize);
+            if (t->fadeIn == NULL || t->fadeOut == NULL) {
+                free(t->fadeIn);
+                free(t->fadeOut);
+                t->fadeIn = t->fadeOut = NULL;
+                break;
+            }
+            float mul = (float)(M_PI / (2.0 * (float)frameSize));
+            for (j = 0; j < frameSize; ++j) {
+                t->fadeIn[j] = t->fadeOut[frameSize-j-1] = sinf((float)j * mul);
+            }
+            t->frameSize = frameSize;
+            ok = YES;
+        }
+        if (ok) {
+            *fadeIn = t->fadeIn;
+            *fadeOut = t->fadeOut;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&MKAudioFadeTableLock);
+
+    if (!ok)
+        NSLog(@"AudioOutputSpeech: unable to get fade tables for frame size %lu", (unsigned long)frameSize);
+    return ok;
+}
+
 @implementation MKAudioOutputSpeech
 
 - (id) initWithSession:(NSUInteger)session sampleRate:(NSUInteger)freq messageType:(MKUDPMessageType)type {
-    if ((self = [super init])) {
+    // Leave room for a large render buffer plus the decode-ahead margin,
+    // and one more maximally sized packet on top of that. The ring never
+    // grows after this point.
+    NSUInteger capacity = MK_AUDIO_OUTPUT_MAX_RENDER_SAMPLES + 4 * MKAudioOutputSpeechMaxPacketSamples(type, freq);
+    if ((self = [super initWithBufferCapacity:capacity])) {
         _jitter = NULL;
         _speexDecoder = NULL;
         _resampler = NULL;
@@ -103,13 +222,17 @@
             _resampler = speex_resampler_init(_useStereo ? 2 : 1, (spx_uint32_t)_sampleRate, (spx_uint32_t)_freq, 3, &err);
             _resamplerBuffer = malloc(sizeof(float)*_audioBufferSize);
             NSLog(@"AudioOutputSpeech: Resampling from %lu Hz to %lu Hz", (unsigned long)_sampleRate, (unsigned long)_freq);
-        }    
-
-        _bufferOffset = 0;
-        _bufferFilled = 0;
-        _lastConsume = 0;
+        }
+        _outputBuffer = malloc(sizeof(float)*MAX(_outputSize, (NSUInteger)_audioBufferSize));
 
-        _lastAlive = TRUE;
+        atomic_init(&_finished, NO);
+        atomic_init(&_decoding, NO);
+        atomic_init(&_underruns, 0);
+        atomic_init(&_inaudible, NO);
+        atomic_init(&_skipDebt, 0);
+        _skipping = NO;
+        _resumed = NO;
+        _skipBudget = 0;
 
         _missCount = 0;
         _missedFrames = 0;
@@ -118,20 +241,20 @@
 
         _jitterLock = [[NSLock alloc] init];
         _jitter = jitter_buffer_init((int)_frameSize);
+        jitter_buffer_ctl(_jitter, JITTER_BUFFER_SET_DESTROY_CALLBACK, (void *)MKAudioOutputSpeechReleasePacket);
     
-        int margin = /* g.s.iJitterBufferSize */ 10 * (int)_frameSize;
-        jitter_buffer_ctl(_jitter, JITTER_BUFFER_SET_MARGIN, &margin);
+        _jitterMargin = /* g.s.iJitterBufferSize */ MK_AUDIO_OUTPUT_JITTER_MARGIN_FRAMES * (int)_frameSize;
+        jitter_buffer_ctl(_jitter, JITTER_BUFFER_SET_MARGIN, &_jitterMargin);
 
-        _fadeIn = malloc(sizeof(float) * _frameSize);
-        _fadeOut = malloc(sizeof(float) * _frameSize);
-
-        float mul = (float)(M_PI / (2.0 * (float)_frameSize));
-        NSUInteger i;
-        for (i = 0; i < _frameSize; ++i) {
-            _fadeIn[i] = _fadeOut[_frameSize-i-1] = sinf((float)i * mul);
+        if (!MKAudioOutputSpeechGetFadeTables(_frameSize, &_fadeIn, &_fadeOut)) {
+            [self release];
+            return nil;
         }
 
-        _frames = [[NSMutableArray alloc] init];
+        _pds = [[MKPacketDataStream alloc] initWithBuffer:NULL length:0];
+        _packet = NULL;
+        _frameIndex = 0;
+        _frameCount = 0;
     }
     return self;
 }
@@ -148,20 +271,130 @@
     if (_opusDecoder)
         opus_decoder_destroy(_opusDecoder);
 
-    if (_fadeIn)
-        free(_fadeIn);
-    if (_fadeOut)
-        free(_fadeOut);
-    
     if (_resamplerBuffer)
         free(_resamplerBuffer);
+    if (_outputBuffer)
+        free(_outputBuffer);
+
+    MKVoicePacketRelease(_packet);
 
     [_jitterLock release];
-    [_frames release];
+    [_pds release];
 
     [super dealloc];
 }
 
+// Prepares a talker that has been retired by MKAudioOutput for a new talk
+// burst, possibly from another user, without recreating its decoder, jitter
+// buffer and buffers. Fails if a late decode job is still running on it.
+- (BOOL) resetWithSession:(NSUInteger)session {
+    if (![self tryBeginDecode])
+        return NO;
+
+    [_jitterLock lock];
+    jitter_buffer_reset(_jitter);
+    _jitterPrimed = NO;
+    _jitterEstimate = 0.0;
+    [_jitterLock unlock];
+
+    if (_opusDecoder)
+        opus_decoder_ctl(_opusDecoder, OPUS_RESET_STATE);
+    if (_speexDecoder) {
+        speex_decoder_ctl(_speexDecoder, SPEEX_RESET_STATE, NULL);
+        speex_bits_reset(&_speexBits);
+    }
+    if (_resampler)
+        speex_resampler_reset_mem(_resampler);
+
+    MKVoicePacketRelease(_packet);
+    _packet = NULL;
+    _frameIndex = 0;
+    _frameCount = 0;
+    _flags = 0xff;
+    _hasTerminator = NO;
+    _notePlayout = NO;
+
+    _missCount = 0;
+    _missedFrames = 0;
+    _powerMin = 0.0f;
+    _powerMax = 0.0f;
+    _averageAvailable = 0.0f;
+
+    _userSession = session;
+    _talkState = MKTalkStatePassive;
+    [self resetBuffer];
+
+    atomic_store(&_underruns, 0);
+    atomic_store(&_inaudible, NO);
+    atomic_store(&_skipDebt, 0);
+    _skipping = NO;
+    _resumed = NO;
+    _skipBudget = 0;
+    atomic_store_explicit(&_finished, NO, memory_order_release);
+    [self endDecode];
+    return YES;
+}
+
+// Decodes a lost frame and resamples it, so that the decoder's code and
+// state are paged in before the first talker arrives, then puts everything
+// back in its initial state. Must not be called while the talker is in use.
+- (void) warmUp {
+    float *output = _resampler ? _resamplerBuffer : _outputBuffer;
+
+    if (_opusDecoder) {
+        opus_decode_float(_opusDecoder, NULL, 0, output, (int)_frameSize, 0);
+        opus_decoder_ctl(_opusDecoder, OPUS_RESET_STATE);
+    } else if (_speexDecoder) {
+        speex_decode(_speexDecoder, NULL, output);
+        speex_decoder_ctl(_speexDecoder, SPEEX_RESET_STATE, NULL);
+    }
+    if (_resampler) {
+        spx_uint32_t inlen = (spx_uint32_t)_frameSize;
+        spx_uint32_t outlen = (spx_uint32_t)(((NSUInteger)_frameSize * _freq + _sampleRate - 1) / _sampleRate);
+        speex_resampler_process_float(_resampler, 0, _resamplerBuffer, &inlen, _outputBuffer, &outlen);
+        speex_resampler_reset_mem(_resampler);
+    }
+}
+
+// In adaptive mode, the jitter buffer margin follows the jitter that is
+// actually measured on the talker's packets, instead of being fixed at
+// 100ms. Used by the low latency profile.
+- (void) setAdaptiveJitter:(BOOL)adaptive {
+    [_jitterLock lock];
+    _adaptiveJitter = adaptive;
+    _jitterPrimed = NO;
+    _jitterEstimate = 0.0;
+    _jitterMargin = adaptive ? 0 : MK_AUDIO_OUTPUT_JITTER_MARGIN_FRAMES * (int)_frameSize;
+    jitter_buffer_ctl(_jitter, JITTER_BUFFER_SET_MARGIN, &_jitterMargin);
+    [_jitterLock unlock];
+}
+
+// Interarrival jitter as in RFC 3550, in samples. Must be called with the
+// jitter lock held.
+- (void) updateJitterForPacket:(MKVoicePacket *)packet sequence:(NSUInteger)seq {
+    if (packet->timestamp == 0)
+        return;
+
+    int64_t arrival = (int64_t)((packet->timestamp / NSEC_PER_USEC) * _sampleRate / USEC_PER_SEC);
+    int64_t transit = arrival - (int64_t)(seq * _frameSize);
+
+    if (_jitterPrimed && seq > _jitterLastSeq && seq - _jitterLastSeq <= MK_AUDIO_OUTPUT_JITTER_MAX_GAP_FRAMES) {
+        double d = fabs((double)(transit - _jitterLastTransit));
+        _jitterEstimate += (d - _jitterEstimate) / 16.0;
+
+        NSInteger frames = (NSInteger) ceil(2.0 * _jitterEstimate / (double)_frameSize);
+        int margin = (int)(MIN(frames, MK_AUDIO_OUTPUT_JITTER_MARGIN_FRAMES) * (NSInteger)_frameSize);
+        if (margin != _jitterMargin) {
+            _jitterMargin = margin;
+            jitter_buffer_ctl(_jitter, JITTER_BUFFER_SET_MARGIN, &_jitterMargin);
+        }
+    }
+
+    _jitterPrimed = YES;
+    _jitterLastSeq = seq;
+    _jitterLastTransit = transit;
+}
+
 - (NSUInteger) userSession {
     return _userSession;
 }
@@ -171,14 +404,26 @@
 }
 
 - (void) addFrame:(NSData *)data forSequence:(NSUInteger)seq {
+    MKVoicePacket *packet = MKVoicePacketCreateWithBytes([data bytes], [data length]);
+    if (packet == NULL)
+        return;
+    [self addPacket:packet forSequence:seq];
+    MKVoicePacketRelease(packet);
+}
+
+// The packet's view covers the flags byte followed by the voice payload.
+// The jitter buffer keeps its own reference to the packet instead of
+// copying it.
+- (void) addPacket:(MKVoicePacket *)packet forSequence:(NSUInteger)seq {
     [_jitterLock lock];
 
-    if ([data length] < 2) {
+    if (packet->length < 2) {
         [_jitterLock unlock];
         return;
     }
 
-    MKPacketDataStream *pds = [[MKPacketDataStream alloc] initWithData:data];
+    MKPacketDataStream *pds = _pds;
+    [pds resetWithBuffer:MKVoicePacketBytes(packet) length:packet->length];
     [pds next];
 
     NSUInteger samples = 0;
@@ -186,15 +431,13 @@
         uint64_t header = [pds getVarint];
         opus_uint32 size = (header & ((1 << 13) - 1));
         if (size > 0) {
-            NSData *opusFrames = [pds copyDataBlock:size];
-            if ([opusFrames length] != (NSUInteger)size || ![pds valid]) {
-                [pds release];
+            if ([pds left] < (NSUInteger)size || ![pds valid]) {
                 [_jitterLock unlock];
                 return;
             }
-            int nframes = opus_packet_get_nb_frames([opusFrames bytes], size);
-            samples = nframes * opus_packet_get_samples_per_frame([opusFrames bytes], SAMPLE_RATE);
-            [opusFrames release];
+            const unsigned char *opusFrames = [pds dataPtr];
+            int nframes = opus_packet_get_nb_frames(opusFrames, size);
+            samples = nframes * opus_packet_get_samples_per_frame(opusFrames, SAMPLE_RATE);
         } else {
             // Prevents a jitter buffer warning for terminator packets.
             samples = 1 * _frameSize;
@@ -209,182 +452,284 @@
     }
 
     if (! [pds valid]) {
-        [pds release];
         NSLog(@"addFrame:: Invalid pds.");
         [_jitterLock unlock];
         return;
     }
 
-    if ([data length] <= UINT32_MAX) {
+    if (packet->length <= UINT32_MAX) {
         JitterBufferPacket jbp;
-        jbp.data = (char *)[data bytes];
-        jbp.len = (spx_uint32_t)[data length];
+        jbp.data = (char *)MKVoicePacketRetain(packet);
+        jbp.len = (spx_uint32_t)packet->length;
         jbp.span = (spx_uint32_t)samples;
         jbp.timestamp = (spx_uint32_t)_frameSize * (spx_uint32_t)seq;
 
+        if (_adaptiveJitter)
+            [self updateJitterForPacket:packet sequence:seq];
+
+        // jitter_buffer_put() drops packets that are too late to ever be
+        // played without calling the destroy callback, so their reference
+        // is still ours. This is the same check it makes. While the buffer
+        // is resetting, its pointer is 0 and every packet is inserted.
+        spx_int32_t step = 0;
+        jitter_buffer_ctl(_jitter, JITTER_BUFFER_GET_DELAY_STEP, &step);
+        spx_uint32_t pointer = (spx_uint32_t)jitter_buffer_get_pointer_timestamp(_jitter);
+        BOOL hopeless = pointer != 0 && (spx_int32_t)(jbp.timestamp + jbp.span + (spx_uint32_t)step - pointer) < 0;
+
         jitter_buffer_put(_jitter, &jbp);
+
+        // If the put resynced the buffer after too many losses, the
+        // packet was inserted after all.
+        if (hopeless && jitter_buffer_get_pointer_timestamp(_jitter) != 0)
+            MKVoicePacketRelease(packet);
     }
 
-    [pds release];
-    
     [_jitterLock unlock];
 }
 
-- (BOOL) needSamples:(NSUInteger)nsamples {
-    NSUInteger i;
-    
-    for (i = _lastConsume; i < _bufferFilled; ++i) {
-        _buffer[i-_lastConsume] = _buffer[i];
+- (BOOL) isFinished {
+    return atomic_load_explicit(&_finished, memory_order_acquire);
+}
+
+- (NSUInteger) bufferedSamples {
+    return MKAudioRingBufferReadable(&_ring);
+}
+
+- (NSUInteger) underrunCount {
+    return atomic_load(&_underruns);
+}
+
+- (BOOL) isInaudible {
+    return atomic_load_explicit(&_inaudible, memory_order_relaxed);
+}
+
+// Inaudible talkers (locally muted, or everyone while deafened) are not
+// decoded or mixed at all, but their jitter buffer keeps running so that
+// they pick up right where the stream is once they become audible again.
+- (void) setInaudible:(BOOL)inaudible {
+    atomic_store_explicit(&_inaudible, inaudible, memory_order_relaxed);
+}
+
+// Called on the render thread instead of needSamples: while the talker is
+// inaudible. Drops anything that was decoded before, and lets the decode
+// thread know how much time has passed. Returns NO once the talker is done.
+- (BOOL) skipSamples:(NSUInteger)nsamples {
+    [self peekSamples:nsamples];
+    [self consumeSamples];
+    atomic_fetch_add_explicit(&_skipDebt, nsamples, memory_order_relaxed);
+    return ![self isFinished];
+}
+
+// Claim this talker for a decode job. Only one decode job may run for
+// a talker at any given time.
+- (BOOL) tryBeginDecode {
+    return !atomic_exchange(&_decoding, YES);
+}
+
+- (void) endDecode {
+    atomic_store(&_decoding, NO);
+}
+
+// Called by MKAudioOutput's decode thread. Decodes frames from the jitter
+// buffer until at least nsamples of output are queued in the ring, or until
+// the talker has finished its talk burst.
+- (void) decodeUntilBuffered:(NSUInteger)nsamples {
+    BOOL skipping = [self isInaudible];
+    if (skipping != _skipping) {
+        _skipping = skipping;
+        _skipBudget = 0;
+        atomic_store_explicit(&_skipDebt, 0, memory_order_relaxed);
+        if (!skipping) {
+            // The decoder state is stale. Start over and fade in.
+            if (_opusDecoder)
+                opus_decoder_ctl(_opusDecoder, OPUS_RESET_STATE);
+            if (_speexDecoder)
+                speex_decoder_ctl(_speexDecoder, SPEEX_RESET_STATE, NULL);
+            if (_resampler)
+                speex_resampler_reset_mem(_resampler);
+            _resumed = YES;
+        }
     }
-    _bufferFilled -= _lastConsume;
 
-    _lastConsume = nsamples;
+    if (_skipping) {
+        NSInteger budget = _skipBudget + (NSInteger)atomic_exchange_explicit(&_skipDebt, 0, memory_order_relaxed);
+        while (![self isFinished] && budget > 0)
+            budget -= (NSInteger)[self decodeFrame];
+        _skipBudget = budget;
+        return;
+    }
 
-    if (_bufferFilled >= nsamples) {
-        return _lastAlive;
+    while (![self isFinished] && MKAudioRingBufferReadable(&_ring) < nsamples) {
+        if (MKAudioRingBufferWritable(&_ring) < _outputSize)
+            break;
+        [self decodeFrame];
     }
+}
 
-    float *output = NULL;
-    BOOL nextAlive = _lastAlive;
-    
-    while (_bufferFilled < nsamples) {
-        int decodedSamples = (int)_frameSize;
-        [self resizeBuffer:(_bufferFilled + _outputSize)];
+// Decode a single frame (or one packet's worth of frames for Opus) and append
+// the resampled result to the output ring. Returns the amount of output, at
+// the mixer rate, that the frame accounts for.
+//
+// While skipping, frames are taken from the jitter buffer and accounted for
+// exactly as if they had been decoded, but nothing is decoded or written.
+- (NSUInteger) decodeFrame {
+    NSUInteger i;
+    float *output = _resampler ? _resamplerBuffer : _outputBuffer;
+    int decodedSamples = (int)_frameSize;
+    BOOL nextAlive = YES;
+    BOOL silent = NO;
 
-        if (_resampler) {
-            output = _resamplerBuffer;
-        } else {
-            output = _buffer + _bufferFilled;
-        }   
+    int avail = 0;
 
-        if (!_lastAlive) {
-            memset(output, 0, _frameSize * sizeof(float));
-        } else {
-            int avail = 0;
-            
-            [_jitterLock lock];
-            int ts = jitter_buffer_get_pointer_timestamp(_jitter);
-            jitter_buffer_ctl(_jitter, JITTER_BUFFER_GET_AVAILABLE_COUNT, &avail);
-            [_jitterLock unlock];
-            
-            if (ts == 0) {
-                int want = (int) _averageAvailable;
-                if (avail < want) {
-                    _missCount++;
-                    if (_missCount < 20) {
-                        memset(output, 0, _frameSize * sizeof(float));
-                        goto nextframe;
-                    }
-                }
+    [_jitterLock lock];
+    int ts = jitter_buffer_get_pointer_timestamp(_jitter);
+    jitter_buffer_ctl(_jitter, JITTER_BUFFER_GET_AVAILABLE_COUNT, &avail);
+    [_jitterLock unlock];
+
+    if (ts == 0) {
+        int want = (int) _averageAvailable;
+        if (avail < want) {
+            _missCount++;
+            if (_missCount < 20) {
+                memset(output, 0, _frameSize * sizeof(float));
+                silent = YES;
             }
+        }
+    }
 
-            if ([_frames count] == 0) {
-                [_jitterLock lock];
+    if (!silent) {
+        if (_frameIndex == _frameCount) {
+            [_jitterLock lock];
 
-                char data[4096];
-
-                JitterBufferPacket jbp;
-                jbp.data = data;
-                jbp.len = 4096;
-
-                spx_int32_t startofs = 0;
-
-                if (jitter_buffer_get(_jitter, &jbp, (spx_int32_t)_frameSize, &startofs) == JITTER_BUFFER_OK) {
-                    MKPacketDataStream *pds = [[MKPacketDataStream alloc] initWithBuffer:(unsigned char *)jbp.data length:jbp.len];
-
-                    _missCount = 0;
-                    _flags = (unsigned char) [pds next];
-                    _hasTerminator = NO;
-                    
-                    if (_msgType == UDPVoiceOpusMessage) {
-                        uint64_t header = [pds getVarint];
-                        NSUInteger size = (header & ((1 << 13) - 1));
-                        _hasTerminator = header & (1 << 13);
-                        if (size > 0) {
-                            NSData *block = [pds copyDataBlock:size];
-                            if (block != nil) {
-                                [_frames addObject:block];
-                                [block release];
+            JitterBufferPacket jbp;
+            jbp.data = NULL;
+            jbp.len = 0;
+
+            spx_int32_t startofs = 0;
+
+            uint64_t getStart = MKAudioProfilerNow();
+            int getResult = jitter_buffer_get(_jitter, &jbp, (spx_int32_t)_frameSize, &startofs);
+            MKAudioProfilerRecordSince(MKAudioProfileStageJitterBufferGet, getStart);
+            if (getResult == JITTER_BUFFER_OK) {
+                // We now own the jitter buffer's reference to the packet. Our
+                // frame views point into it until the next packet is fetched.
+                MKVoicePacketRelease(_packet);
+                _packet = (MKVoicePacket *)jbp.data;
+                _frameIndex = 0;
+                _frameCount = 0;
+
+                MKAudioLatencyRecordSince(MKAudioLatencyStageJitterBuffer, _packet->timestamp);
+                _packetSeq = (NSUInteger)jbp.timestamp / _frameSize;
+                _notePlayout = !_skipping && MKAudioLatencyIsLoopbackSession(_userSession);
+
+                MKPacketDataStream *pds = _pds;
+                [pds resetWithBuffer:MKVoicePacketBytes(_packet) length:_packet->length];
+
+                _missCount = 0;
+                _flags = (unsigned char) [pds next];
+                _hasTerminator = NO;
+                
+                if (_msgType == UDPVoiceOpusMessage) {
+                    uint64_t header = [pds getVarint];
+                    NSUInteger size = (header & ((1 << 13) - 1));
+                    _hasTerminator = header & (1 << 13);
+                    if (size > 0 && [pds left] >= size) {
+                        _frames[_frameCount].data = [pds dataPtr];
+                        _frames[_frameCount].len = size;
+                        _frameCount++;
+                        [pds skip:size];
+                    }
+                } else {
+                    unsigned int header = 0;
+                    do {
+                        header = (unsigned int)[pds next];
+                        if (header) {
+                            NSUInteger size = header & 0x7f;
+                            if ([pds left] >= size && _frameCount < MK_AUDIO_OUTPUT_MAX_FRAMES) {
+                                _frames[_frameCount].data = [pds dataPtr];
+                                _frames[_frameCount].len = size;
+                                _frameCount++;
                             }
+                            [pds skip:size];
+                        } else {
+                            _hasTerminator = YES;
                         }
-                    } else {
-                        unsigned int header = 0;
-                        do {
-                            header = (unsigned int)[pds next];
-                            if (header) {
-                                NSData *block = [pds copyDataBlock:(header & 0x7f)];
-                                if (block != nil) {
-                                    [_frames addObject:block];
-                                    [block release];
-                                }
-                            } else {
-                                _hasTerminator = YES;
-                            }
-                        } while ((header & 0x80) && [pds valid]);
-                    }
-
-                    if ([pds left]) {
-                        _pos[0] = [pds getFloat];
-                        _pos[1] = [pds getFloat];
-                        _pos[2] = [pds getFloat];
-                    } else {
-                        _pos[0] = 0.0f;
-                        _pos[1] = 0.0f;
-                        _pos[2] = 0.0f;
-                    }
-
-                    [pds release];
+                    } while ((header & 0x80) && [pds valid]);
+                }
 
-                    float a = (float) avail;
-                    if (a >= _averageAvailable) {
-                        _averageAvailable = a;
-                    } else {
-                        _averageAvailable *= 0.99f;
-                    }
-                } else {                    
-                    jitter_buffer_update_delay(_jitter, &jbp, NULL);
+                if ([pds left]) {
+                    _pos[0] = [pds getFloat];
+                    _pos[1] = [pds getFloat];
+                    _pos[2] = [pds getFloat];
+                } else {
+                    _pos[0] = 0.0f;
+                    _pos[1] = 0.0f;
+                    _pos[2] = 0.0f;
+                }
 
-                    _missCount++;
-                    if (_missCount > 10) {
-                        nextAlive = NO;
-                    }
+                float a = (float) avail;
+                if (a >= _averageAvailable) {
+                    _averageAvailable = a;
+                } else {
+                    _averageAvailable *= 0.99f;
                 }
+            } else {                    
+                jitter_buffer_update_delay(_jitter, &jbp, NULL);
 
-                [_jitterLock unlock];
+                _missCount++;
+                if (_missCount > 10) {
+                    nextAlive = NO;
+                }
             }
 
-            if ([_frames count] > 0) {
-                NSData *frameData = [_frames objectAtIndex:0];
+            [_jitterLock unlock];
+        }
 
-                if (_msgType == UDPVoiceOpusMessage) {
-                    if ([frameData length] <= INT_MAX) {
-                        decodedSamples = opus_decode_float(_opusDecoder, [frameData bytes], (int)[frameData length], output, (int)_audioBufferSize, 0);
-                        if (decodedSamples < 0) {
-                            decodedSamples = (int)_frameSize;
-                            memset(output, 0, _frameSize * sizeof(float));
-                        }
-                    } else {
+        if (_frameIndex < _frameCount) {
+            MKVoiceFrame *frame = &_frames[_frameIndex];
+            uint64_t decodeStart = _skipping ? 0 : MKAudioLatencyNow();
+            uint64_t profileStart = MKAudioProfilerNow();
+
+            if (_skipping) {
+                decodedSamples = (int)_frameSize;
+                if (_msgType == UDPVoiceOpusMessage && frame->len <= INT_MAX) {
+                    int n = opus_packet_get_nb_samples(frame->data, (opus_int32)frame->len, (opus_int32)_sampleRate);
+                    if (n > 0)
+                        decodedSamples = n;
+                }
+            } else if (_msgType == UDPVoiceOpusMessage) {
+                if (frame->len <= INT_MAX) {
+                    decodedSamples = opus_decode_float(_opusDecoder, frame->data, (int)frame->len, output, (int)_audioBufferSize, 0);
+                    if (decodedSamples < 0) {
                         decodedSamples = (int)_frameSize;
                         memset(output, 0, _frameSize * sizeof(float));
                     }
-                } else if (_msgType == UDPVoiceSpeexMessage) {
-                    if ([frameData length] > 0 && [frameData length] <= INT_MAX) {
-                        speex_bits_read_from(&_speexBits, [frameData bytes], (int)[frameData length]);
-                        speex_decode(_speexDecoder, &_speexBits, output);
-                    } else {
-                        speex_decode(_speexDecoder, NULL, output);
-                    }
-                    for (unsigned int i=0; i < _frameSize; i++) {
-                        output[i] *= (1.0f / 32767.0f);
-                    }
                 } else {
-                    __builtin_trap(); // CELT is no longer supported
+                    decodedSamples = (int)_frameSize;
+                    memset(output, 0, _frameSize * sizeof(float));
+                }
+            } else if (_msgType == UDPVoiceSpeexMessage) {
+                if (frame->len > 0 && frame->len <= INT_MAX) {
+                    speex_bits_read_from(&_speexBits, (char *)frame->data, (int)frame->len);
+                    speex_decode(_speexDecoder, &_speexBits, output);
+                } else {
+                    speex_decode(_speexDecoder, NULL, output);
+                }
+                for (unsigned int i=0; i < _frameSize; i++) {
+                    output[i] *= (1.0f / 32767.0f);
                 }
+            } else {
+                __builtin_trap(); // CELT is no longer supported
+            }
+            MKAudioLatencyRecordSince(MKAudioLatencyStageDecode, decodeStart);
+            if (!_skipping)
+                MKAudioProfilerRecordSince(MKAudioProfileStageDecode, profileStart);
 
-                [_frames removeObjectAtIndex:0];
+            _frameIndex++;
 
-                BOOL update = YES;
+            BOOL update = YES;
 
+            if (!_skipping) {
                 float pow = 0.0f;
                 for (i = 0; i < decodedSamples; ++i) {
                     pow += output[i] * output[i];
@@ -403,44 +748,52 @@
 
                 update = (pow < (_powerMin + 0.01f * (_powerMax - _powerMin)));
 
-                if ([_frames count] == 0 && update) {
-                    [_jitterLock lock];
-                    jitter_buffer_update_delay(_jitter, NULL, NULL);
-                    [_jitterLock unlock];
-                }
+                // Frames at the noise floor are what comfort noise should
+                // sound like.
+                if (update && !_useStereo)
+                    MKAudioComfortNoiseNoteBackground(output, decodedSamples);
+            }
 
-                if ([_frames count] == 0 && _hasTerminator) {
-                    nextAlive = NO;
-                }
-            } else {
-                if (_msgType == UDPVoiceOpusMessage) {
-                    decodedSamples = opus_decode_float(_opusDecoder, NULL, 0, output, (int)_frameSize, 0);
-                } else if (_msgType == UDPVoiceSpeexMessage) {
-                    speex_decode(_speexDecoder, NULL, output);
-                    for (unsigned int i = 0; i < _frameSize; i++)
-                        output[i] *= (1.0f / 32767.0f);
-                } else {
-                    __builtin_trap(); // CELT is no longer supported
-                }
+            if (_frameIndex == _frameCount && update) {
+                [_jitterLock lock];
+                jitter_buffer_update_delay(_jitter, NULL, NULL);
+                [_jitterLock unlock];
             }
 
-            if (! nextAlive) {
-                for (i = 0; i < _frameSize; i++) {
-                    output[i] *= _fadeOut[i];
-                }
-            } else if (ts == 0) {
-                for (i = 0; i < _frameSize; i++) {
-                    output[i] *= _fadeIn[i];
-                }
+            if (_frameIndex == _frameCount && _hasTerminator) {
+                nextAlive = NO;
+            }
+        } else if (!_skipping) {
+            if (_msgType == UDPVoiceOpusMessage) {
+                decodedSamples = opus_decode_float(_opusDecoder, NULL, 0, output, (int)_frameSize, 0);
+            } else if (_msgType == UDPVoiceSpeexMessage) {
+                speex_decode(_speexDecoder, NULL, output);
+                for (unsigned int i = 0; i < _frameSize; i++)
+                    output[i] *= (1.0f / 32767.0f);
+            } else {
+                __builtin_trap(); // CELT is no longer supported
             }
+        }
 
-            [_jitterLock lock];
-            int j;
-            for (j = decodedSamples / _frameSize; j > 0; j--)
-                jitter_buffer_tick(_jitter);
-            [_jitterLock unlock];
+        if (_skipping) {
+            // Nothing to fade.
+        } else if (! nextAlive) {
+            for (i = 0; i < _frameSize; i++) {
+                output[i] *= _fadeOut[i];
+            }
+        } else if (ts == 0 || _resumed) {
+            for (i = 0; i < _frameSize; i++) {
+                output[i] *= _fadeIn[i];
+            }
+            _resumed = NO;
         }
-        
+
+        [_jitterLock lock];
+        int j;
+        for (j = decodedSamples / _frameSize; j > 0; j--)
+            jitter_buffer_tick(_jitter);
+        [_jitterLock unlock];
+
         if (! nextAlive)
             _flags = 0xff;
 
@@ -460,31 +813,54 @@
                 break;
         }
 
+        // The new state is heard once everything already in the ring
+        // has been played.
         if (prevTalkState != _talkState) {
-            NSNotificationCenter *center = [NSNotificationCenter defaultCenter];
-            NSDictionary *talkStateDict = [NSDictionary dictionaryWithObjectsAndKeys:
-                                                [NSNumber numberWithUnsignedInteger:_talkState], @"talkState",
-                                                [NSNumber numberWithUnsignedInteger:_userSession], @"userSession",
-                                           nil];
-            NSNotification *talkNotification = [NSNotification notificationWithName:@"MKAudioUserTalkStateChanged" object:talkStateDict];
-            [center performSelectorOnMainThread:@selector(postNotification:) withObject:talkNotification waitUntilDone:NO];
+            uint64_t queued = (uint64_t)MKAudioRingBufferReadable(&_ring) * SAMPLE_RATE / _freq;
+            MKAudioTalkStatePost(_userSession, _talkState, MKAudioTalkStateSampleTime(MKAudioLatencyNow()) + queued);
         }
+    }
 
-nextframe:
-        {
-            spx_uint32_t inlen = decodedSamples;
-            spx_uint32_t outlen = (spx_uint32_t) (ceilf((float)(decodedSamples * _freq) / (float)_sampleRate));
-            
-            if (_resampler && _lastAlive) {
-                speex_resampler_process_float(_resampler, 0, _resamplerBuffer, &inlen, _buffer + _bufferFilled, &outlen);
-            }
-            _bufferFilled += outlen;
+    spx_uint32_t inlen = decodedSamples;
+    spx_uint32_t outlen = decodedSamples;
+    if (_skipping) {
+        outlen = (spx_uint32_t) (((NSUInteger)decodedSamples * _freq + _sampleRate - 1) / _sampleRate);
+    } else {
+        if (_resampler) {
+            outlen = (spx_uint32_t) (ceilf((float)(decodedSamples * _freq) / (float)_sampleRate));
+            uint64_t start = MKAudioProfilerNow();
+            speex_resampler_process_float(_resampler, 0, _resamplerBuffer, &inlen, _outputBuffer, &outlen);
+            MKAudioProfilerRecordSince(MKAudioProfileStageTalkerResample, start);
+        }
+        MKAudioRingBufferWrite(&_ring, _outputBuffer, outlen);
+
+        // In loopback mode, our own packet will be mixed once everything
+        // that is queued ahead of it has been played.
+        if (_notePlayout) {
+            _notePlayout = NO;
+            uint64_t queued = (uint64_t)MKAudioRingBufferReadable(&_ring) * NSEC_PER_SEC / _freq;
+            MKAudioLatencyNotePlayout(_packetSeq, MKAudioLatencyNow() + queued);
         }
     }
-    
-    BOOL tmp = _lastAlive;
-    _lastAlive = nextAlive;
-    return tmp;
+
+    if (! nextAlive) {
+        atomic_store_explicit(&_finished, YES, memory_order_release);
+    }
+    return outlen;
+}
+
+// Called on the render thread. Only hands out already-decoded samples from
+// the ring; all decoding happens on MKAudioOutput's decode threads.
+//
+// If the decoder has fallen behind, we never wait for it. The view is simply
+// shorter than requested, and the mixer conceals the rest.
+- (BOOL) needSamples:(NSUInteger)nsamples {
+    BOOL finished = [self isFinished];
+    NSUInteger navail = [self peekSamples:nsamples];
+    if (navail < nsamples && !finished) {
+        atomic_fetch_add(&_underruns, 1);
+    }
+    return !(finished && navail == 0);
 }
 
 @end
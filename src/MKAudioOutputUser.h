@@ -3,17 +3,44 @@
 // license that can be found in the LICENSE file.
 
 #import <MumbleKit/MKUser.h>
+#import "MKAudioRingBuffer.h"
 
+// The most channels the positional mixer renders to, and the longest
+// interaural time difference (in samples) it can apply.
+#define MK_AUDIO_MIX_MAX_CHANNELS     8
+#define MK_AUDIO_MIX_MAX_ITD_SAMPLES  64
+
+// Per-source state kept by the mixer between render calls, so that gains
+// and delays can be ramped from where the previous buffer left off.
+typedef struct _MKAudioMixState {
+    BOOL         initialized;
+    float        gain[MK_AUDIO_MIX_MAX_CHANNELS];
+    NSUInteger   delay[MK_AUDIO_MIX_MAX_CHANNELS];
+    float        history[MK_AUDIO_MIX_MAX_ITD_SAMPLES];
+} MKAudioMixState;
+
+// MKAudioOutputUser is a source of audio for MKAudioOutput's mixer.
+//
+// Each source owns a fixed-size ring of output samples. The mixer asks for
+// nsamples via needSamples:, mixes directly out of the view returned by
+// bufferView, and then hands the samples back with consumeSamples.
 @interface MKAudioOutputUser : NSObject
 
-- (id) init;
+- (id) initWithBufferCapacity:(NSUInteger)nsamples;
 - (void) dealloc;
 
 - (MKUser *) user;
-- (float *) buffer;
-- (NSUInteger) bufferLength;
+- (NSUInteger) bufferCapacity;
+
+- (void) getPosition:(float *)pos;
+- (MKAudioMixState *) mixState;
+
+- (float) localVolume;
+- (void) setLocalVolume:(float)volume;
 
 - (BOOL) needSamples:(NSUInteger)nsamples;
-- (void) resizeBuffer:(NSUInteger)newSize;
+- (MKAudioRingBufferView) bufferView;
+- (float) concealmentSample;
+- (void) consumeSamples;
 
 @end
@@ -7,21 +7,24 @@
 
 @implementation MKAudioOutputUser
 
-- (id) init {
+- (id) initWithBufferCapacity:(NSUInteger)nsamples {
     if ((self = [super init])) {
-        _bufferSize = 0;
-        _buffer = NULL;
+        MKAudioRingBufferInit(&_ring, nsamples);
+        memset(&_view, 0, sizeof(_view));
+        _requested = 0;
+        _lastSample = 0.0f;
         _volume = NULL;
         _pos[0] = 0.0f;
         _pos[1] = 0.0f;
         _pos[2] = 0.0f;
+        memset(&_mixState, 0, sizeof(_mixState));
+        atomic_init(&_localVolume, 1.0f);
     }
     return self;
 }
 
 - (void) dealloc {
-    if (_buffer)
-        free(_buffer);
+    MKAudioRingBufferDestroy(&_ring);
     if (_volume)
         free(_volume);
 
@@ -32,28 +35,78 @@
     return nil;
 }
 
-- (float *) buffer {
-    return _buffer;
+- (NSUInteger) bufferCapacity {
+    return _ring.capacity;
 }
 
-- (NSUInteger) bufferLength {
-    return _bufferSize;
+// The position of the source in the game world, as sent along with its
+// last voice packet. All zeroes means the source has no position.
+- (void) getPosition:(float *)pos {
+    pos[0] = _pos[0];
+    pos[1] = _pos[1];
+    pos[2] = _pos[2];
 }
 
-- (void) resizeBuffer:(NSUInteger)newSize {
-    if (newSize > _bufferSize) {
-        float *n = malloc(sizeof(float) * newSize);
-        if (_buffer != NULL) {
-            memcpy(n, _buffer, sizeof(float) * _bufferSize);
-            free(_buffer);
-        }
-        _buffer = n;
-        _bufferSize = newSize;
-    }
+- (MKAudioMixState *) mixState {
+    return &_mixState;
+}
+
+// An extra gain applied by the mixer, for local per-user volume control.
+- (float) localVolume {
+    return atomic_load_explicit(&_localVolume, memory_order_relaxed);
+}
+
+- (void) setLocalVolume:(float)volume {
+    atomic_store_explicit(&_localVolume, volume, memory_order_relaxed);
 }
 
+// Subclasses prepare a view of up to nsamples readable samples here (using
+// peekSamples:), and return NO once they will never produce any more audio.
 - (BOOL) needSamples:(NSUInteger)nsamples {
+    [self peekSamples:0];
     return NO;
 }
 
+- (NSUInteger) peekSamples:(NSUInteger)nsamples {
+    _requested = nsamples;
+    return MKAudioRingBufferPeek(&_ring, nsamples, &_view);
+}
+
+// Empties the ring and forgets all mixer state, so the source can be reused
+// for a new stream. Neither the producer nor the mixer may be using it.
+- (void) resetBuffer {
+    MKAudioRingBufferReset(&_ring);
+    memset(&_view, 0, sizeof(_view));
+    _requested = 0;
+    _lastSample = 0.0f;
+    _pos[0] = 0.0f;
+    _pos[1] = 0.0f;
+    _pos[2] = 0.0f;
+    memset(&_mixState, 0, sizeof(_mixState));
+}
+
+- (MKAudioRingBufferView) bufferView {
+    return _view;
+}
+
+// The sample that the mixer should let decay into silence if the view is
+// shorter than what was asked for.
+- (float) concealmentSample {
+    if (_view.length[1] > 0)
+        return _view.data[1][_view.length[1]-1];
+    if (_view.length[0] > 0)
+        return _view.data[0][_view.length[0]-1];
+    return _lastSample;
+}
+
+// Once a short view has been concealed, the next one starts from silence.
+- (void) consumeSamples {
+    _lastSample = (_view.total == _requested) ? [self concealmentSample] : 0.0f;
+    if (_view.total > 0) {
+        MKAudioRingBufferConsume(&_ring, _view.total);
+    }
+    memset(&_view, 0, sizeof(_view));
+    _requested = 0;
+}
+
 @end
@@ -2,12 +2,20 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
+#import "MKAudioRingBuffer.h"
+
 @interface MKAudioOutputUser () {
 @protected
-    NSString    *_name;
-    NSUInteger   _bufferSize;
-    float       *_buffer;
-    float       *_volume;
-    float        _pos[3];
+    NSString               *_name;
+    MKAudioRingBuffer       _ring;
+    MKAudioRingBufferView   _view;
+    NSUInteger              _requested;
+    float                   _lastSample;
+    float                  *_volume;
+    float                   _pos[3];
+    MKAudioMixState         _mixState;
+    _Atomic float           _localVolume;
 }
-@end
\ No newline at end of file
+- (NSUInteger) peekSamples:(NSUInteger)nsamples;
+- (void) resetBuffer;
+@end
@@ -0,0 +1,23 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#import <MumbleKit/MKAudio.h>
+
+// Process-wide run time histograms for the stages of the audio pipeline.
+//
+// Timestamps come from mach_absolute_time(), and are only converted to
+// nanoseconds when a sample is recorded. Recording is a handful of relaxed
+// atomic operations, so it is safe to do from the audio threads.
+
+uint64_t MKAudioProfilerNow(void);
+uint64_t MKAudioProfilerRecordSince(MKAudioProfileStage stage, uint64_t start);
+uint64_t MKAudioProfilerNanoseconds(uint64_t ticks);
+void MKAudioProfilerGetHistogram(MKAudioProfileStage stage, MKAudioProfileHistogram *hist);
+double MKAudioProfilerBucketLimit(NSUInteger bucket);
+void MKAudioProfilerReset(void);
+
+// Render callbacks, and how many of them took longer than the audio they
+// produced lasts.
+void MKAudioProfilerNoteRenderCycle(BOOL missed);
+NSUInteger MKAudioProfilerRenderCycles(NSUInteger *misses);
@@ -0,0 +1,142 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#import "MKAudioProfiler.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <mach/mach_time.h>
+
+// Bucket i holds samples below 1us * 2^(i/2). The last bucket holds
+// everything above that, which is anything over about 33ms.
+#define MK_AUDIO_PROFILE_FIRST_LIMIT_NS  1000.0
+
+typedef struct _MKAudioProfileStats {
+    _Atomic uint64_t     count;
+    _Atomic uint64_t     sum;
+    _Atomic uint64_t     min;
+    _Atomic uint64_t     max;
+    _Atomic uint64_t     buckets[MK_AUDIO_PROFILE_BUCKETS];
+} MKAudioProfileStats;
+
+static MKAudioProfileStats MKAudioProfileStages[MKAudioProfileStageCount];
+static uint64_t MKAudioProfileLimits[MK_AUDIO_PROFILE_BUCKETS - 1];
+static mach_timebase_info_data_t MKAudioProfileTimebase;
+static pthread_once_t MKAudioProfileOnce = PTHREAD_ONCE_INIT;
+
+static _Atomic uint64_t MKAudioProfileRenderCycles = 0;
+static _Atomic uint64_t MKAudioProfileRenderMisses = 0;
+
+static void MKAudioProfilerInit(void) {
+    NSUInteger i;
+    mach_timebase_info(&MKAudioProfileTimebase);
+    for (i = 0; i < MK_AUDIO_PROFILE_BUCKETS - 1; i++)
+        MKAudioProfileLimits[i] = (uint64_t)(MK_AUDIO_PROFILE_FIRST_LIMIT_NS * pow(2.0, i / 2.0));
+    for (i = 0; i < MKAudioProfileStageCount; i++)
+        atomic_store(&MKAudioProfileStages[i].min, UINT64_MAX);
+}
+
+uint64_t MKAudioProfilerNow(void) {
+    return mach_absolute_time();
+}
+
+uint64_t MKAudioProfilerNanoseconds(uint64_t ticks) {
+    pthread_once(&MKAudioProfileOnce, MKAudioProfilerInit);
+    return ticks * MKAudioProfileTimebase.numer / MKAudioProfileTimebase.denom;
+}
+
+static NSUInteger MKAudioProfilerBucket(uint64_t ns) {
+    NSUInteger lo = 0, hi = MK_AUDIO_PROFILE_BUCKETS - 1;
+    while (lo < hi) {
+        NSUInteger mid = (lo + hi) / 2;
+        if (ns < MKAudioProfileLimits[mid])
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+// Returns the recorded time in nanoseconds.
+uint64_t MKAudioProfilerRecordSince(MKAudioProfileStage stage, uint64_t start) {
+    uint64_t now = mach_absolute_time();
+    if (stage >= MKAudioProfileStageCount || now < start)
+        return 0;
+
+    uint64_t ns = MKAudioProfilerNanoseconds(now - start);
+    MKAudioProfileStats *s = &MKAudioProfileStages[stage];
+    atomic_fetch_add_explicit(&s->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->sum, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->buckets[MKAudioProfilerBucket(ns)], 1, memory_order_relaxed);
+
+    uint64_t cur = atomic_load_explicit(&s->min, memory_order_relaxed);
+    while (ns < cur && !atomic_compare_exchange_weak_explicit(&s->min, &cur, ns, memory_order_relaxed, memory_order_relaxed))
+        ;
+    cur = atomic_load_explicit(&s->max, memory_order_relaxed);
+    while (ns > cur && !atomic_compare_exchange_weak_explicit(&s->max, &cur, ns, memory_order_relaxed, memory_order_relaxed))
+        ;
+    return ns;
+}
+
+// Like the latency histograms, this may be off by a few samples while the
+// stage is being recorded.
+void MKAudioProfilerGetHistogram(MKAudioProfileStage stage, MKAudioProfileHistogram *hist) {
+    NSUInteger i;
+
+    pthread_once(&MKAudioProfileOnce, MKAudioProfilerInit);
+    memset(hist, 0, sizeof(MKAudioProfileHistogram));
+    if (stage >= MKAudioProfileStageCount)
+        return;
+
+    MKAudioProfileStats *s = &MKAudioProfileStages[stage];
+    uint64_t count = atomic_load_explicit(&s->count, memory_order_relaxed);
+    if (count == 0)
+        return;
+
+    hist->count = (NSUInteger)count;
+    hist->minimum = atomic_load_explicit(&s->min, memory_order_relaxed) / 1e3;
+    hist->maximum = atomic_load_explicit(&s->max, memory_order_relaxed) / 1e3;
+    hist->mean = (atomic_load_explicit(&s->sum, memory_order_relaxed) / 1e3) / count;
+    for (i = 0; i < MK_AUDIO_PROFILE_BUCKETS; i++)
+        hist->buckets[i] = (NSUInteger)atomic_load_explicit(&s->buckets[i], memory_order_relaxed);
+}
+
+// Returns the upper limit of a bucket in microseconds. The last bucket has
+// no upper limit.
+double MKAudioProfilerBucketLimit(NSUInteger bucket) {
+    pthread_once(&MKAudioProfileOnce, MKAudioProfilerInit);
+    if (bucket >= MK_AUDIO_PROFILE_BUCKETS - 1)
+        return INFINITY;
+    return MKAudioProfileLimits[bucket] / 1e3;
+}
+
+void MKAudioProfilerReset(void) {
+    NSUInteger i, j;
+
+    pthread_once(&MKAudioProfileOnce, MKAudioProfilerInit);
+    for (i = 0; i < MKAudioProfileStageCount; i++) {
+        MKAudioProfileStats *s = &MKAudioProfileStages[i];
+        atomic_store(&s->count, 0);
+        atomic_store(&s->sum, 0);
+        atomic_store(&s->min, UINT64_MAX);
+        atomic_store(&s->max, 0);
+        for (j = 0; j < MK_AUDIO_PROFILE_BUCKETS; j++)
+            atomic_store(&s->buckets[j], 0);
+    }
+    atomic_store(&MKAudioProfileRenderCycles, 0);
+    atomic_store(&MKAudioProfileRenderMisses, 0);
+}
+
+void MKAudioProfilerNoteRenderCycle(BOOL missed) {
+    atomic_fetch_add_explicit(&MKAudioProfileRenderCycles, 1, memory_order_relaxed);
+    if (missed)
+        atomic_fetch_add_explicit(&MKAudioProfileRenderMisses, 1, memory_order_relaxed);
+}
+
+NSUInteger MKAudioProfilerRenderCycles(NSUInteger *misses) {
+    if (misses)
+        *misses = (NSUInteger)atomic_load_explicit(&MKAudioProfileRenderMisses, memory_order_relaxed);
+    return (NSUInteger)atomic_load_explicit(&MKAudioProfileRenderCycles, memory_order_relaxed);
+}
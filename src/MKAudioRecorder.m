@@ -0,0 +1,462 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#import <MumbleKit/MKAudio.h>
+#import <MumbleKit/MKAudioRecorder.h>
+#import "MKPacketDataStream.h"
+#import "MKVoicePacket.h"
+
+#include <opus.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+// How many received packets may be waiting for the writer thread. At 50
+// packets per second per talker, this is well over a second of 50 talkers.
+#define MK_RECORDER_QUEUE_SIZE       4096
+#define MK_RECORDER_BATCH_SIZE       256
+
+// Pages are written once they are this full, or once they have been open for
+// this long, so that a crash loses at most about a second per track.
+#define MK_RECORDER_PAGE_MAX_BODY    8192
+#define MK_RECORDER_PAGE_MAX_SEGS    255
+#define MK_RECORDER_PAGE_MAX_AGE_NS  (1000ULL * NSEC_PER_MSEC)
+
+// A received packet that starts more than this many 10ms frames after the
+// previous one of the same talker begins a new talk burst.
+#define MK_RECORDER_MAX_SEQ_GAP      50
+
+#define MK_RECORDER_FRAME_SAMPLES    (SAMPLE_RATE / 100)
+
+typedef struct _MKRecorderEntry {
+    MKVoicePacket      *packet;
+    NSUInteger          session;
+    NSUInteger          seq;
+    uint64_t            time;
+} MKRecorderEntry;
+
+typedef struct _MKRecorderTrack {
+    NSUInteger          session;
+    FILE               *file;
+    uint32_t            serial;
+    uint32_t            pageSeq;
+    uint64_t            granule;
+    BOOL                inBurst;
+    NSUInteger          nextSeq;
+
+    uint64_t            pageGranule;
+    uint64_t            pageOpened;
+    unsigned char       segments[MK_RECORDER_PAGE_MAX_SEGS];
+    NSUInteger          nsegments;
+    unsigned char       body[MK_RECORDER_PAGE_MAX_BODY];
+    NSUInteger          bodyLen;
+} MKRecorderTrack;
+
+static uint32_t MKOggCRCTable[256];
+static pthread_once_t MKOggCRCOnce = PTHREAD_ONCE_INIT;
+
+static void MKOggCRCInit(void) {
+    uint32_t i, j;
+    for (i = 0; i < 256; i++) {
+        uint32_t r = i << 24;
+        for (j = 0; j < 8; j++)
+            r = (r & 0x80000000U) ? ((r << 1) ^ 0x04c11db7U) : (r << 1);
+        MKOggCRCTable[i] = r;
+    }
+}
+
+static uint32_t MKOggCRC(uint32_t crc, const unsigned char *data, NSUInteger len) {
+    NSUInteger i;
+    for (i = 0; i < len; i++)
+        crc = (crc << 8) ^ MKOggCRCTable[((crc >> 24) & 0xff) ^ data[i]];
+    return crc;
+}
+
+static void MKWriteLE32(unsigned char *p, uint32_t v) {
+    p[0] = v & 0xff; p[1] = (v >> 8) & 0xff; p[2] = (v >> 16) & 0xff; p[3] = (v >> 24) & 0xff;
+}
+
+static void MKWriteLE64(unsigned char *p, uint64_t v) {
+    MKWriteLE32(p, (uint32_t)(v & 0xffffffffU));
+    MKWriteLE32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t MKRecorderNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+// Writes out the track's current page. Packets never span pages.
+static void MKRecorderTrackFlushPage(MKRecorderTrack *t, unsigned char headerType) {
+    unsigned char header[27];
+
+    if (t->nsegments == 0 && !(headerType & 0x04))
+        return;
+
+    memcpy(header, "OggS", 4);
+    header[4] = 0;
+    header[5] = headerType;
+    MKWriteLE64(header + 6, t->pageGranule);
+    MKWriteLE32(header + 14, t->serial);
+    MKWriteLE32(header + 18, t->pageSeq++);
+    MKWriteLE32(header + 22, 0);
+    header[26] = (unsigned char) t->nsegments;
+
+    uint32_t crc = MKOggCRC(0, header, sizeof(header));
+    crc = MKOggCRC(crc, t->segments, t->nsegments);
+    crc = MKOggCRC(crc, t->body, t->bodyLen);
+    MKWriteLE32(header + 22, crc);
+
+    fwrite(header, 1, sizeof(header), t->file);
+    fwrite(t->segments, 1, t->nsegments, t->file);
+    fwrite(t->body, 1, t->bodyLen, t->file);
+
+    t->nsegments = 0;
+    t->bodyLen = 0;
+}
+
+static void MKRecorderTrackAddPacket(MKRecorderTrack *t, const unsigned char *data, NSUInteger len, NSUInteger samples, uint64_t now) {
+    NSUInteger nsegs = len / 255 + 1;
+    if (t->nsegments + nsegs > MK_RECORDER_PAGE_MAX_SEGS || t->bodyLen + len > MK_RECORDER_PAGE_MAX_BODY)
+        MKRecorderTrackFlushPage(t, 0);
+    if (t->nsegments == 0)
+        t->pageOpened = now;
+
+    NSUInteger i;
+    for (i = 0; i < nsegs - 1; i++)
+        t->segments[t->nsegments++] = 255;
+    t->segments[t->nsegments++] = (unsigned char)(len % 255);
+    memcpy(t->body + t->bodyLen, data, len);
+    t->bodyLen += len;
+
+    t->granule += samples;
+    t->pageGranule = t->granule;
+}
+
+// Fills a gap with Opus packets that carry no data for their frames, which
+// decoders treat as silence. Uses 120ms packets (six empty 20ms CELT frames),
+// then 20ms and 10ms ones for the remainder.
+static void MKRecorderTrackAddSilence(MKRecorderTrack *t, uint64_t nsamples, uint64_t now) {
+    static const unsigned char silence120[2] = { 0xfb, 0x06 };
+    static const unsigned char silence20[1] = { 0xf8 };
+    static const unsigned char silence10[1] = { 0xf0 };
+
+    while (nsamples >= 6 * 2 * MK_RECORDER_FRAME_SAMPLES) {
+        MKRecorderTrackAddPacket(t, silence120, sizeof(silence120), 6 * 2 * MK_RECORDER_FRAME_SAMPLES, now);
+        nsamples -= 6 * 2 * MK_RECORDER_FRAME_SAMPLES;
+    }
+    while (nsamples >= 2 * MK_RECORDER_FRAME_SAMPLES) {
+        MKRecorderTrackAddPacket(t, silence20, sizeof(silence20), 2 * MK_RECORDER_FRAME_SAMPLES, now);
+        nsamples -= 2 * MK_RECORDER_FRAME_SAMPLES;
+    }
+    if (nsamples >= MK_RECORDER_FRAME_SAMPLES) {
+        MKRecorderTrackAddPacket(t, silence10, sizeof(silence10), MK_RECORDER_FRAME_SAMPLES, now);
+    }
+}
+
+static MKRecorderTrack *MKRecorderTrackCreate(NSString *path, NSUInteger session, uint32_t serial) {
+    FILE *f = fopen([path fileSystemRepresentation], "wb");
+    if (f == NULL) {
+        NSLog(@"MKAudioRecorder: unable to open %@ for writing", path);
+        return NULL;
+    }
+
+    MKRecorderTrack *t = calloc(1, sizeof(MKRecorderTrack));
+    t->session = session;
+    t->file = f;
+    t->serial = serial;
+
+    // RFC 7845 identification header, alone on the first page.
+    unsigned char head[19];
+    memcpy(head, "OpusHead", 8);
+    head[8] = 1;
+    head[9] = 1;
+    head[10] = 0; head[11] = 0;
+    MKWriteLE32(head + 12, SAMPLE_RATE);
+    head[16] = 0; head[17] = 0;
+    head[18] = 0;
+    MKRecorderTrackAddPacket(t, head, sizeof(head), 0, 0);
+    MKRecorderTrackFlushPage(t, 0x02);
+
+    // Comment header, also on a page of its own.
+    const char *vendor = "MumbleKit";
+    char comment[64];
+    int clen = snprintf(comment, sizeof(comment), "MUMBLE_SESSION=%lu", (unsigned long)session);
+    unsigned char tags[8 + 4 + 16 + 4 + 4 + sizeof(comment)];
+    NSUInteger vlen = strlen(vendor), off = 0;
+    memcpy(tags, "OpusTags", 8); off += 8;
+    MKWriteLE32(tags + off, (uint32_t)vlen); off += 4;
+    memcpy(tags + off, vendor, vlen); off += vlen;
+    MKWriteLE32(tags + off, 1); off += 4;
+    MKWriteLE32(tags + off, (uint32_t)clen); off += 4;
+    memcpy(tags + off, comment, (size_t)clen); off += (NSUInteger)clen;
+    MKRecorderTrackAddPacket(t, tags, off, 0, 0);
+    MKRecorderTrackFlushPage(t, 0);
+
+    return t;
+}
+
+static void MKRecorderTrackClose(MKRecorderTrack *t) {
+    MKRecorderTrackFlushPage(t, 0x04);
+    fclose(t->file);
+    free(t);
+}
+
+@interface MKAudioRecorder () {
+    NSString                *_directory;
+
+    pthread_mutex_t          _queueLock;
+    MKRecorderEntry         *_queue;
+    NSUInteger               _queueHead;
+    NSUInteger               _queueCount;
+    _Atomic NSUInteger       _dropped;
+    _Atomic BOOL             _recording;
+
+    NSThread                *_writerThread;
+    dispatch_semaphore_t     _writerSema;
+    dispatch_semaphore_t     _writerExitSema;
+
+    // Only touched by the writer thread.
+    uint64_t                 _startTime;
+    MKRecorderTrack        **_tracks;
+    NSUInteger               _ntracks;
+    NSUInteger               _tracksCapacity;
+    MKPacketDataStream      *_pds;
+}
+- (void) writerThreadMain;
+- (void) discardQueue;
+@end
+
+@implementation MKAudioRecorder
+
+- (id) initWithDirectory:(NSString *)path {
+    if ((self = [super init])) {
+        pthread_once(&MKOggCRCOnce, MKOggCRCInit);
+        _directory = [path copy];
+        pthread_mutex_init(&_queueLock, NULL);
+        _queue = calloc(MK_RECORDER_QUEUE_SIZE, sizeof(MKRecorderEntry));
+        atomic_init(&_dropped, 0);
+        atomic_init(&_recording, NO);
+        _writerSema = dispatch_semaphore_create(0);
+        _writerExitSema = dispatch_semaphore_create(0);
+        _pds = [[MKPacketDataStream alloc] initWithBuffer:NULL length:0];
+    }
+    return self;
+}
+
+- (void) dealloc {
+    [self stop];
+    [self discardQueue];
+
+    pthread_mutex_destroy(&_queueLock);
+    free(_queue);
+    dispatch_release(_writerSema);
+    dispatch_release(_writerExitSema);
+    [_pds release];
+    [_directory release];
+
+    [super dealloc];
+}
+
+- (BOOL) start {
+    if (atomic_load(&_recording))
+        return YES;
+
+    // Packets that were queued while the last recording was stopping
+    // belong to that recording.
+    [self discardQueue];
+
+    _startTime = MKRecorderNow();
+    _ntracks = 0;
+
+    // The writer thread must not retain us, or we would never be deallocated.
+    __block MKAudioRecorder *recorder = self;
+    _writerThread = [[NSThread alloc] initWithBlock:^{
+        [recorder writerThreadMain];
+    }];
+    [_writerThread setName:@"MKAudioRecorder writer"];
+    [_writerThread setQualityOfService:NSQualityOfServiceUtility];
+
+    atomic_store(&_recording, YES);
+    [_writerThread start];
+    return YES;
+}
+
+- (void) stop {
+    if (!atomic_exchange(&_recording, NO))
+        return;
+
+    dispatch_semaphore_signal(_writerSema);
+    dispatch_semaphore_wait(_writerExitSema, DISPATCH_TIME_FOREVER);
+    [_writerThread release];
+    _writerThread = nil;
+}
+
+// A packet may still be queued after the writer thread's last drain, by a
+// receive path that saw the recorder running just before it was stopped.
+// Must not be called while the writer thread runs.
+- (void) discardQueue {
+    pthread_mutex_lock(&_queueLock);
+    while (_queueCount > 0) {
+        MKVoicePacketRelease(_queue[_queueHead].packet);
+        _queueHead = (_queueHead + 1) % MK_RECORDER_QUEUE_SIZE;
+        _queueCount--;
+    }
+    pthread_mutex_unlock(&_queueLock);
+}
+
+- (BOOL) isRecording {
+    return atomic_load(&_recording);
+}
+
+- (NSUInteger) droppedPackets {
+    return atomic_load(&_dropped);
+}
+
+// Called on the receive path. Only takes a reference to the packet.
+- (void) recordVoicePacket:(MKVoicePacket *)packet forSession:(NSUInteger)session sequence:(NSUInteger)seq type:(MKUDPMessageType)msgType {
+    if (msgType != UDPVoiceOpusMessage || !atomic_load_explicit(&_recording, memory_order_relaxed))
+        return;
+
+    uint64_t now = MKRecorderNow();
+    BOOL queued = NO;
+
+    pthread_mutex_lock(&_queueLock);
+    if (_queueCount < MK_RECORDER_QUEUE_SIZE) {
+        MKRecorderEntry *e = &_queue[(_queueHead + _queueCount) % MK_RECORDER_QUEUE_SIZE];
+        e->packet = MKVoicePacketRetain(packet);
+        e->session = session;
+        e->seq = seq;
+        e->time = now;
+        _queueCount++;
+        queued = YES;
+    }
+    pthread_mutex_unlock(&_queueLock);
+
+    if (queued)
+        dispatch_semaphore_signal(_writerSema);
+    else
+        atomic_fetch_add(&_dropped, 1);
+}
+
+- (MKRecorderTrack *) trackForSession:(NSUInteger)session {
+    NSUInteger i;
+    for (i = 0; i < _ntracks; i++) {
+        if (_tracks[i]->session == session)
+            return _tracks[i];
+    }
+
+    if (_ntracks == _tracksCapacity) {
+        NSUInteger capacity = MAX(16, _tracksCapacity * 2);
+        MKRecorderTrack **tracks = realloc(_tracks, capacity * sizeof(MKRecorderTrack *));
+        if (tracks == NULL)
+            return NULL;
+        _tracks = tracks;
+        _tracksCapacity = capacity;
+    }
+
+    NSString *path = [_directory stringByAppendingPathComponent:[NSString stringWithFormat:@"session-%lu.opus", (unsigned long)session]];
+    MKRecorderTrack *t = MKRecorderTrackCreate(path, session, (uint32_t)(session * 2654435761U) ^ (uint32_t)_startTime);
+    if (t != NULL)
+        _tracks[_ntracks++] = t;
+    return t;
+}
+
+- (void) writeEntry:(MKRecorderEntry *)e {
+    MKVoicePacket *packet = e->packet;
+    MKPacketDataStream *pds = _pds;
+
+    [pds resetWithBuffer:MKVoicePacketBytes(packet) length:packet->length];
+    [pds next];
+    uint64_t header = [pds getVarint];
+    NSUInteger size = (NSUInteger)(header & ((1 << 13) - 1));
+    BOOL terminator = (header & (1 << 13)) != 0;
+    if (![pds valid] || [pds left] < size)
+        return;
+
+    MKRecorderTrack *t = [self trackForSession:e->session];
+    if (t == NULL)
+        return;
+
+    if (size > 0) {
+        const unsigned char *data = [pds dataPtr];
+        int samples = opus_packet_get_nb_samples(data, (opus_int32)size, SAMPLE_RATE);
+        if (samples <= 0)
+            return;
+
+        if (!t->inBurst || e->seq < t->nextSeq || e->seq > t->nextSeq + MK_RECORDER_MAX_SEQ_GAP) {
+            // A new talk burst starts where it was received on the shared
+            // timeline, unless the track is already past that point.
+            uint64_t pos = 0;
+            if (e->time > _startTime)
+                pos = ((e->time - _startTime) * SAMPLE_RATE) / NSEC_PER_SEC;
+            if (pos > t->granule)
+                MKRecorderTrackAddSilence(t, pos - t->granule, e->time);
+            t->inBurst = YES;
+        } else if (e->seq > t->nextSeq) {
+            // Packets lost within a burst.
+            MKRecorderTrackAddSilence(t, (uint64_t)(e->seq - t->nextSeq) * MK_RECORDER_FRAME_SAMPLES, e->time);
+        }
+
+        MKRecorderTrackAddPacket(t, data, size, (NSUInteger)samples, e->time);
+        t->nextSeq = e->seq + (NSUInteger)samples / MK_RECORDER_FRAME_SAMPLES;
+    }
+
+    if (terminator) {
+        t->inBurst = NO;
+        MKRecorderTrackFlushPage(t, 0);
+    }
+}
+
+- (void) writerThreadMain {
+    MKRecorderEntry batch[MK_RECORDER_BATCH_SIZE];
+    NSUInteger i, n;
+    BOOL running = YES;
+
+    while (running) {
+        dispatch_semaphore_wait(_writerSema, dispatch_time(DISPATCH_TIME_NOW, 250 * NSEC_PER_MSEC));
+        running = atomic_load(&_recording);
+
+        // Drain everything that was queued so far, even when stopping.
+        for (;;) {
+            pthread_mutex_lock(&_queueLock);
+            n = MIN(_queueCount, MK_RECORDER_BATCH_SIZE);
+            for (i = 0; i < n; i++)
+                batch[i] = _queue[(_queueHead + i) % MK_RECORDER_QUEUE_SIZE];
+            _queueHead = (_queueHead + n) % MK_RECORDER_QUEUE_SIZE;
+            _queueCount -= n;
+            pthread_mutex_unlock(&_queueLock);
+
+            if (n == 0)
+                break;
+
+            NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+            for (i = 0; i < n; i++) {
+                [self writeEntry:&batch[i]];
+                MKVoicePacketRelease(batch[i].packet);
+            }
+            [pool release];
+        }
+
+        uint64_t now = MKRecorderNow();
+        for (i = 0; i < _ntracks; i++) {
+            MKRecorderTrack *t = _tracks[i];
+            if (t->nsegments > 0 && now - t->pageOpened > MK_RECORDER_PAGE_MAX_AGE_NS)
+                MKRecorderTrackFlushPage(t, 0);
+        }
+    }
+
+    for (i = 0; i < _ntracks; i++)
+        MKRecorderTrackClose(_tracks[i]);
+    free(_tracks);
+    _tracks = NULL;
+    _ntracks = 0;
+    _tracksCapacity = 0;
+
+    dispatch_semaphore_signal(_writerExitSema);
+}
+
+@end
@@ -0,0 +1,39 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <stdatomic.h>
+
+// MKAudioRingBuffer is a single-producer, single-consumer ring of float samples.
+//
+// One thread may write to the ring while another thread reads from it without
+// any locking. The capacity is always rounded up to a power of two, so read and
+// write positions are free-running counters that are masked on access.
+typedef struct _MKAudioRingBuffer {
+    float                 *buf;
+    uint32_t               capacity;
+    uint32_t               mask;
+    _Atomic uint32_t       readPos;
+    _Atomic uint32_t       writePos;
+} MKAudioRingBuffer;
+
+// A read-only view of the readable part of a ring. Because the ring wraps
+// around, the samples may be split across two contiguous spans.
+typedef struct _MKAudioRingBufferView {
+    const float           *data[2];
+    NSUInteger             length[2];
+    NSUInteger             total;
+} MKAudioRingBufferView;
+
+BOOL MKAudioRingBufferInit(MKAudioRingBuffer *rb, NSUInteger minCapacity);
+void MKAudioRingBufferDestroy(MKAudioRingBuffer *rb);
+void MKAudioRingBufferReset(MKAudioRingBuffer *rb);
+
+NSUInteger MKAudioRingBufferReadable(MKAudioRingBuffer *rb);
+NSUInteger MKAudioRingBufferWritable(MKAudioRingBuffer *rb);
+
+NSUInteger MKAudioRingBufferWrite(MKAudioRingBuffer *rb, const float *src, NSUInteger nsamp);
+NSUInteger MKAudioRingBufferRead(MKAudioRingBuffer *rb, float *dst, NSUInteger nsamp);
+
+NSUInteger MKAudioRingBufferPeek(MKAudioRingBuffer *rb, NSUInteger nsamp, MKAudioRingBufferView *view);
+void MKAudioRingBufferConsume(MKAudioRingBuffer *rb, NSUInteger nsamp);
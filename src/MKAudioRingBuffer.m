@@ -0,0 +1,113 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#import "MKAudioRingBuffer.h"
+
+BOOL MKAudioRingBufferInit(MKAudioRingBuffer *rb, NSUInteger minCapacity) {
+    uint32_t capacity = 1;
+    while (capacity < minCapacity && capacity < (1U << 30))
+        capacity <<= 1;
+
+    rb->buf = calloc(capacity, sizeof(float));
+    if (rb->buf == NULL) {
+        rb->capacity = 0;
+        rb->mask = 0;
+        return NO;
+    }
+    rb->capacity = capacity;
+    rb->mask = capacity - 1;
+    atomic_init(&rb->readPos, 0);
+    atomic_init(&rb->writePos, 0);
+    return YES;
+}
+
+void MKAudioRingBufferDestroy(MKAudioRingBuffer *rb) {
+    if (rb->buf)
+        free(rb->buf);
+    rb->buf = NULL;
+    rb->capacity = 0;
+    rb->mask = 0;
+}
+
+// Must only be called while neither the producer nor the consumer
+// is accessing the ring.
+void MKAudioRingBufferReset(MKAudioRingBuffer *rb) {
+    atomic_store_explicit(&rb->readPos, 0, memory_order_relaxed);
+    atomic_store_explicit(&rb->writePos, 0, memory_order_release);
+}
+
+NSUInteger MKAudioRingBufferReadable(MKAudioRingBuffer *rb) {
+    uint32_t w = atomic_load_explicit(&rb->writePos, memory_order_acquire);
+    uint32_t r = atomic_load_explicit(&rb->readPos, memory_order_relaxed);
+    return (NSUInteger)(w - r);
+}
+
+NSUInteger MKAudioRingBufferWritable(MKAudioRingBuffer *rb) {
+    uint32_t w = atomic_load_explicit(&rb->writePos, memory_order_relaxed);
+    uint32_t r = atomic_load_explicit(&rb->readPos, memory_order_acquire);
+    return (NSUInteger)(rb->capacity - (w - r));
+}
+
+// Producer side. Returns the number of samples actually written.
+NSUInteger MKAudioRingBufferWrite(MKAudioRingBuffer *rb, const float *src, NSUInteger nsamp) {
+    uint32_t w = atomic_load_explicit(&rb->writePos, memory_order_relaxed);
+    uint32_t r = atomic_load_explicit(&rb->readPos, memory_order_acquire);
+    NSUInteger space = rb->capacity - (w - r);
+    if (nsamp > space)
+        nsamp = space;
+
+    NSUInteger idx = w & rb->mask;
+    NSUInteger first = MIN(nsamp, rb->capacity - idx);
+    memcpy(rb->buf + idx, src, first * sizeof(float));
+    if (nsamp > first)
+        memcpy(rb->buf, src + first, (nsamp - first) * sizeof(float));
+
+    atomic_store_explicit(&rb->writePos, w + (uint32_t)nsamp, memory_order_release);
+    return nsamp;
+}
+
+// Consumer side. Returns the number of samples actually read.
+NSUInteger MKAudioRingBufferRead(MKAudioRingBuffer *rb, float *dst, NSUInteger nsamp) {
+    uint32_t r = atomic_load_explicit(&rb->readPos, memory_order_relaxed);
+    uint32_t w = atomic_load_explicit(&rb->writePos, memory_order_acquire);
+    NSUInteger avail = w - r;
+    if (nsamp > avail)
+        nsamp = avail;
+
+    NSUInteger idx = r & rb->mask;
+    NSUInteger first = MIN(nsamp, rb->capacity - idx);
+    memcpy(dst, rb->buf + idx, first * sizeof(float));
+    if (nsamp > first)
+        memcpy(dst + first, rb->buf, (nsamp - first) * sizeof(float));
+
+    atomic_store_explicit(&rb->readPos, r + (uint32_t)nsamp, memory_order_release);
+    return nsamp;
+}
+
+// Consumer side. Fills in a view of up to nsamp readable samples without
+// copying them. The samples stay valid until they are released by a call to
+// MKAudioRingBufferConsume. Returns the number of samples in the view.
+NSUInteger MKAudioRingBufferPeek(MKAudioRingBuffer *rb, NSUInteger nsamp, MKAudioRingBufferView *view) {
+    uint32_t r = atomic_load_explicit(&rb->readPos, memory_order_relaxed);
+    uint32_t w = atomic_load_explicit(&rb->writePos, memory_order_acquire);
+    NSUInteger avail = w - r;
+    if (nsamp > avail)
+        nsamp = avail;
+
+    NSUInteger idx = r & rb->mask;
+    NSUInteger first = MIN(nsamp, rb->capacity - idx);
+    view->data[0] = rb->buf + idx;
+    view->length[0] = first;
+    view->data[1] = rb->buf;
+    view->length[1] = nsamp - first;
+    view->total = nsamp;
+    return nsamp;
+}
+
+// Consumer side. Releases nsamp samples previously returned by
+// MKAudioRingBufferPeek back to the producer.
+void MKAudioRingBufferConsume(MKAudioRingBuffer *rb, NSUInteger nsamp) {
+    uint32_t r = atomic_load_explicit(&rb->readPos, memory_order_relaxed);
+    atomic_store_explicit(&rb->readPos, r + (uint32_t)nsamp, memory_order_release);
+}
@@ -0,0 +1,57 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <stdatomic.h>
+
+// MKAudioSourceTable maps user sessions to audio sources.
+//
+// Readers never lock. They enter a read section, look sources up in (or
+// iterate over) the current snapshot, and leave the read section again.
+// Every source found in a snapshot stays valid until the read section ends.
+//
+// Writers must be serialized by the caller. Each insertion or removal builds
+// a new snapshot: an open-addressed, session-keyed slot array, plus a dense
+// array of all sources for iteration. Old snapshots, and the sources removed
+// with them, are reclaimed once all readers that could still see them have
+// left their read sections. Inserts and removals only happen when a user
+// starts or stops talking, so copying the table is cheap compared to
+// locking on every voice packet.
+typedef struct _MKAudioSourceSlot {
+    NSUInteger                      session;
+    id                              source;
+} MKAudioSourceSlot;
+
+typedef struct _MKAudioSourceSnapshot {
+    struct _MKAudioSourceSnapshot  *nextRetired;
+    id                              removed;
+    NSUInteger                      mask;
+    NSUInteger                      count;
+    id                             *sources;
+    MKAudioSourceSlot              *slots;
+} MKAudioSourceSnapshot;
+
+// Called for each source once no reader can see it anymore. The handler
+// takes over the table's reference to the source.
+typedef void (*MKAudioSourceReclaimFunc)(void *ctx, id source);
+
+typedef struct _MKAudioSourceTable {
+    _Atomic(MKAudioSourceSnapshot *) current;
+    _Atomic NSUInteger              epoch;
+    _Atomic NSUInteger              readers[2];
+    MKAudioSourceSnapshot          *retired[2];
+    MKAudioSourceReclaimFunc        reclaim;
+    void                           *reclaimCtx;
+} MKAudioSourceTable;
+
+BOOL MKAudioSourceTableInit(MKAudioSourceTable *t, MKAudioSourceReclaimFunc reclaim, void *ctx);
+void MKAudioSourceTableDestroy(MKAudioSourceTable *t);
+
+// Reader side.
+MKAudioSourceSnapshot *MKAudioSourceTableReadBegin(MKAudioSourceTable *t, NSUInteger *token);
+void MKAudioSourceTableReadEnd(MKAudioSourceTable *t, NSUInteger token);
+id MKAudioSourceSnapshotLookup(const MKAudioSourceSnapshot *snap, NSUInteger session);
+
+// Writer side.
+BOOL MKAudioSourceTableInsert(MKAudioSourceTable *t, NSUInteger session, id source);
+BOOL MKAudioSourceTableRemove(MKAudioSourceTable *t, NSUInteger session, id source);
@@ -0,0 +1,184 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#import "MKAudioSourceTable.h"
+
+#define MK_AUDIO_SOURCE_TABLE_MIN_SLOTS  16
+
+static NSUInteger MKAudioSourceHash(NSUInteger session, NSUInteger mask) {
+    uint64_t h = (uint64_t)session * 0x9e3779b97f4a7c15ULL;
+    return (NSUInteger)(h >> 32) & mask;
+}
+
+// The snapshot, its dense array and its slots share a single allocation.
+static MKAudioSourceSnapshot *MKAudioSourceSnapshotCreate(NSUInteger count) {
+    NSUInteger nslots = MK_AUDIO_SOURCE_TABLE_MIN_SLOTS;
+    while (nslots < 2 * count)
+        nslots <<= 1;
+
+    size_t size = sizeof(MKAudioSourceSnapshot) + count * sizeof(id) + nslots * sizeof(MKAudioSourceSlot);
+    MKAudioSourceSnapshot *snap = calloc(1, size);
+    if (snap == NULL)
+        return NULL;
+    snap->mask = nslots - 1;
+    snap->count = 0;
+    snap->slots = (MKAudioSourceSlot *)(snap + 1);
+    snap->sources = (id *)(snap->slots + nslots);
+    return snap;
+}
+
+static void MKAudioSourceSnapshotAdd(MKAudioSourceSnapshot *snap, NSUInteger session, id source) {
+    NSUInteger i = MKAudioSourceHash(session, snap->mask);
+    while (snap->slots[i].source != nil)
+        i = (i + 1) & snap->mask;
+    snap->slots[i].session = session;
+    snap->slots[i].source = source;
+    snap->sources[snap->count++] = source;
+}
+
+id MKAudioSourceSnapshotLookup(const MKAudioSourceSnapshot *snap, NSUInteger session) {
+    NSUInteger i = MKAudioSourceHash(session, snap->mask);
+    for (;;) {
+        const MKAudioSourceSlot *slot = &snap->slots[i];
+        if (slot->source == nil)
+            return nil;
+        if (slot->session == session)
+            return slot->source;
+        i = (i + 1) & snap->mask;
+    }
+}
+
+// Frees every snapshot on the list, and hands the sources that were removed
+// along with them to the reclaim handler.
+static void MKAudioSourceTableFreeRetired(MKAudioSourceTable *t, MKAudioSourceSnapshot *snap) {
+    while (snap != NULL) {
+        MKAudioSourceSnapshot *next = snap->nextRetired;
+        if (snap->removed != nil) {
+            if (t->reclaim)
+                t->reclaim(t->reclaimCtx, snap->removed);
+            else
+                [snap->removed release];
+        }
+        free(snap);
+        snap = next;
+    }
+}
+
+// Readers register with the parity of the epoch they start in. The epoch may
+// only advance once all readers of the previous epoch have left, so anything
+// retired in epoch e is unreachable once the epoch has advanced twice.
+static void MKAudioSourceTableTryReclaim(MKAudioSourceTable *t) {
+    int n;
+    for (n = 0; n < 2; n++) {
+        NSUInteger e = atomic_load(&t->epoch);
+        NSUInteger next = (e + 1) & 1;
+        if (atomic_load(&t->readers[next]) != 0)
+            return;
+        MKAudioSourceSnapshot *old = t->retired[next];
+        t->retired[next] = NULL;
+        atomic_store(&t->epoch, e + 1);
+        MKAudioSourceTableFreeRetired(t, old);
+    }
+}
+
+static void MKAudioSourceTablePublish(MKAudioSourceTable *t, MKAudioSourceSnapshot *snap, id removed) {
+    MKAudioSourceSnapshot *old = atomic_exchange(&t->current, snap);
+    NSUInteger e = atomic_load(&t->epoch);
+    old->removed = removed;
+    old->nextRetired = t->retired[e & 1];
+    t->retired[e & 1] = old;
+    MKAudioSourceTableTryReclaim(t);
+}
+
+BOOL MKAudioSourceTableInit(MKAudioSourceTable *t, MKAudioSourceReclaimFunc reclaim, void *ctx) {
+    MKAudioSourceSnapshot *snap = MKAudioSourceSnapshotCreate(0);
+    if (snap == NULL)
+        return NO;
+    atomic_init(&t->current, snap);
+    atomic_init(&t->epoch, 0);
+    atomic_init(&t->readers[0], 0);
+    atomic_init(&t->readers[1], 0);
+    t->retired[0] = NULL;
+    t->retired[1] = NULL;
+    t->reclaim = reclaim;
+    t->reclaimCtx = ctx;
+    return YES;
+}
+
+// Must only be called once there are no more readers.
+void MKAudioSourceTableDestroy(MKAudioSourceTable *t) {
+    NSUInteger i;
+
+    t->reclaim = NULL;
+    MKAudioSourceTableFreeRetired(t, t->retired[0]);
+    MKAudioSourceTableFreeRetired(t, t->retired[1]);
+    t->retired[0] = NULL;
+    t->retired[1] = NULL;
+
+    MKAudioSourceSnapshot *snap = atomic_load(&t->current);
+    if (snap != NULL) {
+        for (i = 0; i < snap->count; i++)
+            [snap->sources[i] release];
+        free(snap);
+    }
+    atomic_store(&t->current, NULL);
+}
+
+MKAudioSourceSnapshot *MKAudioSourceTableReadBegin(MKAudioSourceTable *t, NSUInteger *token) {
+    for (;;) {
+        NSUInteger e = atomic_load(&t->epoch);
+        atomic_fetch_add(&t->readers[e & 1], 1);
+        if (atomic_load(&t->epoch) == e) {
+            *token = e & 1;
+            return atomic_load(&t->current);
+        }
+        atomic_fetch_sub(&t->readers[e & 1], 1);
+    }
+}
+
+void MKAudioSourceTableReadEnd(MKAudioSourceTable *t, NSUInteger token) {
+    atomic_fetch_sub(&t->readers[token], 1);
+}
+
+// Adds source for session, replacing any source the session already had.
+// The table retains the source.
+BOOL MKAudioSourceTableInsert(MKAudioSourceTable *t, NSUInteger session, id source) {
+    MKAudioSourceSnapshot *cur = atomic_load(&t->current);
+    id replaced = MKAudioSourceSnapshotLookup(cur, session);
+    NSUInteger i;
+
+    MKAudioSourceSnapshot *snap = MKAudioSourceSnapshotCreate(cur->count + (replaced == nil ? 1 : 0));
+    if (snap == NULL)
+        return NO;
+    for (i = 0; i <= cur->mask; i++) {
+        MKAudioSourceSlot *slot = &cur->slots[i];
+        if (slot->source != nil && slot->session != session)
+            MKAudioSourceSnapshotAdd(snap, slot->session, slot->source);
+    }
+    MKAudioSourceSnapshotAdd(snap, session, [source retain]);
+
+    MKAudioSourceTablePublish(t, snap, replaced);
+    return YES;
+}
+
+// Removes source for session, but only if it is still the session's source.
+BOOL MKAudioSourceTableRemove(MKAudioSourceTable *t, NSUInteger session, id source) {
+    MKAudioSourceSnapshot *cur = atomic_load(&t->current);
+    NSUInteger i;
+
+    if (MKAudioSourceSnapshotLookup(cur, session) != source || source == nil)
+        return NO;
+
+    MKAudioSourceSnapshot *snap = MKAudioSourceSnapshotCreate(cur->count - 1);
+    if (snap == NULL)
+        return NO;
+    for (i = 0; i <= cur->mask; i++) {
+        MKAudioSourceSlot *slot = &cur->slots[i];
+        if (slot->source != nil && slot->session != session)
+            MKAudioSourceSnapshotAdd(snap, slot->session, slot->source);
+    }
+
+    MKAudioSourceTablePublish(t, snap, source);
+    return YES;
+}
@@ -0,0 +1,33 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#import <MumbleKit/MKUser.h>
+
+// Talk state changes are posted from the audio threads as small events,
+// without allocating or taking locks, and are drained in batches on the
+// main thread.
+//
+// Every thread that posts events gets a single-producer, single-consumer
+// ring of its own the first time it posts. The ring goes back to the pool
+// when the thread exits. Events that don't fit are dropped and counted in
+// MKAudioTalkStateDroppedCount, so the main thread knows to resync.
+//
+// Timestamps are in samples at SAMPLE_RATE on the monotonic clock (see
+// MKAudioTalkStateSampleTime), and tell when the change becomes audible
+// (or, for our own user, when it was captured).
+
+// How many events the main thread takes out of the rings at a time.
+#define MK_AUDIO_TALK_STATE_BATCH  128
+
+typedef struct _MKAudioTalkStateEvent {
+    NSUInteger    session;
+    MKTalkState   state;
+    uint64_t      sampleTime;
+} MKAudioTalkStateEvent;
+
+uint64_t MKAudioTalkStateSampleTime(uint64_t ns);
+
+BOOL MKAudioTalkStatePost(NSUInteger session, MKTalkState state, uint64_t sampleTime);
+NSUInteger MKAudioTalkStateDrain(MKAudioTalkStateEvent *events, NSUInteger max);
+NSUInteger MKAudioTalkStateDroppedCount(void);
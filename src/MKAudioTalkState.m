@@ -0,0 +1,107 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#import <MumbleKit/MKAudio.h>
+#import "MKAudioTalkState.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Producers are the audio input thread and the decode threads, so a handful
+// of rings is plenty.
+#define MK_TALK_STATE_MAX_PRODUCERS  16
+#define MK_TALK_STATE_RING_SIZE      256
+
+typedef struct _MKAudioTalkStateRing {
+    _Atomic BOOL             inUse;
+    _Atomic uint32_t         head;
+    _Atomic uint32_t         tail;
+    MKAudioTalkStateEvent    events[MK_TALK_STATE_RING_SIZE];
+} MKAudioTalkStateRing;
+
+static MKAudioTalkStateRing MKAudioTalkStateRings[MK_TALK_STATE_MAX_PRODUCERS];
+static _Atomic NSUInteger MKAudioTalkStateDropped = 0;
+
+static _Thread_local MKAudioTalkStateRing *MKAudioTalkStateThreadRing = NULL;
+static pthread_key_t MKAudioTalkStateKey;
+static pthread_once_t MKAudioTalkStateOnce = PTHREAD_ONCE_INIT;
+
+// Hands the ring back once its thread exits. Events that are still in it
+// are drained as usual.
+static void MKAudioTalkStateThreadExit(void *ptr) {
+    MKAudioTalkStateRing *ring = (MKAudioTalkStateRing *) ptr;
+    atomic_store_explicit(&ring->inUse, NO, memory_order_release);
+}
+
+static void MKAudioTalkStateInit(void) {
+    pthread_key_create(&MKAudioTalkStateKey, MKAudioTalkStateThreadExit);
+}
+
+static MKAudioTalkStateRing *MKAudioTalkStateClaimRing(void) {
+    NSUInteger i;
+
+    pthread_once(&MKAudioTalkStateOnce, MKAudioTalkStateInit);
+    for (i = 0; i < MK_TALK_STATE_MAX_PRODUCERS; i++) {
+        MKAudioTalkStateRing *ring = &MKAudioTalkStateRings[i];
+        BOOL expected = NO;
+        if (atomic_compare_exchange_strong(&ring->inUse, &expected, YES)) {
+            pthread_setspecific(MKAudioTalkStateKey, ring);
+            return ring;
+        }
+    }
+    return NULL;
+}
+
+uint64_t MKAudioTalkStateSampleTime(uint64_t ns) {
+    return (ns / NSEC_PER_SEC) * SAMPLE_RATE + ((ns % NSEC_PER_SEC) * SAMPLE_RATE) / NSEC_PER_SEC;
+}
+
+// Called on an audio thread.
+BOOL MKAudioTalkStatePost(NSUInteger session, MKTalkState state, uint64_t sampleTime) {
+    MKAudioTalkStateRing *ring = MKAudioTalkStateThreadRing;
+    if (ring == NULL) {
+        ring = MKAudioTalkStateClaimRing();
+        MKAudioTalkStateThreadRing = ring;
+        if (ring == NULL) {
+            atomic_fetch_add_explicit(&MKAudioTalkStateDropped, 1, memory_order_relaxed);
+            return NO;
+        }
+    }
+
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == MK_TALK_STATE_RING_SIZE) {
+        atomic_fetch_add_explicit(&MKAudioTalkStateDropped, 1, memory_order_relaxed);
+        return NO;
+    }
+
+    MKAudioTalkStateEvent *ev = &ring->events[tail % MK_TALK_STATE_RING_SIZE];
+    ev->session = session;
+    ev->state = state;
+    ev->sampleTime = sampleTime;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return YES;
+}
+
+// Called on the main thread. Events from a single producer come out in the
+// order they were posted; events from different producers are not ordered.
+NSUInteger MKAudioTalkStateDrain(MKAudioTalkStateEvent *events, NSUInteger max) {
+    NSUInteger i, n = 0;
+
+    for (i = 0; i < MK_TALK_STATE_MAX_PRODUCERS && n < max; i++) {
+        MKAudioTalkStateRing *ring = &MKAudioTalkStateRings[i];
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        while (head != tail && n < max) {
+            events[n++] = ring->events[head % MK_TALK_STATE_RING_SIZE];
+            head++;
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+    }
+    return n;
+}
+
+NSUInteger MKAudioTalkStateDroppedCount(void) {
+    return atomic_load_explicit(&MKAudioTalkStateDropped, memory_order_relaxed);
+}
@@ -10,8 +10,11 @@
 #import "MKAudioOutput.h"
 #import "MKCryptState.h"
 #import "MKPacketDataStream.h"
+#import "MKVoicePacket.h"
+#import "MKAudioLatency.h"
 
 #include <dispatch/dispatch.h>
+#include <stdatomic.h>
 
 #include  <Security/SecureTransport.h>
 
@@ -26,6 +29,7 @@
 #include <sys/time.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <errno.h>
 
 #import "Mumble.pb.h"
 
@@ -58,6 +62,14 @@
     id             _delegate;
     int            _socket;
     CFSocketRef    _udpSock;
+    MKPacketDataStream *_udpStream;
+
+    // Outgoing voice. The source lives as long as we do, and the run loop
+    // is set once the connection thread runs, so the audio input thread
+    // can poke them without locking.
+    MKVoicePacketQueue  _voiceQueue;
+    CFRunLoopSourceRef  _voiceSource;
+    _Atomic(CFRunLoopRef) _voiceRunLoop;
     NSArray        *_certificateChain;
     NSError        *_connError;
     BOOL           _rejected;
@@ -95,10 +107,13 @@
 // UDP
 - (void) _setupUdpSock;
 - (void) _teardownUdpSock;
-- (void) _udpDataReady:(NSData *)data;
+- (void) _udpDataReady:(const unsigned char *)crypted length:(NSUInteger)len;
 - (void) _udpMessageReceived:(NSData *)data;
+- (void) _udpPacketReceived:(MKVoicePacket *)packet;
 - (void) _sendUDPMessage:(NSData *)data;
 - (void) _sendVoiceDataOnConnectionThread:(NSData *)data;
+- (void) _sendVoicePacketOnConnectionThread:(MKVoicePacket *)packet;
+- (void) _drainVoiceQueue;
 
 // Error handling
 - (void) _handleError:(NSError *)streamError;
@@ -110,27 +125,39 @@
 @end
 
 // CFSocket UDP callback.  This is called by MKConnection's UDP CFSocket whenever
-// there is new data available (it only uses the kCFSocketDataCallback callback mode).
+// there is a datagram waiting to be read (it only uses the kCFSocketReadCallBack
+// callback mode).
+//
+// We read the datagram ourselves instead of using kCFSocketDataCallBack, which
+// would allocate a new CFData for every single packet we receive.
 static void MKConnectionUDPCallback(CFSocketRef sock, CFSocketCallBackType type,
                                     CFDataRef addr, const void *data, void *udata) {
     MKConnection *conn = (MKConnection *)udata;
+    unsigned char buf[MK_VOICE_PACKET_MAX_SIZE+4];
 
     if (conn == NULL) {
         NSLog(@"MKConnection: MKConnectionUDPCallback called with udata == NULL");
         return;
     }
 
-    if (type != kCFSocketDataCallBack) {
+    if (type != kCFSocketReadCallBack) {
         NSLog(@"MKConnection: MKConnectionUDPCallback called with type=%lu", type);
         return;
     }
 
-    if (data == NULL) {
-        NSLog(@"MKConnection: MKConnectionUDPCallback called with data == NULL");
+    ssize_t len = recv(CFSocketGetNative(sock), buf, sizeof(buf), 0);
+    if (len <= 0) {
         return;
     }
 
-    [conn _udpDataReady:(NSData *)data];
+    [conn _udpDataReady:buf length:(NSUInteger)len];
+}
+
+// Run loop source callback for outgoing voice. Called on the MKConnection
+// thread whenever the audio input thread has queued up new voice packets.
+static void MKConnectionVoiceSourcePerform(void *info) {
+    MKConnection *conn = (MKConnection *)info;
+    [conn _drainVoiceQueue];
 }
 
 @implementation MKConnection
@@ -142,12 +169,30 @@ static void MKConnectionUDPCallback(CFSocketRef sock, CFSocketCallBackType type,
 
     _ignoreSSLVerification = NO;
 
+    // Outgoing voice packets are handed to the connection thread through
+    // _voiceQueue, which is poked through this run loop source when there
+    // is something to send.
+    MKVoicePacketQueueInit(&_voiceQueue);
+    CFRunLoopSourceContext voicectx;
+    memset(&voicectx, 0, sizeof(CFRunLoopSourceContext));
+    voicectx.info = self;
+    voicectx.perform = MKConnectionVoiceSourcePerform;
+    _voiceSource = CFRunLoopSourceCreate(NULL, 0, &voicectx);
+    atomic_init(&_voiceRunLoop, NULL);
+
     return self;
 }
 
 - (void) dealloc {
     [self disconnect];
 
+    MKVoicePacketQueueDrain(&_voiceQueue);
+    CFRunLoopSourceInvalidate(_voiceSource);
+    CFRelease(_voiceSource);
+    CFRunLoopRef voiceRunLoop = atomic_load(&_voiceRunLoop);
+    if (voiceRunLoop != NULL)
+        CFRelease(voiceRunLoop);
+
     [_peerCertificates release];
     [_certificateChain release];
 
@@ -157,6 +202,12 @@ static void MKConnectionUDPCallback(CFSocketRef sock, CFSocketCallBackType type,
 - (void) main {
     NSRunLoop *runLoop = [NSRunLoop currentRunLoop];
 
+    // The run loop is kept until we are deallocated, so that waking it up
+    // stays safe after this thread is gone.
+    CFRunLoopRef voiceRunLoop = CFRunLoopGetCurrent();
+    CFRunLoopAddSource(voiceRunLoop, _voiceSource, kCFRunLoopDefaultMode);
+    atomic_store_explicit(&_voiceRunLoop, (CFRunLoopRef)CFRetain(voiceRunLoop), memory_order_release);
+
     do {
         if (_reconnect) {
             _reconnect = NO;
@@ -173,6 +224,7 @@ static void MKConnectionUDPCallback(CFSocketRef sock, CFSocketCallBackType type,
 
         if (_inputStream == nil || _outputStream == nil) {
             NSLog(@"MKConnection: Unable to create stream pair.");
+            CFRunLoopRemoveSource(voiceRunLoop, _voiceSource, kCFRunLoopDefaultMode);
             return;
         }
 
@@ -237,12 +289,16 @@ static void MKConnectionUDPCallback(CFSocketRef sock, CFSocketCallBackType type,
         _connectionEstablished = NO;
         _rejected = NO;
 
-        // Remove the connection as the main connection for audio.
-        [[MKAudio sharedAudio] setMainConnectionForAudio:nil];
+        // Stop sharing the audio subsystem.
+        [[MKAudio sharedAudio] removeConnectionForAudio:self];
 
     } while (_reconnect);
     
     [_crypt release];
+    [_udpStream release];
+    _udpStream = nil;
+
+    CFRunLoopRemoveSource(voiceRunLoop, _voiceSource, kCFRunLoopDefaultMode);
 
     [NSThread exit];
 }
@@ -438,8 +494,9 @@ static void MKConnectionUDPCallback(CFSocketRef sock, CFSocketCallBackType type,
                 // Make TLS trust status available to clients.
                 [self _updateTLSTrustedStatus];
                 
-                // Add the connection as the main connection.
-                [[MKAudio sharedAudio] setMainConnectionForAudio:self];
+                // Share the audio subsystem. The first connection to be
+                // established becomes the main connection.
+                [[MKAudio sharedAudio] addConnectionForAudio:self];
                 
                 // Schedule our ping timer.
                 _pingTimer = [NSTimer timerWithTimeInterval:MKConnectionPingInterval target:self selector:@selector(_pingTimerFired:) userInfo:nil repeats:YES];
@@ -537,7 +594,7 @@ static void MKConnectionUDPCallback(CFSocketRef sock, CFSocketCallBackType type,
     udpctx.info = self;
 
     _udpSock = CFSocketCreate(NULL, sa.ss_family, SOCK_DGRAM, IPPROTO_UDP,
-                                  kCFSocketDataCallBack, MKConnectionUDPCallback,
+                                  kCFSocketReadCallBack, MKConnectionUDPCallback,
                                   &udpctx);
     if (! _udpSock) {
         NSLog(@"MKConnection: Failed to create UDP socket.");
@@ -730,7 +787,8 @@ out:
 // out whether it should be sent via UDP or TCP depending on the current
 // connection conditions.
 //
-// This is a wrapper that ensures the actual call will be made on the connection thread.
+// This may be called from any thread. It doesn't use the voice queue, which
+// belongs to the audio input thread.
 - (void) sendVoiceData:(NSData *)data {
     if ([NSThread currentThread] == self) {
         [self _sendVoiceDataOnConnectionThread:data];
@@ -739,15 +797,77 @@ out:
     }
 }
 
-// Send a voice packet. Must only be called on the MKConnection thread.
-// Internal MKConnection method. Use sendVoiceData to send actual voice data.
 - (void) _sendVoiceDataOnConnectionThread:(NSData *)data {
+    MKVoicePacket *packet = MKVoicePacketCreateWithBytes([data bytes], [data length]);
+    if (packet == NULL)
+        return;
+    [self _sendVoicePacketOnConnectionThread:packet];
+    MKVoicePacketRelease(packet);
+}
+
+// Send a voice packet to the server, taking over the caller's reference
+// to the packet.
+//
+// The packet is handed to the connection thread through a single-producer
+// queue, so this must only ever be called from one thread at a time (the
+// audio input thread). The run loop source is then signalled, without
+// locking, to wake up the connection thread.
+- (void) sendVoicePacket:(MKVoicePacket *)packet {
+    if ([NSThread currentThread] == self) {
+        [self _sendVoicePacketOnConnectionThread:packet];
+        MKVoicePacketRelease(packet);
+        return;
+    }
+
+    if (!MKVoicePacketQueuePush(&_voiceQueue, packet)) {
+        MKVoicePacketRelease(packet);
+        return;
+    }
+
+    // Signalling a source that is not (or no longer) in a run loop is
+    // harmless. The packet then waits in the queue until we go away.
+    CFRunLoopSourceSignal(_voiceSource);
+    CFRunLoopRef voiceRunLoop = atomic_load_explicit(&_voiceRunLoop, memory_order_acquire);
+    if (voiceRunLoop != NULL)
+        CFRunLoopWakeUp(voiceRunLoop);
+}
+
+- (void) _drainVoiceQueue {
+    MKVoicePacket *packet;
+    while ((packet = MKVoicePacketQueuePop(&_voiceQueue)) != NULL) {
+        [self _sendVoicePacketOnConnectionThread:packet];
+        MKVoicePacketRelease(packet);
+    }
+}
+
+// Send a voice packet. Must only be called on the MKConnection thread.
+// Internal MKConnection method. Use sendVoicePacket: to send actual voice data.
+//
+// Over UDP, the packet is encrypted into a stack buffer and written to the
+// socket directly, without any intermediate allocations.
+- (void) _sendVoicePacketOnConnectionThread:(MKVoicePacket *)packet {
     if (!_readyVoice || !_connectionEstablished)
         return;
     if (!_forceTCP && _udpAvailable) {
-        [self _sendUDPMessage:data];
+        if (![_crypt valid] || _udpSock == NULL || !CFSocketIsValid(_udpSock)) {
+            NSLog(@"MKConnection: Invalid CryptState or CFSocket.");
+            return;
+        }
+        unsigned char crypted[MK_VOICE_PACKET_MAX_SIZE+4];
+        [_crypt encryptBytes:MKVoicePacketBytes(packet) length:packet->length intoBuffer:crypted];
+        if (send(CFSocketGetNative(_udpSock), crypted, packet->length+4, 0) < 0) {
+            NSLog(@"MKConnection: send() failed for voice packet (errno=%i)", errno);
+        }
     } else {
+        NSData *data = [[NSData alloc] initWithBytes:MKVoicePacketBytes(packet) length:packet->length];
         [self sendMessageWithType:UDPTunnelMessage data:data];
+        [data release];
+    }
+
+    if (packet->timestamp != 0) {
+        uint64_t now = MKAudioLatencyNow();
+        MKAudioLatencyRecord(MKAudioLatencyStageSend, now - packet->timestamp);
+        MKAudioLatencyNoteSent(packet->sequence, now);
     }
 }
 
@@ -763,18 +883,26 @@ out:
 // encrypted using whichever cipher was agreed upon during the handshake.
 // These tunelled UDP messages do not go through this method, but go directly
 // to the _udpMessageReceived: method instead.
-- (void) _udpDataReady:(NSData *)crypted {
+//
+// The datagram is decrypted straight into a pooled MKVoicePacket, which is
+// then passed along by reference.
+- (void) _udpDataReady:(const unsigned char *)crypted length:(NSUInteger)len {
     // For now, let's just do this to enable UDP. fixme(mkrautz): Better detection.
     if (! _udpAvailable) {
         _udpAvailable = true;
         NSLog(@"MKConnection: UDP is now available!");
     }
 
-    if ([crypted length] > 4) {
-        NSData *plain = [_crypt decryptData:crypted];
-        if (plain) {
-            [self _udpMessageReceived:plain];
+    if (len > 4 && len - 4 <= MK_VOICE_PACKET_MAX_SIZE) {
+        MKVoicePacket *packet = MKVoicePacketAlloc();
+        if (packet == NULL)
+            return;
+        packet->timestamp = MKAudioLatencyNow();
+        if ([_crypt decryptBytes:crypted length:len intoBuffer:packet->data]) {
+            packet->length = len - 4;
+            [self _udpPacketReceived:packet];
         }
+        MKVoicePacketRelease(packet);
     }
 }
 
@@ -954,6 +1082,7 @@ out:
     } else {
         _shouldUseOpus = NO;
     }
+    [[MKAudio sharedAudio] connectionDidChangeCodec:self];
 
     if (_shouldUseOpus == NO) {
         NSLog(@"MKConnection: Server asks for CELT, but we do not support it. Please upgrade your mumble server. TODO: fail gracefully here");
@@ -1031,13 +1160,37 @@ out:
     return NO;
 }
 
+// This is the entry point for UDP packets that are tunneled through the TCP stream.
+- (void) _udpMessageReceived:(NSData *)data {
+    MKVoicePacket *packet = MKVoicePacketCreateWithBytes([data bytes], [data length]);
+    if (packet == NULL) {
+        NSLog(@"MKConnection: Discarding oversized UDPTunnel packet.");
+        return;
+    }
+    packet->timestamp = MKAudioLatencyNow();
+    [self _udpPacketReceived:packet];
+    MKVoicePacketRelease(packet);
+}
+
 // This is the entry point for UDP packets after they've been decrypted,
 // and also for UDP packets that are tunneled through the TCP stream.
-- (void) _udpMessageReceived:(NSData *)data {
-    unsigned char *buf = (unsigned char *)[data bytes];
+//
+// Voice packets are not copied. Instead, the flags byte is moved up to sit
+// right in front of the voice payload (there is always room, since it is
+// preceded by the session and sequence varints), and the packet's view is
+// narrowed to cover just that before it is handed to MKAudio.
+- (void) _udpPacketReceived:(MKVoicePacket *)packet {
+    if (packet->length < 1)
+        return;
+
+    unsigned char *buf = packet->data;
     MKUDPMessageType messageType = ((buf[0] >> 5) & 0x7);
     unsigned int messageFlags = buf[0] & 0x1f;
-    MKPacketDataStream *pds = [[MKPacketDataStream alloc] initWithBuffer:buf+1 length:[data length]-1]; // fixme(-1)?
+    if (_udpStream == nil) {
+        _udpStream = [[MKPacketDataStream alloc] initWithBuffer:NULL length:0];
+    }
+    MKPacketDataStream *pds = _udpStream;
+    [pds resetWithBuffer:buf+1 length:packet->length-1];
 
     switch (messageType) {
         case UDPVoiceCELTAlphaMessage:
@@ -1050,13 +1203,14 @@ out:
             }
             NSUInteger session = [pds getUnsignedInt];
             NSUInteger seq = [pds getUnsignedInt];
-            NSMutableData *voicePacketData = [[NSMutableData alloc] initWithCapacity:[pds left]+1];
-            [voicePacketData setLength:[pds left]+1];
-            unsigned char *bytes = [voicePacketData mutableBytes];
-            bytes[0] = (unsigned char)messageFlags;
-            memcpy(bytes+1, [pds dataPtr], [pds left]);
-            [[MKAudio sharedAudio] addFrameToBufferWithSession:session data:voicePacketData sequence:seq type:messageType];
-            [voicePacketData release];
+            if (![pds valid])
+                break;
+            NSUInteger payload = 1 + [pds size];
+            buf[payload-1] = (unsigned char)messageFlags;
+            packet->offset = payload-1;
+            packet->length = [pds left]+1;
+            packet->sequence = seq;
+            [[MKAudio sharedAudio] addVoicePacket:packet forSession:session sequence:seq type:messageType fromConnection:self];
             break;
         }
 
@@ -1071,8 +1225,6 @@ out:
             NSLog(@"MKConnection: Unknown UDPTunnel packet (%i) received. Discarding...", (int)messageType);
             break;
     }
-
-    [pds release];
 }
 
 - (void) _messageRecieved:(NSData *)data {
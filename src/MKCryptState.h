@@ -14,6 +14,8 @@ struct MKCryptStatePrivate;
 - (void) setKey:(NSData *)key eiv:(NSData *)enc div:(NSData *)dec;
 - (void) setDecryptIV:(NSData *)dec;
 - (NSData *) encryptData:(NSData *)data;
+- (void) encryptBytes:(const unsigned char *)src length:(NSUInteger)len intoBuffer:(unsigned char *)dst;
 - (NSData *) decryptData:(NSData *)data;
+- (BOOL) decryptBytes:(const unsigned char *)src length:(NSUInteger)len intoBuffer:(unsigned char *)dst;
 
 @end
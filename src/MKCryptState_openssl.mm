@@ -70,6 +70,12 @@ using namespace MumbleClient;
 	return [crypted autorelease];
 }
 
+// Encrypt len bytes at src into dst, which must have room for len+4 bytes.
+// Unlike encryptData:, this does not allocate.
+- (void) encryptBytes:(const unsigned char *)src length:(NSUInteger)len intoBuffer:(unsigned char *)dst {
+	_cs->encrypt(src, dst, (unsigned int)len);
+}
+
 - (NSData *) decryptData:(NSData *)data {
 	if (!([data length] > 4))
 		return nil;
@@ -87,4 +93,12 @@ using namespace MumbleClient;
 	}
 }
 
+// Decrypt len bytes at src into dst, which must have room for len-4 bytes.
+// Unlike decryptData:, this does not allocate.
+- (BOOL) decryptBytes:(const unsigned char *)src length:(NSUInteger)len intoBuffer:(unsigned char *)dst {
+	if (!(len > 4) || len > UINT_MAX)
+		return NO;
+	return (BOOL)_cs->decrypt(src, dst, (unsigned int)len);
+}
+
 @end
@@ -0,0 +1,25 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#import <MumbleKit/MKAudio.h>
+#import "MKAudioDevice.h"
+
+// MKHeadlessAudioDevice is an audio device without any audio hardware.
+//
+// Captured audio comes from PCM written to the device (or read from a file
+// descriptor), and mixed audio is handed to a sink block. Time is either
+// advanced by a thread of the device's own, in real time or as fast as
+// possible, or by the caller through runFrames:.
+@interface MKHeadlessAudioDevice : MKAudioDevice
+
+- (id) initWithSettings:(MKAudioSettings *)settings;
+- (void) dealloc;
+
+- (void) setOutputSink:(MKAudioPCMSink)sink;
+- (NSUInteger) writeInput:(const short *)pcm count:(NSUInteger)nsamp;
+- (void) setInputFileDescriptor:(int)fd;
+
+- (NSUInteger) runFrames:(NSUInteger)nframes;
+
+@end
@@ -0,0 +1,285 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#import "MKHeadlessAudioDevice.h"
+#import "MKAudioRingBuffer.h"
+
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+// The device runs in 10ms cycles, just like the codecs.
+#define MK_HEADLESS_FRAME_SIZE       (SAMPLE_RATE / 100)
+
+// About a second of input can be queued up ahead of time.
+#define MK_HEADLESS_INPUT_CAPACITY   SAMPLE_RATE
+
+@interface MKHeadlessAudioDevice () {
+    MKAudioSettings              _settings;
+    int                          _outputChannels;
+
+    MKAudioDeviceOutputFunc      _outputFunc;
+    MKAudioDeviceInputFunc       _inputFunc;
+    MKAudioPCMSink               _outputSink;
+    NSLock                      *_lock;
+
+    MKAudioRingBuffer            _input;
+    int                          _inputFd;
+    // A read can end in the middle of a sample. Its first byte is kept
+    // for the next read.
+    unsigned char                _inputCarry;
+    BOOL                         _hasInputCarry;
+
+    short                       *_inputBuffer;
+    short                       *_outputBuffer;
+
+    NSThread                    *_clockThread;
+    _Atomic BOOL                 _running;
+    dispatch_semaphore_t         _exitSema;
+}
+- (void) clockThreadMain;
+@end
+
+@implementation MKHeadlessAudioDevice
+
+- (id) initWithSettings:(MKAudioSettings *)settings {
+    if ((self = [super init])) {
+        memcpy(&_settings, settings, sizeof(MKAudioSettings));
+        _outputChannels = _settings.enablePositionalAudio ? 2 : 1;
+        _lock = [[NSLock alloc] init];
+        _inputFd = -1;
+        MKAudioRingBufferInit(&_input, MK_HEADLESS_INPUT_CAPACITY);
+        _inputBuffer = calloc(MK_HEADLESS_FRAME_SIZE, sizeof(short));
+        _outputBuffer = calloc(MK_HEADLESS_FRAME_SIZE * _outputChannels, sizeof(short));
+        atomic_init(&_running, NO);
+        _exitSema = dispatch_semaphore_create(0);
+    }
+    return self;
+}
+
+- (void) dealloc {
+    [self teardownDevice];
+
+    [_outputFunc release];
+    [_inputFunc release];
+    [_outputSink release];
+    [_lock release];
+
+    MKAudioRingBufferDestroy(&_input);
+    free(_inputBuffer);
+    free(_outputBuffer);
+    dispatch_release(_exitSema);
+
+    [super dealloc];
+}
+
+- (BOOL) setupDevice {
+    if (_settings.headlessClock == MKAudioHeadlessClockManual)
+        return YES;
+    if (atomic_exchange(&_running, YES))
+        return YES;
+
+    // The clock thread must not retain us, or teardownDevice in dealloc
+    // would never be reached.
+    __block MKHeadlessAudioDevice *device = self;
+    _clockThread = [[NSThread alloc] initWithBlock:^{
+        [device clockThreadMain];
+    }];
+    [_clockThread setName:@"MKHeadlessAudioDevice clock"];
+    [_clockThread start];
+    return YES;
+}
+
+- (BOOL) teardownDevice {
+    if (atomic_exchange(&_running, NO)) {
+        dispatch_semaphore_wait(_exitSema, DISPATCH_TIME_FOREVER);
+        [_clockThread release];
+        _clockThread = nil;
+    }
+    return YES;
+}
+
+- (void) setupOutput:(MKAudioDeviceOutputFunc)outf {
+    [_lock lock];
+    [_outputFunc release];
+    _outputFunc = [outf copy];
+    [_lock unlock];
+}
+
+- (void) setupInput:(MKAudioDeviceInputFunc)inf {
+    [_lock lock];
+    [_inputFunc release];
+    _inputFunc = [inf copy];
+    [_lock unlock];
+}
+
+- (void) setOutputSink:(MKAudioPCMSink)sink {
+    [_lock lock];
+    [_outputSink release];
+    _outputSink = [sink copy];
+    [_lock unlock];
+}
+
+// Queues mono 16-bit PCM at 48kHz for capture. Only one thread may write
+// input at a time. Returns the number of samples that fit.
+- (NSUInteger) writeInput:(const short *)pcm count:(NSUInteger)nsamp {
+    float chunk[256];
+    NSUInteger i, n, written = 0;
+
+    while (written < nsamp) {
+        n = MIN(nsamp - written, sizeof(chunk)/sizeof(chunk[0]));
+        for (i = 0; i < n; i++)
+            chunk[i] = (float) pcm[written + i];
+        NSUInteger w = MKAudioRingBufferWrite(&_input, chunk, n);
+        written += w;
+        if (w < n)
+            break;
+    }
+    return written;
+}
+
+// Reads captured audio (raw mono 16-bit PCM at 48kHz, host byte order) from
+// fd instead of from writeInput:count:. The descriptor is put into
+// non-blocking mode, so a pipe that runs dry just yields silence. The
+// caller keeps ownership of fd. Pass -1 to stop reading from it.
+- (void) setInputFileDescriptor:(int)fd {
+    if (fd >= 0) {
+        int flags = fcntl(fd, F_GETFL);
+        if (flags != -1)
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+    [_lock lock];
+    _inputFd = fd;
+    _hasInputCarry = NO;
+    [_lock unlock];
+}
+
+- (void) readInput {
+    NSUInteger i, got = 0;
+
+    if (_inputFd >= 0) {
+        size_t want = MK_HEADLESS_FRAME_SIZE * sizeof(short);
+        unsigned char *dst = (unsigned char *) _inputBuffer;
+        if (_hasInputCarry) {
+            dst[got++] = _inputCarry;
+            _hasInputCarry = NO;
+        }
+        while (got < want) {
+            ssize_t ret = read(_inputFd, dst + got, want - got);
+            if (ret > 0) {
+                got += (size_t) ret;
+            } else if (ret < 0 && errno == EINTR) {
+                continue;
+            } else {
+                break;
+            }
+        }
+        if (got % sizeof(short) != 0) {
+            _inputCarry = dst[got - 1];
+            _hasInputCarry = YES;
+        }
+        got /= sizeof(short);
+    } else {
+        float chunk[MK_HEADLESS_FRAME_SIZE];
+        got = MKAudioRingBufferRead(&_input, chunk, MK_HEADLESS_FRAME_SIZE);
+        for (i = 0; i < got; i++)
+            _inputBuffer[i] = (short) chunk[i];
+    }
+
+    for (i = got; i < MK_HEADLESS_FRAME_SIZE; i++)
+        _inputBuffer[i] = 0;
+}
+
+// Runs a single 10ms cycle: capture, then playback.
+- (void) runCycle {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+
+    [_lock lock];
+    [self readInput];
+    if (_inputFunc)
+        _inputFunc(_inputBuffer, MK_HEADLESS_FRAME_SIZE);
+
+    BOOL mixed = NO;
+    if (_outputFunc)
+        mixed = _outputFunc(_outputBuffer, MK_HEADLESS_FRAME_SIZE);
+    if (!mixed)
+        memset(_outputBuffer, 0, MK_HEADLESS_FRAME_SIZE * _outputChannels * sizeof(short));
+    if (_outputSink)
+        _outputSink(_outputBuffer, MK_HEADLESS_FRAME_SIZE, _outputChannels, SAMPLE_RATE);
+    [_lock unlock];
+
+    [pool release];
+}
+
+// Advances the device by at least nframes, on the calling thread, as fast
+// as possible. Returns the number of frames actually run.
+- (NSUInteger) runFrames:(NSUInteger)nframes {
+    NSUInteger done = 0;
+    while (done < nframes) {
+        [self runCycle];
+        done += MK_HEADLESS_FRAME_SIZE;
+    }
+    return done;
+}
+
+- (void) clockThreadMain {
+    const BOOL realtime = _settings.headlessClock == MKAudioHeadlessClockRealtime;
+    const long period = 1000000000L / (SAMPLE_RATE / MK_HEADLESS_FRAME_SIZE);
+    struct timespec next;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (atomic_load(&_running)) {
+        [self runCycle];
+
+        if (realtime) {
+            // Sleep until an absolute deadline, so that the clock doesn't
+            // drift by however long each cycle took.
+            next.tv_nsec += period;
+            if (next.tv_nsec >= 1000000000L) {
+                next.tv_nsec -= 1000000000L;
+                next.tv_sec++;
+            }
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long long delta = (long long)(next.tv_sec - now.tv_sec) * 1000000000LL + (next.tv_nsec - now.tv_nsec);
+            if (delta > 0) {
+                struct timespec ts = { (time_t)(delta / 1000000000LL), (long)(delta % 1000000000LL) };
+                while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+                    ;
+            } else if (delta < -100000000LL) {
+                // More than 100ms behind. Don't try to catch up in a burst.
+                next = now;
+            }
+        }
+    }
+    dispatch_semaphore_signal(_exitSema);
+}
+
+- (int) inputSampleRate {
+    return SAMPLE_RATE;
+}
+
+- (int) outputSampleRate {
+    return SAMPLE_RATE;
+}
+
+- (int) numberOfInputChannels {
+    return 1;
+}
+
+- (int) numberOfOutputChannels {
+    return _outputChannels;
+}
+
+- (double) inputLatency {
+    return (double) MK_HEADLESS_FRAME_SIZE / SAMPLE_RATE;
+}
+
+- (double) outputLatency {
+    return (double) MK_HEADLESS_FRAME_SIZE / SAMPLE_RATE;
+}
+
+@end
@@ -11,6 +11,15 @@
 #import <AudioUnit/AUComponent.h>
 #import <AudioToolbox/AudioToolbox.h>
 
+// The low latency profile asks for the smallest IO buffer the device
+// supports, but not less than this. Smaller buffers cost more in callback
+// overhead than they save.
+#define MK_MAC_AUDIO_MIN_BUFFER_FRAMES  32
+
+// Input channels beyond this are dropped. MKAudioInput mixes the others
+// down to mono, or picks one of them.
+#define MK_MAC_AUDIO_MAX_INPUT_CHANNELS  8
+
 @interface MKMacAudioDevice () {
 @public
     MKAudioSettings              _settings;
@@ -26,6 +35,9 @@
     int                          _recordSampleSize;
     int                          _recordMicChannels;
 
+    AudioDeviceID                _recordDevice;
+    AudioDeviceID                _playbackDevice;
+
     MKAudioDeviceOutputFunc      _outputFunc;
     MKAudioDeviceInputFunc       _inputFunc;
 }
@@ -104,6 +116,52 @@ static OSStatus outputCallback(void *udata, AudioUnitRenderActionFlags *flags, c
     return noErr;
 }
 
+static void MKMacAudioDeviceUseSmallestBuffer(AudioDeviceID devId, AudioObjectPropertyScope scope) {
+    AudioObjectPropertyAddress addr = { kAudioDevicePropertyBufferFrameSizeRange, scope, kAudioObjectPropertyElementMaster };
+    AudioValueRange range;
+    UInt32 len = sizeof(AudioValueRange);
+    OSStatus err = AudioObjectGetPropertyData(devId, &addr, 0, NULL, &len, &range);
+    if (err != noErr) {
+        NSLog(@"MKMacAudioDevice: Unable to query buffer size range.");
+        return;
+    }
+
+    UInt32 frames = (UInt32) MAX(range.mMinimum, MK_MAC_AUDIO_MIN_BUFFER_FRAMES);
+    addr.mSelector = kAudioDevicePropertyBufferFrameSize;
+    err = AudioObjectSetPropertyData(devId, &addr, 0, NULL, sizeof(UInt32), &frames);
+    if (err != noErr) {
+        NSLog(@"MKMacAudioDevice: Unable to set buffer size to %u frames.", (unsigned int)frames);
+        return;
+    }
+    NSLog(@"MKMacAudioDevice: Using %u frame buffers.", (unsigned int)frames);
+}
+
+// The IO buffer plus the latency the device itself reports, in seconds.
+static double MKMacAudioDeviceLatency(AudioDeviceID devId, AudioObjectPropertyScope scope) {
+    AudioObjectPropertySelector selectors[3] = {
+        kAudioDevicePropertyBufferFrameSize,
+        kAudioDevicePropertyLatency,
+        kAudioDevicePropertySafetyOffset,
+    };
+    AudioObjectPropertyAddress rateAddr = { kAudioDevicePropertyNominalSampleRate, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster };
+    Float64 rate = 0.0;
+    UInt32 frames = 0, len = sizeof(Float64);
+    int i;
+
+    if (devId == kAudioObjectUnknown)
+        return 0.0;
+    if (AudioObjectGetPropertyData(devId, &rateAddr, 0, NULL, &len, &rate) != noErr || rate <= 0.0)
+        return 0.0;
+    for (i = 0; i < 3; i++) {
+        AudioObjectPropertyAddress addr = { selectors[i], scope, kAudioObjectPropertyElementMaster };
+        UInt32 val = 0;
+        len = sizeof(UInt32);
+        if (AudioObjectGetPropertyData(devId, &addr, 0, NULL, &len, &val) == noErr)
+            frames += val;
+    }
+    return (double) frames / rate;
+}
+
 @implementation MKMacAudioDevice
 
 - (id) initWithSettings:(MKAudioSettings *)settings {
@@ -181,6 +239,10 @@ static OSStatus outputCallback(void *udata, AudioUnitRenderActionFlags *flags, c
         NSLog(@"MKMacAudioDevice: Unable to set default device.");
         return NO;
     }
+    _recordDevice = devId;
+
+    if (_settings.enableLowLatency)
+        MKMacAudioDeviceUseSmallestBuffer(devId, kAudioDevicePropertyScopeInput);
     
     len = sizeof(AudioStreamBasicDescription);
     err = AudioUnitGetProperty(_recordAudioUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Input, 1, &fmt, &len);
@@ -189,12 +251,12 @@ static OSStatus outputCallback(void *udata, AudioUnitRenderActionFlags *flags, c
         return NO;
     }
     
-    if (fmt.mChannelsPerFrame > 1) {
-        NSLog(@"MKMacAudioDevice: Input device with more than one channel detected. Defaulting to 1.");
+    if (fmt.mChannelsPerFrame > MK_MAC_AUDIO_MAX_INPUT_CHANNELS) {
+        NSLog(@"MKMacAudioDevice: Input device has %u channels. Only using the first %i.", (unsigned int)fmt.mChannelsPerFrame, MK_MAC_AUDIO_MAX_INPUT_CHANNELS);
     }
     
     _recordFrequency = (int) fmt.mSampleRate;
-    _recordMicChannels = 1;
+    _recordMicChannels = (int) MAX(1, MIN(fmt.mChannelsPerFrame, MK_MAC_AUDIO_MAX_INPUT_CHANNELS));
     _recordSampleSize = _recordMicChannels * sizeof(short);
     
     fmt.mFormatFlags = kAudioFormatFlagIsSignedInteger | kAudioFormatFlagIsPacked;
@@ -325,8 +387,14 @@ static OSStatus outputCallback(void *udata, AudioUnitRenderActionFlags *flags, c
         return NO;
     }
     
-    // On desktop we call AudioDeviceSetProperty() with kAudioDevicePropertyBufferFrameSize
-    // to setup our frame size.
+    len = sizeof(AudioDeviceID);
+    err = AudioUnitGetProperty(_playbackAudioUnit, kAudioOutputUnitProperty_CurrentDevice, kAudioUnitScope_Global, 0, &_playbackDevice, &len);
+    if (err != noErr) {
+        NSLog(@"MKMacAudioDevice: Unable to query output device.");
+        _playbackDevice = kAudioObjectUnknown;
+    } else if (_settings.enableLowLatency) {
+        MKMacAudioDeviceUseSmallestBuffer(_playbackDevice, kAudioDevicePropertyScopeOutput);
+    }
     
     err = AudioOutputUnitStart(_playbackAudioUnit);
     if (err != noErr) {
@@ -396,4 +464,12 @@ static OSStatus outputCallback(void *udata, AudioUnitRenderActionFlags *flags, c
     return _playbackChannels;
 }
 
+- (double) inputLatency {
+    return MKMacAudioDeviceLatency(_recordDevice, kAudioDevicePropertyScopeInput);
+}
+
+- (double) outputLatency {
+    return MKMacAudioDeviceLatency(_playbackDevice, kAudioDevicePropertyScopeOutput);
+}
+
 @end
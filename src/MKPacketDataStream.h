@@ -13,6 +13,8 @@ typedef union _float32u {
 - (id) initWithBuffer:(unsigned char *)buffer length:(NSUInteger)len;
 - (void) dealloc;
 
+- (void) resetWithBuffer:(unsigned char *)buffer length:(NSUInteger)len;
+
 - (NSUInteger) size;
 - (NSUInteger) capactiy;
 - (NSUInteger) left;
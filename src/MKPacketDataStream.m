@@ -47,6 +47,20 @@
     [super dealloc];
 }
 
+// Point an existing stream at a new buffer, so that hot paths can reuse a
+// single stream instead of allocating one per packet.
+- (void) resetWithBuffer:(unsigned char *)buffer length:(NSUInteger)len {
+    [mutableData release];
+    mutableData = nil;
+    [immutableData release];
+    immutableData = nil;
+    data = buffer;
+    offset = 0;
+    overshoot = 0;
+    maxSize = len;
+    ok = YES;
+}
+
 - (NSUInteger) size {
     return offset;
 }
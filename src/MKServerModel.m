@@ -26,10 +26,17 @@
 // fixme(mkrautz): Refactor once 1.0's out the door.
 @interface MKAudio ()
 - (void) setSelfMuted:(BOOL)selfMuted;
+- (void) setSelfDeafened:(BOOL)selfDeafened;
+- (void) setLocalSession:(NSUInteger)session forConnection:(MKConnection *)conn;
 - (void) setSuppressed:(BOOL)suppressed;
 - (void) setMuted:(BOOL)muted;
+- (void) setVoiceTarget:(NSUInteger)target forConnection:(MKConnection *)conn;
 @end
 
+// Target 0 is normal talking, and 31 is the server loopback.
+#define MK_SERVER_MODEL_MIN_VOICE_TARGET  1
+#define MK_SERVER_MODEL_MAX_VOICE_TARGET  30
+
 @interface MKServerModel () {
     MKConnection              *_connection;
     MKChannel                 *_rootChannel;
@@ -92,9 +99,17 @@
         [_connection setMessageHandler:self];
         
         // fixme(mkrautz): Refactor this once 1.0's out the door.
-        [[MKAudio sharedAudio] setSelfMuted:NO];
-        [[MKAudio sharedAudio] setMuted:NO];
-        [[MKAudio sharedAudio] setSuppressed:NO];
+        // The audio subsystem may already be shared with other connections,
+        // whose state must be left alone.
+        NSArray *audioConns = [[MKAudio sharedAudio] connectionsForAudio];
+        if ([audioConns count] == 0 || ([audioConns count] == 1 && [audioConns containsObject:conn])) {
+            [[MKAudio sharedAudio] setSelfMuted:NO];
+            [[MKAudio sharedAudio] setSelfDeafened:NO];
+            [[MKAudio sharedAudio] setMuted:NO];
+            [[MKAudio sharedAudio] setSuppressed:NO];
+        }
+        [[MKAudio sharedAudio] setLocalSession:NSNotFound forConnection:conn];
+        [[MKAudio sharedAudio] setVoiceTarget:0 forConnection:conn];
 
         // Listens to notifications form MKAudioOutput and MKAudioInput
         [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(notificationUserTalkStateChanged:) name:@"MKAudioUserTalkStateChanged" object:nil];
@@ -356,6 +371,7 @@
 - (void) connection:(MKConnection *)conn handleServerSyncMessage:(MPServerSync *)msg {
     MKUser *user = [self userWithSession:[msg session]];
     _connectedUser = user;
+    [[MKAudio sharedAudio] setLocalSession:[user session] forConnection:_connection];
 
     MKAudioSettings settings;
     [[MKAudio sharedAudio] readAudioSettings:&settings];
@@ -546,6 +562,10 @@
     if (![_connection connected])
         return;
 
+    // Other users' talk states are only ours if they are on our connection.
+    if (session != nil && [infoDict objectForKey:@"connection"] != _connection)
+        return;
+
     if (talkState) {
         // An infoDict with a missing userSession means that our own talkState changed.
         if (session == nil) {
@@ -611,6 +631,7 @@
 
         if (user == _connectedUser) {
             [[MKAudio sharedAudio] setSelfMuted:[user isSelfMuted]];
+            [[MKAudio sharedAudio] setSelfDeafened:[user isSelfDeafened]];
         }
 
         [_delegate serverModel:self userSelfMuteDeafenStateChanged:user];
@@ -1056,6 +1077,55 @@
 
 }
 
+#pragma mark -
+#pragma mark Voice target operations
+
+- (void) registerVoiceTarget:(NSUInteger)target toUsers:(NSArray *)users andChannels:(NSArray *)channels includeLinks:(BOOL)links includeChildren:(BOOL)children group:(NSString *)group {
+    if (target < MK_SERVER_MODEL_MIN_VOICE_TARGET || target > MK_SERVER_MODEL_MAX_VOICE_TARGET) {
+        NSLog(@"MKServerModel: invalid voice target %lu", (unsigned long)target);
+        return;
+    }
+
+    NSMutableArray *targets = [[[NSMutableArray alloc] initWithCapacity:[channels count] + 1] autorelease];
+    if ([users count] > 0) {
+        NSMutableArray *userSessions = [[[NSMutableArray alloc] initWithCapacity:[users count]] autorelease];
+        for (MKUser *user in users) {
+            [userSessions addObject:[NSNumber numberWithUnsignedLong:[user session]]];
+        }
+        MPVoiceTarget_Target_Builder *mpt = [MPVoiceTarget_Target builder];
+        [mpt setSessionArray:userSessions];
+        [targets addObject:[mpt build]];
+    }
+    for (MKChannel *chan in channels) {
+        MPVoiceTarget_Target_Builder *mpt = [MPVoiceTarget_Target builder];
+        [mpt setChannelId:(uint32_t)[chan channelId]];
+        [mpt setLinks:links];
+        [mpt setChildren:children];
+        if (group != nil)
+            [mpt setGroup:group];
+        [targets addObject:[mpt build]];
+    }
+
+    MPVoiceTarget_Builder *mpvt = [MPVoiceTarget builder];
+    [mpvt setId:(uint32_t)target];
+    [mpvt setTargetsArray:targets];
+
+    NSData *data = [[mpvt build] data];
+    [_connection sendMessageWithType:VoiceTargetMessage data:data];
+}
+
+- (void) unregisterVoiceTarget:(NSUInteger)target {
+    [self registerVoiceTarget:target toUsers:nil andChannels:nil includeLinks:NO includeChildren:NO group:nil];
+}
+
+- (void) setVoiceTarget:(NSUInteger)target {
+    if (target > MK_SERVER_MODEL_MAX_VOICE_TARGET) {
+        NSLog(@"MKServerModel: invalid voice target %lu", (unsigned long)target);
+        return;
+    }
+    [[MKAudio sharedAudio] setVoiceTarget:target forConnection:_connection];
+}
+
 #pragma mark -
 #pragma mark Mute/deafen operations
 
@@ -0,0 +1,79 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <stdatomic.h>
+
+// Large enough for any UDP datagram a Mumble server will send us.
+#define MK_VOICE_PACKET_MAX_SIZE  1024
+
+// MKVoicePacket is a pooled, reference counted buffer for a single voice
+// packet. A packet is filled once, right where it is received, and is then
+// passed along by reference all the way to the decoder. Consumers only ever
+// look at it through offset/length views.
+//
+// Packets come from a process-wide free list, so once the pool has warmed
+// up, receiving and decoding voice does not allocate.
+//
+// The sequence number and timestamp are only used for latency measurements.
+// The timestamp is when the packet was built for sending, or when it was
+// received, and is 0 if unknown.
+typedef struct _MKVoicePacket {
+    _Atomic int32_t          refs;
+    struct _MKVoicePacket   *next;
+    NSUInteger               offset;
+    NSUInteger               length;
+    NSUInteger               sequence;
+    uint64_t                 timestamp;
+    unsigned char            data[MK_VOICE_PACKET_MAX_SIZE];
+} MKVoicePacket;
+
+MKVoicePacket *MKVoicePacketAlloc(void);
+MKVoicePacket *MKVoicePacketRetain(MKVoicePacket *packet);
+void MKVoicePacketRelease(MKVoicePacket *packet);
+
+MKVoicePacket *MKVoicePacketCreateWithBytes(const unsigned char *bytes, NSUInteger len);
+
+static inline unsigned char *MKVoicePacketBytes(MKVoicePacket *packet) {
+    return packet->data + packet->offset;
+}
+
+NSUInteger MKVoicePacketPoolAllocationCount(void);
+NSUInteger MKVoicePacketPoolOutstandingCount(void);
+
+// Room left in front of an outgoing packet's payload for the flags byte and
+// the varint header fields, which are only known once the payload is done.
+#define MK_VOICE_PACKET_HEADER_ROOM  24
+
+// MKVoicePacketBuilder assembles an outgoing voice packet in place. Encoders
+// write each frame straight into the packet, and the header is filled in
+// right-aligned in front of the payload when the packet is finished.
+typedef struct _MKVoicePacketBuilder {
+    MKVoicePacket   *packet;
+    NSUInteger       start;
+    NSUInteger       end;
+    NSUInteger       lastHead;
+} MKVoicePacketBuilder;
+
+void MKVoicePacketBuilderInit(MKVoicePacketBuilder *b);
+void MKVoicePacketBuilderDestroy(MKVoicePacketBuilder *b);
+
+unsigned char *MKVoicePacketBuilderFrameBuffer(MKVoicePacketBuilder *b, NSUInteger *avail);
+void MKVoicePacketBuilderCommitFrame(MKVoicePacketBuilder *b, NSUInteger len, BOOL framed);
+MKVoicePacket *MKVoicePacketBuilderFinish(MKVoicePacketBuilder *b, unsigned char flags, uint64_t seq, BOOL opus, BOOL terminator);
+
+// MKVoicePacketQueue hands packets from a single producer thread to a single
+// consumer thread without locking. A pushed packet's reference is owned by
+// the queue until it is popped.
+#define MK_VOICE_PACKET_QUEUE_SIZE  64
+
+typedef struct _MKVoicePacketQueue {
+    MKVoicePacket           *packets[MK_VOICE_PACKET_QUEUE_SIZE];
+    _Atomic uint32_t         head;
+    _Atomic uint32_t         tail;
+} MKVoicePacketQueue;
+
+void MKVoicePacketQueueInit(MKVoicePacketQueue *q);
+void MKVoicePacketQueueDrain(MKVoicePacketQueue *q);
+BOOL MKVoicePacketQueuePush(MKVoicePacketQueue *q, MKVoicePacket *packet);
+MKVoicePacket *MKVoicePacketQueuePop(MKVoicePacketQueue *q);
@@ -0,0 +1,231 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#import "MKVoicePacket.h"
+
+#include <pthread.h>
+
+static pthread_mutex_t   MKVoicePacketPoolLock = PTHREAD_MUTEX_INITIALIZER;
+static MKVoicePacket    *MKVoicePacketPoolFreeList = NULL;
+static _Atomic NSUInteger MKVoicePacketPoolAllocations = 0;
+static _Atomic NSUInteger MKVoicePacketPoolFree = 0;
+
+// Returns a packet with a reference count of one, and an empty view.
+MKVoicePacket *MKVoicePacketAlloc(void) {
+    MKVoicePacket *packet = NULL;
+
+    pthread_mutex_lock(&MKVoicePacketPoolLock);
+    packet = MKVoicePacketPoolFreeList;
+    if (packet != NULL) {
+        MKVoicePacketPoolFreeList = packet->next;
+        atomic_fetch_sub_explicit(&MKVoicePacketPoolFree, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&MKVoicePacketPoolLock);
+
+    if (packet == NULL) {
+        packet = malloc(sizeof(MKVoicePacket));
+        if (packet == NULL)
+            return NULL;
+        atomic_fetch_add(&MKVoicePacketPoolAllocations, 1);
+    }
+
+    atomic_init(&packet->refs, 1);
+    packet->next = NULL;
+    packet->offset = 0;
+    packet->length = 0;
+    packet->sequence = 0;
+    packet->timestamp = 0;
+    return packet;
+}
+
+MKVoicePacket *MKVoicePacketRetain(MKVoicePacket *packet) {
+    atomic_fetch_add_explicit(&packet->refs, 1, memory_order_relaxed);
+    return packet;
+}
+
+// Packets are never freed. Once the last reference is gone, the packet
+// goes back on the free list for the next receive.
+void MKVoicePacketRelease(MKVoicePacket *packet) {
+    if (packet == NULL)
+        return;
+    if (atomic_fetch_sub_explicit(&packet->refs, 1, memory_order_acq_rel) != 1)
+        return;
+
+    pthread_mutex_lock(&MKVoicePacketPoolLock);
+    packet->next = MKVoicePacketPoolFreeList;
+    MKVoicePacketPoolFreeList = packet;
+    atomic_fetch_add_explicit(&MKVoicePacketPoolFree, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&MKVoicePacketPoolLock);
+}
+
+MKVoicePacket *MKVoicePacketCreateWithBytes(const unsigned char *bytes, NSUInteger len) {
+    if (len > MK_VOICE_PACKET_MAX_SIZE)
+        return NULL;
+    MKVoicePacket *packet = MKVoicePacketAlloc();
+    if (packet == NULL)
+        return NULL;
+    memcpy(packet->data, bytes, len);
+    packet->length = len;
+    return packet;
+}
+
+// The number of packets that have been allocated from the heap since the
+// process started. This stops growing once the pool has warmed up.
+NSUInteger MKVoicePacketPoolAllocationCount(void) {
+    return atomic_load(&MKVoicePacketPoolAllocations);
+}
+
+// The number of packets that are currently referenced by someone, rather
+// than sitting on the free list. Once all voice has been played out, this
+// goes back to where it was before.
+NSUInteger MKVoicePacketPoolOutstandingCount(void) {
+    pthread_mutex_lock(&MKVoicePacketPoolLock);
+    NSUInteger outstanding = atomic_load(&MKVoicePacketPoolAllocations) - atomic_load(&MKVoicePacketPoolFree);
+    pthread_mutex_unlock(&MKVoicePacketPoolLock);
+    return outstanding;
+}
+
+// Write value as a Mumble varint, ending right before data[end]. Returns the
+// new start of the data. See -[MKPacketDataStream addVarint:].
+static NSUInteger MKVoicePacketPrependVarint(unsigned char *data, NSUInteger end, uint64_t i) {
+    unsigned char buf[9];
+    NSUInteger n = 0;
+
+    if (i < 0x80) {
+        buf[n++] = (unsigned char)i;
+    } else if (i < 0x4000) {
+        buf[n++] = (unsigned char)((i >> 8) | 0x80);
+        buf[n++] = (unsigned char)(i & 0xFF);
+    } else if (i < 0x200000) {
+        buf[n++] = (unsigned char)((i >> 16) | 0xC0);
+        buf[n++] = (unsigned char)((i >> 8) & 0xFF);
+        buf[n++] = (unsigned char)(i & 0xFF);
+    } else if (i < 0x10000000) {
+        buf[n++] = (unsigned char)((i >> 24) | 0xE0);
+        buf[n++] = (unsigned char)((i >> 16) & 0xFF);
+        buf[n++] = (unsigned char)((i >> 8) & 0xFF);
+        buf[n++] = (unsigned char)(i & 0xFF);
+    } else if (i < 0x100000000LL) {
+        buf[n++] = 0xF0;
+        buf[n++] = (unsigned char)((i >> 24) & 0xFF);
+        buf[n++] = (unsigned char)((i >> 16) & 0xFF);
+        buf[n++] = (unsigned char)((i >> 8) & 0xFF);
+        buf[n++] = (unsigned char)(i & 0xFF);
+    } else {
+        buf[n++] = 0xF4;
+        buf[n++] = (unsigned char)((i >> 56) & 0xFF);
+        buf[n++] = (unsigned char)((i >> 48) & 0xFF);
+        buf[n++] = (unsigned char)((i >> 40) & 0xFF);
+        buf[n++] = (unsigned char)((i >> 32) & 0xFF);
+        buf[n++] = (unsigned char)((i >> 24) & 0xFF);
+        buf[n++] = (unsigned char)((i >> 16) & 0xFF);
+        buf[n++] = (unsigned char)((i >> 8) & 0xFF);
+        buf[n++] = (unsigned char)(i & 0xFF);
+    }
+
+    memcpy(data + end - n, buf, n);
+    return end - n;
+}
+
+void MKVoicePacketBuilderInit(MKVoicePacketBuilder *b) {
+    b->packet = NULL;
+    b->start = MK_VOICE_PACKET_HEADER_ROOM;
+    b->end = MK_VOICE_PACKET_HEADER_ROOM;
+    b->lastHead = NSNotFound;
+}
+
+void MKVoicePacketBuilderDestroy(MKVoicePacketBuilder *b) {
+    MKVoicePacketRelease(b->packet);
+    MKVoicePacketBuilderInit(b);
+}
+
+// Returns where the encoder should write the next frame, and how much room
+// there is for it. One byte is always kept free in front of the frame for
+// its length header.
+unsigned char *MKVoicePacketBuilderFrameBuffer(MKVoicePacketBuilder *b, NSUInteger *avail) {
+    if (b->packet == NULL) {
+        b->packet = MKVoicePacketAlloc();
+        if (b->packet == NULL) {
+            *avail = 0;
+            return NULL;
+        }
+    }
+    *avail = MK_VOICE_PACKET_MAX_SIZE - b->end - 1;
+    return b->packet->data + b->end + 1;
+}
+
+// Framed frames (Speex) are each preceded by a length byte, with the top bit
+// set on all but the last one. An unframed frame (Opus) is the entire payload.
+void MKVoicePacketBuilderCommitFrame(MKVoicePacketBuilder *b, NSUInteger len, BOOL framed) {
+    unsigned char *data = b->packet->data;
+    if (framed) {
+        data[b->end] = (unsigned char)(len & 0x7f);
+        if (b->lastHead != NSNotFound)
+            data[b->lastHead] |= 0x80;
+        b->lastHead = b->end;
+        b->end += 1 + len;
+    } else {
+        b->start = b->end + 1;
+        b->end = b->start + len;
+    }
+}
+
+// Fill in the header in front of the payload, and hand the finished packet
+// over to the caller. The builder starts over with a fresh packet.
+MKVoicePacket *MKVoicePacketBuilderFinish(MKVoicePacketBuilder *b, unsigned char flags, uint64_t seq, BOOL opus, BOOL terminator) {
+    MKVoicePacket *packet = b->packet;
+    if (packet == NULL)
+        return NULL;
+
+    NSUInteger pos = b->start;
+    if (opus) {
+        uint64_t header = b->end - b->start;
+        if (terminator)
+            header |= (1 << 13); // Opus terminator flag
+        pos = MKVoicePacketPrependVarint(packet->data, pos, header);
+    }
+    pos = MKVoicePacketPrependVarint(packet->data, pos, seq);
+    packet->data[--pos] = flags;
+
+    packet->offset = pos;
+    packet->length = b->end - pos;
+    packet->sequence = (NSUInteger)seq;
+
+    b->packet = NULL;
+    MKVoicePacketBuilderInit(b);
+    return packet;
+}
+
+void MKVoicePacketQueueInit(MKVoicePacketQueue *q) {
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+}
+
+// Release any packets left in the queue. Must only be called while neither
+// the producer nor the consumer is using the queue.
+void MKVoicePacketQueueDrain(MKVoicePacketQueue *q) {
+    MKVoicePacket *packet;
+    while ((packet = MKVoicePacketQueuePop(q)) != NULL)
+        MKVoicePacketRelease(packet);
+}
+
+BOOL MKVoicePacketQueuePush(MKVoicePacketQueue *q, MKVoicePacket *packet) {
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail - head == MK_VOICE_PACKET_QUEUE_SIZE)
+        return NO;
+    q->packets[tail % MK_VOICE_PACKET_QUEUE_SIZE] = packet;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return YES;
+}
+
+MKVoicePacket *MKVoicePacketQueuePop(MKVoicePacketQueue *q) {
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head == tail)
+        return NULL;
+    MKVoicePacket *packet = q->packets[head % MK_VOICE_PACKET_QUEUE_SIZE];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return packet;
+}
@@ -272,4 +272,18 @@ static OSStatus outputCallback(void *udata, AudioUnitRenderActionFlags *flags, c
     return _numMicChannels;
 }
 
+// Both directions go through the same IO unit, so they share a buffer.
+- (double) inputLatency {
+    Float32 duration = 0.0f;
+    UInt32 len = sizeof(Float32);
+    OSStatus err = AudioSessionGetProperty(kAudioSessionProperty_CurrentHardwareIOBufferDuration, &len, &duration);
+    if (err != kAudioSessionNoError)
+        return 0.0;
+    return duration;
+}
+
+- (double) outputLatency {
+    return [self inputLatency];
+}
+
 @end
@@ -9,6 +9,9 @@
 @class MKAudioInput;
 @class MKAudioOutput;
 @class MKAudioOutputSidetone;
+@class MKAudioRecorder;
+
+struct _MKVoicePacket;
 
 #define SAMPLE_RATE 48000
 
@@ -31,6 +34,124 @@ typedef enum _MKVADKind {
     MKVADKindAmplitude,
 } MKVADKind;
 
+/// How a headless audio device advances time.
+typedef enum _MKAudioHeadlessClock {
+    /// A thread of the device's own runs one 10ms cycle every 10ms.
+    MKAudioHeadlessClockRealtime,
+    /// A thread of the device's own runs cycles back to back, as fast as
+    /// the machine allows.
+    MKAudioHeadlessClockFreeRunning,
+    /// Nothing happens until the caller runs cycles with
+    /// -[MKAudio runHeadlessAudioFrames:].
+    MKAudioHeadlessClockManual,
+} MKAudioHeadlessClock;
+
+/// Receives mixed 16-bit PCM from a headless audio device. Samples are
+/// interleaved if there is more than one channel.
+typedef void (^MKAudioPCMSink)(const short *frames, NSUInteger nsamp, NSUInteger channels, int sampleRate);
+
+/// Receives the decoded audio of a single user, as mono float PCM at
+/// SAMPLE_RATE, before it is mixed. Users of connections other than the
+/// first are identified by their session key (see
+/// -[MKAudio sessionKeyForSession:onConnection:]).
+typedef void (^MKAudioUserPCMSink)(NSUInteger session, const float *frames, NSUInteger nsamp);
+
+/// The stages of the voice pipeline that MKAudio measures the latency of.
+typedef enum _MKAudioLatencyStage {
+    /// From the first sample of a 10ms frame being captured, until the
+    /// frame is complete.
+    MKAudioLatencyStageCapture,
+    /// From a captured frame being complete, until it has been
+    /// preprocessed and encoded.
+    MKAudioLatencyStageEncode,
+    /// From the first frame of a packet being complete, until the packet
+    /// is handed to the connection. This includes waiting for the rest of
+    /// the packet's frames.
+    MKAudioLatencyStagePacketize,
+    /// From a packet being handed to the connection, until it is written
+    /// to the network.
+    MKAudioLatencyStageSend,
+    /// From a packet being sent, until the server sends it back. Only
+    /// measured in loopback mode.
+    MKAudioLatencyStageNetwork,
+    /// From a packet being received, until it is taken out of the jitter
+    /// buffer to be decoded.
+    MKAudioLatencyStageJitterBuffer,
+    /// The time it takes to decode a frame.
+    MKAudioLatencyStageDecode,
+    /// How long decoded audio waits before it is mixed.
+    MKAudioLatencyStagePlayout,
+    /// From the first sample of a packet being captured, until it is
+    /// mixed for playback after coming back from the server. Only measured
+    /// in loopback mode. Does not include the output device's own latency.
+    MKAudioLatencyStageMouthToEar,
+    MKAudioLatencyStageCount
+} MKAudioLatencyStage;
+
+#define MK_AUDIO_LATENCY_BUCKETS  32
+
+/// A latency histogram. Times are in milliseconds.
+///
+/// Bucket i counts samples below 0.1ms * 2^(i/2), that did not fit into
+/// bucket i-1. The last bucket counts everything that did not fit anywhere
+/// else.
+typedef struct _MKAudioLatencyHistogram {
+    NSUInteger  count;
+    double      minimum;
+    double      maximum;
+    double      mean;
+    NSUInteger  buckets[MK_AUDIO_LATENCY_BUCKETS];
+} MKAudioLatencyHistogram;
+
+/// The stages of the audio pipeline that MKAudio measures the run time of.
+typedef enum _MKAudioProfileStage {
+    /// Resampling a captured frame to the encoder's sample rate.
+    MKAudioProfileStageInputResample,
+    /// Running the Speex preprocessor on a captured frame.
+    MKAudioProfileStagePreprocess,
+    /// Encoding a frame.
+    MKAudioProfileStageEncode,
+    /// Finishing a packet and handing it to the connection.
+    MKAudioProfileStageFlush,
+    /// Taking a packet out of a talker's jitter buffer.
+    MKAudioProfileStageJitterBufferGet,
+    /// Decoding a frame.
+    MKAudioProfileStageDecode,
+    /// Resampling a talker's decoded audio to the mixer's sample rate.
+    MKAudioProfileStageTalkerResample,
+    /// A whole render callback: mixing, resampling and conversion.
+    MKAudioProfileStageMix,
+    MKAudioProfileStageCount
+} MKAudioProfileStage;
+
+#define MK_AUDIO_PROFILE_BUCKETS  32
+
+/// A run time histogram. Times are in microseconds.
+///
+/// Bucket i counts samples below 1us * 2^(i/2), that did not fit into
+/// bucket i-1. The last bucket counts everything that did not fit anywhere
+/// else.
+typedef struct _MKAudioProfileHistogram {
+    NSUInteger  count;
+    double      minimum;
+    double      maximum;
+    double      mean;
+    NSUInteger  buckets[MK_AUDIO_PROFILE_BUCKETS];
+} MKAudioProfileHistogram;
+
+/// How long the last start of the audio subsystem took. Times are in
+/// milliseconds, counted from the call to start.
+typedef struct _MKAudioStartupTimes {
+    /// Until start returned, including the warm-up.
+    double  setup;
+    /// Spent warming up codecs, resamplers and buffers.
+    double  warmUp;
+    /// Until the first input was captured, or 0 if none has been yet.
+    double  firstInput;
+    /// Until the first output was rendered, or 0 if none has been yet.
+    double  firstOutput;
+} MKAudioStartupTimes;
+
 typedef struct _MKAudioSettings {
     MKCodecFormat   codec;
     MKTransmitType  transmitType;
@@ -45,6 +166,10 @@ typedef struct _MKAudioSettings {
     float           volume;
     int             outputDelay;
     float           micBoost;
+
+    /// The input channel to capture, starting at 1. 0 mixes all of the
+    /// input device's channels down to mono.
+    int             inputChannel;
     BOOL            enablePreprocessor;
     BOOL            enableEchoCancellation;
     BOOL            enableSideTone;
@@ -58,6 +183,20 @@ typedef struct _MKAudioSettings {
     BOOL            preferReceiverOverSpeaker;
     BOOL            opusForceCELTMode;
     BOOL            audioMixerDebug;
+
+    /// Tunes the whole pipeline for 10ms voice: one frame per packet, the
+    /// smallest device buffers, an adaptive jitter buffer and a shorter
+    /// decode-ahead. Overrides audioPerPacket.
+    BOOL            enableLowLatency;
+
+    BOOL            enablePositionalAudio;
+    BOOL            positionalHeadphones;
+    float           positionalMinDistance;
+    float           positionalMaxDistance;
+    float           positionalMaxDistanceVolume;
+
+    BOOL                  enableHeadlessAudio;
+    MKAudioHeadlessClock  headlessClock;
 } MKAudioSettings;
 
 /// @protocol MKAudioDelegate MKAudio.h MumbleKit/MKAudio.h
@@ -173,9 +312,18 @@ typedef struct _MKAudioSettings {
 
 /// Updates the MumbleKit audio subsystem with a new configuration.
 ///
+/// Changes to quality, the VAD and transmit settings, noise suppression,
+/// mic boost, comfort noise and sidetone (including its volume) are
+/// applied to the running audio subsystem at its next frame. Other changes only take
+/// effect after a restart; see isRestartNeeded.
+///
 /// @param settings  A pointer to a MKAudioSettings struct with the new audio subsystem settings.
 - (void) updateAudioSettings:(MKAudioSettings *)settings;
 
+/// Returns whether the running audio subsystem must be restarted for
+/// settings passed to updateAudioSettings: to take effect.
+- (BOOL) isRestartNeeded;
+
 ///-------------------
 /// @name Transmission
 ///-------------------
@@ -196,19 +344,238 @@ typedef struct _MKAudioSettings {
 /// suitable for echo cancellation.
 - (BOOL) echoCancellationAvailable;
 
-/// Sets the main connection for audio purposes.  This is the connection
-/// that the audio input code will use when tramitting produced packets.
+///-----------------------
+/// @name Positional Audio
+///-----------------------
+
+/// Sets the position and orientation of the listener in the game world.
+///
+/// When positional audio is enabled in the audio settings, voice packets
+/// that carry a position are panned and attenuated relative to the listener.
+/// The vectors use the same left-handed coordinate system as Mumble's
+/// positional audio plugins (x to the right, y up, z forward).
 ///
-/// Currently, this method should not be used. It is a future API.
-/// Internally, any constructed MKConnection will implicitly register
-/// itself as the main connection for audio purposes. In the future,
-/// this will be an explicit choice instead, allowing multiple
-/// connections to live alongside eachother.
+/// @param  position  The listener's position, in meters.
+/// @param  front     A unit vector pointing in the direction the listener is facing.
+/// @param  top       A unit vector pointing up from the listener's head.
+- (void) setListenerPosition:(const float *)position front:(const float *)front top:(const float *)top;
+
+///----------------------
+/// @name Local Playback
+///----------------------
+
+/// Locally mutes or unmutes a user. Audio from a locally muted user is
+/// neither decoded nor played back. The setting is kept until it is
+/// changed again, also across restarts of the audio subsystem.
+///
+/// @param  muted    Whether or not to mute the user.
+/// @param  session  The session of the user. For users of connections
+///                  other than the first, pass the session key returned
+///                  by sessionKeyForSession:onConnection:.
+- (void) setLocalMuted:(BOOL)muted forSession:(NSUInteger)session;
+
+/// Returns whether or not the user with the given session is locally muted.
+- (BOOL) isLocallyMutedSession:(NSUInteger)session;
+
+/// Sets the local playback volume of a user.
+///
+/// @param  volume   The volume, as a linear gain. 1.0 is the default.
+/// @param  session  The session of the user, or its session key (see
+///                  setLocalMuted:forSession:).
+- (void) setLocalVolume:(float)volume forSession:(NSUInteger)session;
+
+/// Returns the local playback volume of the user with the given session.
+- (float) localVolumeForSession:(NSUInteger)session;
+
+///---------------------
+/// @name Headless Audio
+///---------------------
+
+/// Sets the block that receives mixed output while the enableHeadlessAudio
+/// setting is on. The block is called on the thread that runs the headless
+/// device's cycles, and is kept across restarts.
+///
+/// @param  sink  The sink block, or nil.
+- (void) setHeadlessOutputSink:(MKAudioPCMSink)sink;
+
+/// Sets the block that receives each audible user's decoded audio before it
+/// is mixed. Works with any audio device. The block is called on the audio
+/// output thread, and is kept across restarts.
+///
+/// @param  sink  The sink block, or nil.
+- (void) setUserOutputSink:(MKAudioUserPCMSink)sink;
+
+/// Queues mono 16-bit PCM at SAMPLE_RATE as captured audio for the
+/// headless audio device.
+///
+/// @param  pcm    The samples.
+/// @param  nsamp  The number of samples.
+///
+/// @returns  The number of samples that were queued.
+- (NSUInteger) writeHeadlessInput:(const short *)pcm count:(NSUInteger)nsamp;
+
+/// Makes the headless audio device read captured audio (raw mono 16-bit PCM
+/// at SAMPLE_RATE) from a file or pipe. The caller keeps ownership of the
+/// file descriptor.
+///
+/// @param  fd  The file descriptor, or -1 to go back to writeHeadlessInput:count:.
+- (void) setHeadlessInputFileDescriptor:(int)fd;
+
+/// Runs the headless audio device for at least nframes frames on the
+/// calling thread, as fast as possible.
+///
+/// @param  nframes  The number of frames to run.
+///
+/// @returns  The number of frames that were run, or 0 if the headless
+///           audio device isn't running.
+- (NSUInteger) runHeadlessAudioFrames:(NSUInteger)nframes;
+
+///----------------
+/// @name Recording
+///----------------
+
+/// Sets the recorder that received voice is passed to. The recorder
+/// sees every user's voice, even while deafened or when the user is
+/// locally muted.
+///
+/// @param  recorder  The recorder to use, or nil to stop passing voice
+///                   to a recorder.
+- (void) setRecorder:(MKAudioRecorder *)recorder;
+
+///--------------
+/// @name Latency
+///--------------
+
+/// Reads the latency histogram of a stage of the voice pipeline. The
+/// histograms cover everything since the process started, or since the
+/// last call to resetLatencyStatistics.
 ///
-/// @param  conn  The MKConnection to set as the main connection
-///               for audio purposes.
+/// @param  histogram  The histogram to fill in.
+/// @param  stage      The stage to read the histogram of.
+- (void) getLatencyHistogram:(MKAudioLatencyHistogram *)histogram forStage:(MKAudioLatencyStage)stage;
+
+/// Returns an estimate of the given percentile of a stage's latency, in
+/// milliseconds. This is the upper limit of the bucket the percentile
+/// falls into, or 0 if nothing was measured.
+///
+/// @param  percentile  The percentile, between 0.0 and 1.0.
+/// @param  stage       The stage.
+- (double) latencyPercentile:(double)percentile forStage:(MKAudioLatencyStage)stage;
+
+/// Clears all latency histograms.
+- (void) resetLatencyStatistics;
+
+/// Enables or disables loopback latency measurement. While enabled, the
+/// server sends our own voice back to us instead of to the other users in
+/// the channel, which allows measuring the network round trip and the full
+/// mouth-to-ear latency.
+///
+/// @param  enabled  Whether or not to enable loopback mode.
+- (void) setLatencyLoopbackEnabled:(BOOL)enabled;
+
+/// Returns whether loopback latency measurement is enabled.
+- (BOOL) isLatencyLoopbackEnabled;
+
+/// Returns the mouth-to-ear latency currently achieved, in milliseconds,
+/// including the audio devices' own latency.
+///
+/// In loopback mode this is the measured median. Otherwise it is the sum
+/// of the median of each local stage, and the network is not included.
+- (double) estimatedMouthToEarLatency;
+
+///----------------
+/// @name Profiling
+///----------------
+
+/// Reads the run time histogram of a stage of the audio pipeline. The
+/// histograms cover everything since the process started, or since the
+/// last call to resetProfile.
+///
+/// @param  histogram  The histogram to fill in.
+/// @param  stage      The stage to read the histogram of.
+- (void) getProfileHistogram:(MKAudioProfileHistogram *)histogram forStage:(MKAudioProfileStage)stage;
+
+/// Returns the number of render callbacks so far, and how many of them
+/// took longer than the audio they produced lasts.
+///
+/// @param  misses  Set to the number of callbacks that missed their deadline.
+- (NSUInteger) renderCyclesWithDeadlineMisses:(NSUInteger *)misses;
+
+/// Clears all run time histograms and render counters.
+- (void) resetProfile;
+
+/// Returns the profile as UTF-8 encoded JSON, suitable for attaching to
+/// bug reports. The caller owns the returned object.
+- (NSData *) copyProfileJSON;
+
+/// Reads how long the last start of the audio subsystem took. Before
+/// the audio threads run, start prepares every codec, resampler and
+/// buffer they need, so that the first frames don't pay for it.
+///
+/// @param  times  The struct to fill in. It is zeroed if the audio
+///                subsystem is not running.
+- (void) getStartupTimes:(MKAudioStartupTimes *)times;
+
+///------------------
+/// @name Connections
+///------------------
+
+/// Adds a connection to the audio subsystem. Up to eight connections can
+/// share it: captured audio is encoded once and sent to all of them, and
+/// the voice of every connection's users is played back by the same mixer.
+///
+/// An MKConnection adds itself once it is established, and removes itself
+/// when it disconnects.
+///
+/// @param  conn  The connection to add. The first connection added
+///               becomes the main connection.
+- (void) addConnectionForAudio:(MKConnection *)conn;
+
+/// Removes a connection from the audio subsystem, together with the local
+/// playback settings of its users.
+///
+/// @param  conn  The connection to remove.
+- (void) removeConnectionForAudio:(MKConnection *)conn;
+
+/// Returns the connections that share the audio subsystem.
+- (NSArray *) connectionsForAudio;
+
+/// Sets the main connection for audio purposes. The main connection
+/// decides which codec is used to encode our voice, and is the one that
+/// latency loopback measurements are made on.
+///
+/// @param  conn  The MKConnection to set as the main connection. It is
+///               added if needed. Passing nil removes the current main
+///               connection.
 - (void) setMainConnectionForAudio:(MKConnection *)conn;
+
+/// Sets the playback volume of all users of a connection. It scales their
+/// local volumes, and is kept until the connection is removed.
+///
+/// @param  volume  The volume, as a linear gain. 1.0 is the default.
+/// @param  conn    The connection.
+- (void) setVolume:(float)volume forConnection:(MKConnection *)conn;
+
+/// Returns the playback volume of a connection.
+- (float) volumeForConnection:(MKConnection *)conn;
+
+/// Returns the key that identifies a user of a connection in the audio
+/// subsystem. For users of the first connection, the key is their
+/// session. Returns NSNotFound if the connection was not added.
+///
+/// @param  session  The session of the user on the connection.
+/// @param  conn     The connection.
+- (NSUInteger) sessionKeyForSession:(NSUInteger)session onConnection:(MKConnection *)conn;
+
+/// Called by a connection once the server has told it which codec to use.
+/// The main connection's codec is used to encode our voice.
+///
+/// @param  conn  The connection.
+- (void) connectionDidChangeCodec:(MKConnection *)conn;
+
 - (void) addFrameToBufferWithSession:(NSUInteger)session data:(NSData *)data sequence:(NSUInteger)seq type:(MKUDPMessageType)msgType;
+- (void) addVoicePacket:(struct _MKVoicePacket *)packet forSession:(NSUInteger)session sequence:(NSUInteger)seq type:(MKUDPMessageType)msgType;
+- (void) addVoicePacket:(struct _MKVoicePacket *)packet forSession:(NSUInteger)session sequence:(NSUInteger)seq type:(MKUDPMessageType)msgType fromConnection:(MKConnection *)conn;
 - (MKAudioOutputSidetone *) sidetoneOutput;
 - (float) speechProbablity;
 - (float) peakCleanMic;
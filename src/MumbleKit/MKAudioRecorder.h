@@ -0,0 +1,50 @@
+// Copyright 2012 The MumbleKit Developers. All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#import <MumbleKit/MKConnection.h>
+
+struct _MKVoicePacket;
+
+/// @class MKAudioRecorder MKAudioRecorder.h MumbleKit/MKAudioRecorder.h
+///
+/// MKAudioRecorder records every user's voice to a separate Ogg/Opus file.
+///
+/// The Opus packets received from the server are written to disk as they are,
+/// without being decoded or re-encoded. All tracks share a single timeline
+/// that starts when the recorder is started: talk bursts are placed at the
+/// time they were received, and the gaps between them are filled with
+/// silence, so the tracks of a recording line up when mixed.
+///
+/// Packets are handed to a background writer thread through a bounded queue.
+/// If the writer falls too far behind, packets are dropped rather than
+/// holding up the receive path.
+///
+/// Only Opus voice is recorded.
+@interface MKAudioRecorder : NSObject
+
+/// Initializes a recorder that writes its tracks to the given directory.
+/// Each track is named after the session of the user it belongs to.
+///
+/// @param  path  The directory to write tracks to. It must already exist.
+- (id) initWithDirectory:(NSString *)path;
+
+/// Starts recording. The recorder must also be registered with MKAudio
+/// by calling -[MKAudio setRecorder:].
+- (BOOL) start;
+
+/// Stops recording, and finishes and closes all tracks.
+- (void) stop;
+
+/// Returns whether the recorder is currently recording.
+- (BOOL) isRecording;
+
+/// Returns the number of packets that were dropped because the writer
+/// thread could not keep up.
+- (NSUInteger) droppedPackets;
+
+/// Queues a received voice packet for writing. Called by MKAudio.
+/// The packet's view must cover the flags byte followed by the voice payload.
+- (void) recordVoicePacket:(struct _MKVoicePacket *)packet forSession:(NSUInteger)session sequence:(NSUInteger)seq type:(MKUDPMessageType)msgType;
+
+@end
@@ -12,6 +12,8 @@
 @class MKCryptState;
 @class MKCertificate;
 
+struct _MKVoicePacket;
+
 typedef enum {
     UDPVoiceCELTAlphaMessage = 0,
     UDPPingMessage,
@@ -420,6 +422,16 @@ typedef enum {
 /// @param data  A raw Mumble voice packet.
 - (void) sendVoiceData:(NSData *)data;
 
+/// Send a pooled voice packet to the remote server.
+/// This is the allocation-free counterpart of sendVoiceData:. The
+/// connection takes over the caller's reference to the packet.
+///
+/// Unlike sendVoiceData:, this must only be called from one thread at a
+/// time. MKAudio calls it from its audio input thread.
+///
+/// @param packet  A voice packet whose view covers a raw Mumble voice packet.
+- (void) sendVoicePacket:(struct _MKVoicePacket *)packet;
+
 ///------------------------
 /// @name Codec Information
 ///------------------------
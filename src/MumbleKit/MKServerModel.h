@@ -590,6 +590,35 @@
 /// Get whether or not the certificate chain is verified by the system's root CAs.
 - (BOOL) serverCertificatesTrusted;
 
+///------------------------------
+/// @name Voice target operations
+///------------------------------
+
+/// Registers a voice target with the server. Once registered, a target can
+/// be switched to with setVoiceTarget: as often as needed, without sending
+/// its definition again. Registering a target again replaces it.
+///
+/// @param  target    The target's slot, between 1 and 30.
+/// @param  users     An NSArray of MKUser objects (or nil) to whisper to.
+/// @param  channels  An NSArray of MKChannel objects (or nil) to shout to.
+/// @param  links     Whether to include the channels linked to each channel.
+/// @param  children  Whether to include the subchannels of each channel.
+/// @param  group     If not nil, only members of this group in each channel
+///                   are included.
+- (void) registerVoiceTarget:(NSUInteger)target toUsers:(NSArray *)users andChannels:(NSArray *)channels includeLinks:(BOOL)links includeChildren:(BOOL)children group:(NSString *)group;
+
+/// Removes a voice target from the server.
+///
+/// @param  target  The target's slot, between 1 and 30.
+- (void) unregisterVoiceTarget:(NSUInteger)target;
+
+/// Switches where our voice goes on this server. The switch takes effect
+/// with the next voice packet, and doesn't involve the server. Other
+/// connections sharing the audio subsystem keep their own targets.
+///
+/// @param  target  A registered target's slot, or 0 to talk normally.
+- (void) setVoiceTarget:(NSUInteger)target;
+
 ///-----------------------------
 /// @name Mute/deafen operations
 ///-----------------------------
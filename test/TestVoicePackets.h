@@ -0,0 +1,9 @@
+#import <Foundation/Foundation.h>
+
+#define TEST_VOICE_SAMPLE_RATE  48000
+#define TEST_VOICE_FRAME_SIZE   (TEST_VOICE_SAMPLE_RATE / 100)
+
+// Returns count Mumble voice packets (flags byte, header and payload), each
+// holding one 10ms Opus frame of a two-tone signal. The last packet is a
+// terminator. Returns fewer packets if encoding fails.
+NSArray *TestEncodeVoicePackets(NSUInteger count);
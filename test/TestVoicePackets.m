@@ -0,0 +1,43 @@
+#import <MumbleKit/MKConnection.h>
+#import "TestVoicePackets.h"
+#import "MKPacketDataStream.h"
+
+#include <opus.h>
+#include <math.h>
+
+NSArray *TestEncodeVoicePackets(NSUInteger count) {
+    NSMutableArray *packets = [NSMutableArray arrayWithCapacity:count];
+    OpusEncoder *enc = opus_encoder_create(TEST_VOICE_SAMPLE_RATE, 1, OPUS_APPLICATION_VOIP, NULL);
+    opus_encoder_ctl(enc, OPUS_SET_VBR(0));
+    opus_encoder_ctl(enc, OPUS_SET_BITRATE(40000));
+
+    short pcm[TEST_VOICE_FRAME_SIZE];
+    unsigned char encbuf[512];
+    unsigned char data[1024];
+    NSUInteger i, j;
+
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < TEST_VOICE_FRAME_SIZE; j++) {
+            double t = (double)(i * TEST_VOICE_FRAME_SIZE + j) / TEST_VOICE_SAMPLE_RATE;
+            pcm[j] = (short)(8000.0 * sin(2.0 * M_PI * 220.0 * t) + 2000.0 * sin(2.0 * M_PI * 1375.0 * t));
+        }
+        int len = opus_encode(enc, pcm, TEST_VOICE_FRAME_SIZE, encbuf, sizeof(encbuf));
+        if (len <= 0) {
+            NSLog(@"TestEncodeVoicePackets: opus_encode failed (%i)", len);
+            break;
+        }
+
+        data[0] = (unsigned char)(UDPVoiceOpusMessage << 5);
+        MKPacketDataStream *pds = [[MKPacketDataStream alloc] initWithBuffer:(data+1) length:1023];
+        uint64_t header = (uint64_t)len;
+        if (i == count-1)
+            header |= (1 << 13);
+        [pds addVarint:header];
+        [pds appendBytes:encbuf length:(NSUInteger)len];
+        [packets addObject:[NSData dataWithBytes:data length:[pds size] + 1]];
+        [pds release];
+    }
+
+    opus_encoder_destroy(enc);
+    return packets;
+}
@@ -0,0 +1,76 @@
+#import <Foundation/Foundation.h>
+#import <MumbleKit/MKConnection.h>
+#import "MKAudioOutputSpeech.h"
+#import "MKAudioDecodeScheduler.h"
+#import "TestVoicePackets.h"
+
+#define BENCH_PACKETS       100
+
+// Measures decode throughput of MKAudioDecodeScheduler for a varying number
+// of talkers and cores.
+//
+// Each talker is fed one second worth of 10ms Opus packets, and all talkers
+// are then decoded in 10ms cycles, the same way MKAudioOutput's decode thread
+// does it. Throughput is reported in seconds of decoded audio per wall-clock
+// second.
+
+static double RunBenchmark(NSArray *packets, NSUInteger ntalkers, NSUInteger nworkers, NSUInteger *lateCycles) {
+    NSMutableArray *talkers = [NSMutableArray arrayWithCapacity:ntalkers];
+    NSUInteger i, seq;
+
+    for (i = 0; i < ntalkers; i++) {
+        MKAudioOutputSpeech *ous = [[MKAudioOutputSpeech alloc] initWithSession:i sampleRate:TEST_VOICE_SAMPLE_RATE messageType:UDPVoiceOpusMessage];
+        for (seq = 0; seq < [packets count]; seq++) {
+            [ous addFrame:[packets objectAtIndex:seq] forSequence:seq];
+        }
+        [talkers addObject:ous];
+        [ous release];
+    }
+
+    MKAudioDecodeScheduler *scheduler = [[MKAudioDecodeScheduler alloc] initWithNumberOfWorkers:nworkers];
+
+    NSUInteger cycles = 0;
+    NSDate *start = [NSDate date];
+    for (;;) {
+        [scheduler decodeTalkers:talkers untilBuffered:TEST_VOICE_FRAME_SIZE withinNanoseconds:10 * NSEC_PER_MSEC];
+
+        BOOL alive = NO;
+        for (MKAudioOutputSpeech *ous in talkers) {
+            alive |= [ous needSamples:TEST_VOICE_FRAME_SIZE];
+            [ous consumeSamples];
+        }
+        cycles++;
+        if (!alive || cycles > 4 * BENCH_PACKETS)
+            break;
+    }
+    NSTimeInterval elapsed = -[start timeIntervalSinceNow];
+
+    *lateCycles = [scheduler lateCycles];
+    [scheduler release];
+
+    double audioSeconds = (double)(ntalkers * [packets count]) / 100.0;
+    return audioSeconds / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+
+    NSArray *packets = TestEncodeVoicePackets(BENCH_PACKETS);
+    NSUInteger talkerCounts[] = { 1, 4, 16, 32, 64, 128 };
+    NSUInteger ncpu = [[NSProcessInfo processInfo] activeProcessorCount];
+    NSUInteger t, c;
+
+    printf("talkers  cores  audio-s/s  late\n");
+    for (t = 0; t < sizeof(talkerCounts)/sizeof(talkerCounts[0]); t++) {
+        for (c = 1; c <= MIN(ncpu, 8); c *= 2) {
+            NSAutoreleasePool *iterPool = [[NSAutoreleasePool alloc] init];
+            NSUInteger late = 0;
+            double throughput = RunBenchmark(packets, talkerCounts[t], c, &late);
+            printf("%7lu  %5lu  %9.1f  %4lu\n", (unsigned long)talkerCounts[t], (unsigned long)c, throughput, (unsigned long)late);
+            [iterPool release];
+        }
+    }
+
+    [pool release];
+    return 0;
+}
@@ -0,0 +1,86 @@
+#import <Foundation/Foundation.h>
+#import <MumbleKit/MKConnection.h>
+#import "MKAudioOutputSpeech.h"
+#import "MKVoicePacket.h"
+#import "TestVoicePackets.h"
+
+#define TEST_PACKETS       200
+
+// Feeds a talker's jitter buffer reordered, duplicate and late voice
+// packets, and checks that every one of them ends up back in the packet
+// pool once the talker is done with it.
+
+// Hands a packet to the talker the way MKAudioOutput does, and drops our
+// own reference.
+static void AddPacket(MKAudioOutputSpeech *ous, NSArray *packets, NSUInteger seq) {
+    NSData *data = [packets objectAtIndex:seq];
+    MKVoicePacket *packet = MKVoicePacketCreateWithBytes([data bytes], [data length]);
+    if (packet == NULL)
+        return;
+    [ous addPacket:packet forSequence:seq];
+    MKVoicePacketRelease(packet);
+}
+
+// Runs a single 10ms decode and mix cycle. Returns NO once the talker is done.
+static BOOL RunCycle(MKAudioOutputSpeech *ous) {
+    if ([ous tryBeginDecode]) {
+        [ous decodeUntilBuffered:TEST_VOICE_FRAME_SIZE];
+        [ous endDecode];
+    }
+    BOOL alive = [ous needSamples:TEST_VOICE_FRAME_SIZE];
+    [ous consumeSamples];
+    return alive;
+}
+
+int main(int argc, char *argv[]) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    NSArray *packets = TestEncodeVoicePackets(TEST_PACKETS);
+    NSUInteger seq, cycles;
+    int ret = 0;
+
+    if ([packets count] != TEST_PACKETS) {
+        [pool release];
+        return 1;
+    }
+
+    NSUInteger before = MKVoicePacketPoolOutstandingCount();
+    MKAudioOutputSpeech *ous = [[MKAudioOutputSpeech alloc] initWithSession:1 sampleRate:TEST_VOICE_SAMPLE_RATE messageType:UDPVoiceOpusMessage];
+
+    // Pairs swapped around.
+    for (seq = 0; seq < 40; seq += 2) {
+        AddPacket(ous, packets, seq+1);
+        AddPacket(ous, packets, seq);
+    }
+    for (cycles = 0; cycles < 30; cycles++)
+        RunCycle(ous);
+
+    // The jitter buffer has played past these, so they are dropped.
+    for (seq = 0; seq < 20; seq++)
+        AddPacket(ous, packets, seq);
+
+    // Duplicates, with every seventh packet missing.
+    for (seq = 40; seq < TEST_PACKETS; seq++) {
+        if (seq % 7 == 0)
+            continue;
+        AddPacket(ous, packets, seq);
+        AddPacket(ous, packets, seq);
+    }
+    for (cycles = 0; cycles < 4 * TEST_PACKETS; cycles++) {
+        if (!RunCycle(ous))
+            break;
+    }
+
+    [ous release];
+    NSUInteger after = MKVoicePacketPoolOutstandingCount();
+
+    printf("outstanding packets before: %lu, after: %lu\n", (unsigned long)before, (unsigned long)after);
+    if (after != before) {
+        printf("FAIL: voice packets were not returned to the pool\n");
+        ret = 1;
+    } else {
+        printf("OK\n");
+    }
+
+    [pool release];
+    return ret;
+}
@@ -0,0 +1,180 @@
+#import <Foundation/Foundation.h>
+#import <MumbleKit/MKAudio.h>
+#import <MumbleKit/MKConnection.h>
+#import "MKAudioInput.h"
+#import "MKHeadlessAudioDevice.h"
+#import "MKVoicePacket.h"
+#import "MKCryptState.h"
+
+#include <objc/runtime.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <math.h>
+#include <stdatomic.h>
+
+#define TEST_SAMPLE_RATE   48000
+#define TEST_FRAME_SIZE    (TEST_SAMPLE_RATE / 100)
+#define TEST_WARMUP        50
+#define TEST_FRAMES        1000
+
+// Checks that sending voice does not allocate once the packet pool has
+// warmed up.
+//
+// It feeds captured audio to a real MKAudioInput, which encodes it and hands
+// each packet to MKConnection's sendVoicePacket:. The connection never talks
+// to a server. Instead, it is made ready for voice over UDP by hand, with a
+// crypt state of its own and one end of a socket pair as its UDP socket, so
+// every packet is encrypted and sent. This thread also plays the connection
+// thread's part and drains its voice queue, and reads the packets back off
+// the other end. Every heap allocation made on this thread in the meantime
+// is counted through malloc_logger, so an allocation that is freed again
+// right away still shows up.
+
+// From libmalloc. It is called for every allocation and free in the process.
+typedef void (malloc_logger_t)(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3, uintptr_t result, uint32_t num_hot_frames_to_skip);
+extern malloc_logger_t *malloc_logger;
+
+#define TEST_MALLOC_LOG_TYPE_ALLOCATE  2
+
+static _Thread_local BOOL TestCounting = NO;
+static _Atomic NSUInteger TestAllocations = 0;
+
+static void TestMallocLogger(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3, uintptr_t result, uint32_t num_hot_frames_to_skip) {
+    if (TestCounting && (type & TEST_MALLOC_LOG_TYPE_ALLOCATE))
+        atomic_fetch_add_explicit(&TestAllocations, 1, memory_order_relaxed);
+}
+
+// Opus is only picked when the server asks for it.
+@interface TestConnection : MKConnection
+@end
+
+@implementation TestConnection
+- (BOOL) shouldUseOpus {
+    return YES;
+}
+@end
+
+// MKConnection's connection thread normally calls this.
+@interface MKConnection (Test)
+- (void) _drainVoiceQueue;
+@end
+
+// The connection's state is private, so it is set through the runtime.
+static BOOL SetIvar(MKConnection *conn, const char *name, const void *value, size_t size) {
+    Ivar ivar = class_getInstanceVariable([MKConnection class], name);
+    if (ivar == NULL) {
+        printf("FAIL: MKConnection has no %s\n", name);
+        return NO;
+    }
+    memcpy((char *)conn + ivar_getOffset(ivar), value, size);
+    return YES;
+}
+
+static BOOL MakeReadyForVoice(MKConnection *conn, MKCryptState *crypt, CFSocketRef sock) {
+    BOOL yes = YES, no = NO;
+    return SetIvar(conn, "_crypt", &crypt, sizeof(crypt))
+        && SetIvar(conn, "_udpSock", &sock, sizeof(sock))
+        && SetIvar(conn, "_udpAvailable", &yes, sizeof(yes))
+        && SetIvar(conn, "_forceTCP", &no, sizeof(no))
+        && SetIvar(conn, "_readyVoice", &yes, sizeof(yes))
+        && SetIvar(conn, "_connectionEstablished", &yes, sizeof(yes));
+}
+
+// Returns the number of datagrams that came out of the other end.
+static NSUInteger SendFrames(MKAudioInput *input, MKConnection *conn, int peer, short *pcm, NSUInteger nframes) {
+    unsigned char buf[MK_VOICE_PACKET_MAX_SIZE + 4];
+    NSUInteger i, received = 0;
+    for (i = 0; i < nframes; i++) {
+        [input addMicrophoneDataWithBuffer:pcm amount:TEST_FRAME_SIZE];
+        [conn _drainVoiceQueue];
+        while (recv(peer, buf, sizeof(buf), 0) > 0)
+            received++;
+    }
+    return received;
+}
+
+int main(int argc, char *argv[]) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    int ret = 0;
+    NSUInteger i;
+
+    short pcm[TEST_FRAME_SIZE];
+    for (i = 0; i < TEST_FRAME_SIZE; i++) {
+        pcm[i] = (short)(8000.0 * sin(2.0 * M_PI * 440.0 * (double)i / TEST_SAMPLE_RATE));
+    }
+
+    MKAudioSettings settings;
+    memset(&settings, 0, sizeof(MKAudioSettings));
+    settings.codec = MKCodecFormatOpus;
+    settings.transmitType = MKTransmitTypeContinuous;
+    settings.quality = 40000;
+    settings.audioPerPacket = 1;
+    settings.enableHeadlessAudio = YES;
+    settings.headlessClock = MKAudioHeadlessClockManual;
+
+    MKHeadlessAudioDevice *device = [[MKHeadlessAudioDevice alloc] initWithSettings:&settings];
+    MKAudioInput *input = [[MKAudioInput alloc] initWithDevice:device andSettings:&settings];
+    MKConnection *conn = [[TestConnection alloc] init];
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) != 0) {
+        printf("FAIL: unable to create socket pair\n");
+        return 1;
+    }
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    CFSocketRef sock = CFSocketCreateWithNative(kCFAllocatorDefault, fds[0], kCFSocketNoCallBack, NULL, NULL);
+    MKCryptState *crypt = [[MKCryptState alloc] init];
+    [crypt generateKey];
+    if (sock == NULL || ![crypt valid] || !MakeReadyForVoice(conn, crypt, sock)) {
+        printf("FAIL: unable to make the connection ready for voice\n");
+        return 1;
+    }
+    [input setConnectionsForAudio:[NSArray arrayWithObject:conn]];
+
+    SendFrames(input, conn, fds[1], pcm, TEST_WARMUP);
+
+    NSUInteger poolBefore = MKVoicePacketPoolAllocationCount();
+    malloc_logger = TestMallocLogger;
+    TestCounting = YES;
+
+    NSUInteger sent = SendFrames(input, conn, fds[1], pcm, TEST_FRAMES);
+
+    TestCounting = NO;
+    malloc_logger = NULL;
+    NSUInteger poolAfter = MKVoicePacketPoolAllocationCount();
+    NSUInteger heap = atomic_load(&TestAllocations);
+
+    printf("datagrams sent: %lu\n", (unsigned long)sent);
+    printf("pool allocations per frame: %.3f\n", (double)(poolAfter - poolBefore) / TEST_FRAMES);
+    printf("heap allocations per frame: %.3f\n", (double)heap / TEST_FRAMES);
+
+    if (sent < TEST_FRAMES) {
+        printf("FAIL: not every frame was sent\n");
+        ret = 1;
+    } else if (poolAfter != poolBefore || heap != 0) {
+        printf("FAIL: sending voice allocates in steady state\n");
+        ret = 1;
+    } else {
+        printf("OK\n");
+    }
+
+    [input setConnectionsForAudio:nil];
+    [input release];
+
+    // The connection thread never ran, so it doesn't own these.
+    MKCryptState *noCrypt = nil;
+    CFSocketRef noSock = NULL;
+    SetIvar(conn, "_crypt", &noCrypt, sizeof(noCrypt));
+    SetIvar(conn, "_udpSock", &noSock, sizeof(noSock));
+    [conn release];
+    [crypt release];
+    CFSocketInvalidate(sock);
+    CFRelease(sock);
+    close(fds[1]);
+    [device release];
+
+    [pool release];
+    return ret;
+}